@@ -0,0 +1,164 @@
+// Checks of the libwordfreq C ABI against the naive reference counter. Build
+// with wordfreq.cpp and the same WORDFREQ_HAVE_* flags, for example:
+//   g++ -std=c++17 -O2 -pthread api_test.cpp wordfreq.cpp -o api_test
+// and run with optional text files to count as well as the built-in sample.
+#include "wordfreq.h"
+#include "wordfreq_internal.h"
+
+static int failures = 0;
+
+// Function to report a failed check
+void fail(const std::string &what) {
+  std::cerr << "FAIL: " << what << std::endl;
+  failures++;
+}
+
+// Function to compare a table with the reference counts of text
+void check_table(const wf_table *table, const std::unordered_map<std::string, int> &expected,
+                 const std::string &what) {
+  uint64_t total = 0;
+  for (const auto &pair : expected) {
+    uint64_t count = wf_table_count(table, pair.first.data(), pair.first.size());
+    if (count != (uint64_t)pair.second) {
+      fail(what + ": \"" + pair.first + "\" counted " + std::to_string(count) + ", expected " +
+           std::to_string(pair.second));
+      return;
+    }
+    total += pair.second;
+  }
+  if (wf_table_size(table) != expected.size()) {
+    fail(what + ": " + std::to_string(wf_table_size(table)) + " distinct words, expected " +
+         std::to_string(expected.size()));
+  } else if (wf_table_total(table) != total) {
+    fail(what + ": total " + std::to_string(wf_table_total(table)) + ", expected " + std::to_string(total));
+  }
+}
+
+// Function to count text as one buffer and as iovec lists cut at several
+// places, including inside words and UTF-8 sequences
+void check_text(const wf_engine *engine, const std::string &text, const std::string &what) {
+  std::unordered_map<std::string, int> expected = count_words_reference(text);
+
+  wf_table *table = wf_table_new();
+  if (wf_count_buffer(engine, text.data(), text.size(), table) != 0) {
+    fail(what + ": wf_count_buffer failed");
+  } else {
+    check_table(table, expected, what + " buffer");
+  }
+  wf_table_free(table);
+
+  // Two segments split at a range of offsets, then many short segments
+  std::vector<size_t> cuts;
+  for (size_t cut = 0; cut <= text.size(); cut += std::max<size_t>(1, text.size() / 16)) {
+    cuts.push_back(cut);
+  }
+  for (size_t cut : cuts) {
+    struct iovec iov[2] = {{(void *)text.data(), cut}, {(void *)(text.data() + cut), text.size() - cut}};
+    table = wf_table_new();
+    if (wf_count_iovec(engine, iov, 2, table) != 0) {
+      fail(what + ": wf_count_iovec failed");
+    } else {
+      check_table(table, expected, what + " iovec cut at " + std::to_string(cut));
+    }
+    wf_table_free(table);
+  }
+
+  std::vector<struct iovec> pieces;
+  for (size_t start = 0, length = 1; start < text.size(); start += length, length = length % 5 + 1) {
+    pieces.push_back({(void *)(text.data() + start), std::min(length, text.size() - start)});
+  }
+  table = wf_table_new();
+  if (wf_count_iovec(engine, pieces.data(), (int)pieces.size(), table) != 0) {
+    fail(what + ": wf_count_iovec failed");
+  } else {
+    check_table(table, expected, what + " short segments");
+  }
+  wf_table_free(table);
+}
+
+// Function to save a table, load it back and compare the two
+void check_round_trip(const wf_engine *engine, const std::string &text) {
+  std::string path = "/tmp/wordfreq_api_test." + std::to_string(getpid()) + ".wfct";
+  wf_table *table = wf_table_new();
+  if (wf_count_buffer(engine, text.data(), text.size(), table) != 0 || wf_table_save(table, path.c_str()) != 0) {
+    fail("could not count and save " + path);
+    wf_table_free(table);
+    return;
+  }
+  wf_table *loaded = wf_table_load(path.c_str());
+  unlink(path.c_str());
+  if (loaded == nullptr) {
+    fail("could not load " + path);
+    wf_table_free(table);
+    return;
+  }
+  check_table(loaded, count_words_reference(text), "loaded table");
+
+  std::vector<wf_entry> saved_top(10), loaded_top(10);
+  size_t saved_size = wf_table_top(table, saved_top.size(), saved_top.data());
+  size_t loaded_size = wf_table_top(loaded, loaded_top.size(), loaded_top.data());
+  bool same = saved_size == loaded_size;
+  for (size_t i = 0; same && i < saved_size; i++) {
+    same = saved_top[i].count == loaded_top[i].count &&
+           std::string_view(saved_top[i].word, saved_top[i].length) ==
+               std::string_view(loaded_top[i].word, loaded_top[i].length);
+  }
+  if (!same) {
+    fail("top words differ after a save and load");
+  }
+  if (wf_table_load("/nonexistent/table.wfct") != nullptr) {
+    fail("loading a missing table succeeded");
+  } else if (strstr(wf_last_error(), "/nonexistent/table.wfct") == nullptr) {
+    fail(std::string("wf_last_error does not name the missing table: ") + wf_last_error());
+  }
+  wf_table_free(loaded);
+  wf_table_free(table);
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::pair<std::string, std::string>> texts;
+  texts.push_back({"sample", "The quick brown fox -- jumps over the LAZY dog; the dog sleeps.\n"
+                             "Caf\xc3\xa9 na\xc3\xafve \xc3\x89T\xc3\x89 \xd0\x9c\xd0\xbe\xd1\x81\xd0\xba\xd0\xb2\xd0\xb0 "
+                             "\xe6\x9d\xb1\xe4\xba\xac don't stop, 42 times\xff\xfe bytes\n"});
+  texts.push_back({"empty", ""});
+  for (int i = 1; i < argc; i++) {
+    std::string content;
+    if (!read_input_file(argv[i], content)) {
+      std::cerr << "Error opening file: " << argv[i] << std::endl;
+      return 1;
+    }
+    texts.push_back({argv[i], content});
+  }
+
+  const char *backends[] = {"local-map", "interned", "sharded", "lockfree", "art"};
+  for (int backend = WF_BACKEND_LOCAL_MAP; backend <= WF_BACKEND_ART; backend++) {
+    for (int threads : {1, 3}) {
+      wf_options options;
+      wf_options_init(&options);
+      options.backend = backend;
+      options.threads = threads;
+      options.hot_cache_entries = backend == WF_BACKEND_LOCAL_MAP ? 64 : 0;
+      wf_engine *engine = wf_engine_new(&options);
+      if (engine == nullptr) {
+        fail("wf_engine_new failed");
+        continue;
+      }
+      for (const auto &text : texts) {
+        check_text(engine, text.second,
+                   text.first + " (" + backends[backend] + ", " + std::to_string(threads) + " threads)");
+      }
+      wf_engine_free(engine);
+    }
+  }
+
+  wf_engine *engine = wf_engine_new(nullptr);
+  check_round_trip(engine, texts.size() > 2 ? texts.back().second : texts[0].second);
+  wf_engine_free(engine);
+
+  if (failures > 0) {
+    std::cerr << failures << " API checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All API checks passed" << std::endl;
+  return 0;
+}
@@ -1,158 +1,203 @@
-#include <algorithm>
-#include <chrono>
-#include <cstring>
-#include <fcntl.h>
-#include <fstream>
-#include <iostream>
-#include <pthread.h>
-#include <string>
-#include <sys/resource.h> 
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <unistd.h>
-#include <unordered_map>
-#include <vector>
-#include <mutex>
-#include <iomanip>
-
-// Define constants
-const int MAX_THREADS = 4;
-
-// Mutex to protect access to the shared data structure (word count map)
-std::mutex word_count_mutex;
-
-// Struct for passing additional arguments to threads
-struct ThreadData {
-  std::string *text_part;
-  std::unordered_map<std::string, int> *word_count_map;
-};
+#include <charconv>
+#include <csignal>
+#include <dirent.h>
+#include <glob.h>
+#include <random>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-// Function to count word frequencies in a portion of the file (multi-threaded)
-void *count_words(void *arg) {
-  auto *data = (ThreadData *)arg;
-  std::string *text_part = data->text_part;
-  auto *word_count_map = data->word_count_map;
-  std::string word;
+#include "wordfreq_internal.h"
 
-  std::unordered_map<std::string, int> local_word_count;  // Local map for each thread
+// ---------------------------------------------------------------------------
+// Counting named files for the commands. The library reports failures through
+// last_error(); these print it and go on with empty counts, so one unreadable
+// input does not stop a comparison or a benchmark.
+// ---------------------------------------------------------------------------
 
-  for (size_t i = 0; i < text_part->length(); i++) {
-    char c = (*text_part)[i];
-    if (isalpha(c)) {
-      word += tolower(c); // Accumulate characters to form a word
-    } else if (!word.empty()) {
-      local_word_count[word]++;
-      word.clear(); // Reset word after storing
+// Single-threaded version for comparison
+template <typename Policy>
+std::unordered_map<std::string, int> process_file_single_thread(const std::string &filename,
+                                                                PhaseTimes *times = nullptr) {
+  std::string file_content;
+  {
+    PhaseTimer timer(times, PHASE_READ);
+    if (!read_input_file(filename, file_content)) {
+      std::cerr << last_error() << std::endl;
+      return {};
     }
   }
 
-  if (!word.empty()) { // Add the last word if it exists
-    local_word_count[word]++;
+  std::unordered_map<std::string, int> word_count_map;
+  if (times == nullptr) {
+    for_each_word<Policy>(file_content.data(), file_content.size(), [&](const std::string &word) { word_count_map[word]++; });
+    return word_count_map;
   }
 
-  // Update the shared word count map with thread-local results
-  std::lock_guard<std::mutex> lock(word_count_mutex);  // Lock to prevent data race
-  for (const auto &pair : local_word_count) {
-    (*word_count_map)[pair.first] += pair.second;
+  // Profile mode: tokenize into a batch, then count from it (see count_part)
+  std::string batch;
+  std::vector<size_t> word_ends;
+  {
+    PhaseTimer timer(times, PHASE_TOKENIZE);
+    for_each_word<Policy>(file_content.data(), file_content.size(), [&](const std::string &word) {
+      batch += word;
+      word_ends.push_back(batch.size());
+    });
   }
-
-  return nullptr;
+  PhaseTimer timer(times, PHASE_COUNT);
+  std::string word;
+  size_t start = 0;
+  for (size_t end : word_ends) {
+    word.assign(batch, start, end - start);
+    word_count_map[word]++;
+    start = end;
+  }
+  return word_count_map;
 }
 
-// Single-threaded version for comparison
-std::unordered_map<std::string, int> process_file_single_thread(const std::string &filename) {
-  std::ifstream file(filename);
-  if (!file.is_open()) {
-    std::cerr << "Error opening file: " << filename << std::endl;
-    return {};
+// Function to dispatch a runtime policy to the matching instantiation
+std::unordered_map<std::string, int> process_file_single_thread(const std::string &filename,
+                                                                WordPolicy policy = WordPolicy::LETTERS,
+                                                                PhaseTimes *times = nullptr) {
+  switch (policy) {
+  case WordPolicy::ASCII:
+    return process_file_single_thread<AsciiLettersPolicy>(filename, times);
+  case WordPolicy::ALNUM:
+    return process_file_single_thread<AlnumPolicy>(filename, times);
+  case WordPolicy::APOSTROPHE:
+    return process_file_single_thread<ApostrophePolicy>(filename, times);
+  default:
+    return process_file_single_thread<LettersPolicy>(filename, times);
   }
+}
 
-  std::string file_content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-  std::unordered_map<std::string, int> word_count_map;
-  std::string word;
-  for (size_t i = 0; i < file_content.length(); i++) {
-    char c = file_content[i];
-    if (isalpha(c)) {
-      word += tolower(c); // Accumulate characters to form a word
-    } else if (!word.empty()) {
-      word_count_map[word]++;
-      word.clear(); // Reset word after storing
+// Multi-threaded version
+template <typename Policy>
+std::unordered_map<std::string, int> process_file_multi_thread(const std::string &filename,
+                                                               CountBackend backend = CountBackend::LOCAL_MAP,
+                                                               size_t hot_cache_entries = 0,
+                                                               HotCacheStats *hot_cache_stats = nullptr,
+                                                               PhaseProfile *profile = nullptr,
+                                                               std::vector<struct rusage> *thread_usage = nullptr,
+                                                               int num_threads = MAX_THREADS, size_t chunk_size = 0) {
+  std::string file_content;
+  {
+    PhaseTimer timer(profile != nullptr ? &profile->total : nullptr, PHASE_READ);
+    if (!read_input_file(filename, file_content)) {
+      std::cerr << last_error() << std::endl;
+      return {};
     }
   }
+  std::unordered_map<std::string, int> word_count_map;
+  if (!count_text_multi_thread<Policy>(file_content, word_count_map, backend, hot_cache_entries, hot_cache_stats,
+                                       profile, thread_usage, num_threads, chunk_size)) {
+    std::cerr << last_error() << std::endl;
+    return {};
+  }
   return word_count_map;
 }
 
-// Multi-threaded version
-std::unordered_map<std::string, int> process_file_multi_thread(const std::string &filename) {
-  std::ifstream file(filename);
-  if (!file.is_open()) {
-    std::cerr << "Error opening file: " << filename << std::endl;
-    return {};
+// Function to dispatch a runtime policy to the matching instantiation
+std::unordered_map<std::string, int> process_file_multi_thread(const std::string &filename,
+                                                               WordPolicy policy = WordPolicy::LETTERS,
+                                                               CountBackend backend = CountBackend::LOCAL_MAP,
+                                                               size_t hot_cache_entries = 0,
+                                                               HotCacheStats *hot_cache_stats = nullptr,
+                                                               PhaseProfile *profile = nullptr,
+                                                               std::vector<struct rusage> *thread_usage = nullptr,
+                                                               int num_threads = MAX_THREADS, size_t chunk_size = 0) {
+  switch (policy) {
+  case WordPolicy::ASCII:
+    return process_file_multi_thread<AsciiLettersPolicy>(filename, backend, hot_cache_entries, hot_cache_stats,
+                                                         profile, thread_usage, num_threads, chunk_size);
+  case WordPolicy::ALNUM:
+    return process_file_multi_thread<AlnumPolicy>(filename, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                  thread_usage, num_threads, chunk_size);
+  case WordPolicy::APOSTROPHE:
+    return process_file_multi_thread<ApostrophePolicy>(filename, backend, hot_cache_entries, hot_cache_stats,
+                                                       profile, thread_usage, num_threads, chunk_size);
+  default:
+    return process_file_multi_thread<LettersPolicy>(filename, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                    thread_usage, num_threads, chunk_size);
   }
+}
 
-  std::string file_content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-  std::vector<std::string> parts(MAX_THREADS);
-
-  for (int i = 0; i < MAX_THREADS; i++) {
-    parts[i] = file_content.substr(i * file_content.length() / MAX_THREADS,
-                                   file_content.length() / MAX_THREADS);
+// Function to count the n-grams of a file on num_threads threads
+template <typename Policy = LettersPolicy>
+NgramCounts count_file_ngrams(const std::string &filename, int n, int num_threads = MAX_THREADS) {
+  NgramCounts result;
+  result.n = n;
+  std::string file_content;
+  if (!read_input_file(filename, file_content)) {
+    std::cerr << last_error() << std::endl;
+    return result;
   }
 
-  pthread_t threads[MAX_THREADS];
-  std::unordered_map<std::string, int> total_word_count;
-  ThreadData thread_data[MAX_THREADS];
+  std::vector<std::string_view> parts = split_at_whitespace(file_content, num_threads);
 
-  for (int i = 0; i < MAX_THREADS; i++) {
-    thread_data[i] = {&parts[i], &total_word_count};
-    int thread_result = pthread_create(&threads[i], NULL, count_words, (void *)&thread_data[i]);
-    if (thread_result != 0) {
-      std::cerr << "Error creating thread: " << thread_result << std::endl;
-      exit(1);
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<NgramThreadData> thread_data(num_threads);
+  std::mutex merge_mutex;
+  std::vector<ChunkEdges> edges(num_threads);
+  std::vector<bool> started(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    thread_data[i] = {parts[i], n, result.words.get(), &result.counts, &merge_mutex, &edges[i]};
+    started[i] = pthread_create(&threads[i], NULL, count_ngrams<Policy>, (void *)&thread_data[i]) == 0;
+    if (!started[i]) {
+      count_ngrams<Policy>(&thread_data[i]); // Out of threads: count this part here instead
     }
   }
-
-  for (int i = 0; i < MAX_THREADS; i++) {
-    pthread_join(threads[i], nullptr);
-  }
-
-  return total_word_count;
-}
-
-// Function to extract the top N most frequent words
-std::vector<std::pair<std::string, int>> get_top_frequent_words(const std::unordered_map<std::string, int> &word_count_map, int top_n = 10) {
-  std::vector<std::pair<std::string, int>> word_freqs(word_count_map.begin(), word_count_map.end());
-
-  // Sort by frequency in descending order
-  std::sort(word_freqs.begin(), word_freqs.end(), [](const auto &a, const auto &b) {
-    return a.second > b.second;
-  });
-
-  if (word_freqs.size() > top_n) {
-    word_freqs.resize(top_n); // Keep only the top N words
+  for (int i = 0; i < num_threads; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], nullptr);
+    }
   }
 
-  return word_freqs;
+  count_crossing_ngrams(edges, n, result.counts);
+  return result;
 }
 
 // Function to compare single-threaded vs multi-threaded performance
-void compare_performance(const std::vector<std::string> &files) {
+void compare_performance(const std::vector<std::string> &files, int ngram = 1,
+                         CountBackend backend = CountBackend::LOCAL_MAP, size_t hot_cache_entries = 0) {
   for (const std::string &file : files) {
     std::cout << "Processing file: " << file << "\n";
 
+    // Per-phase times are only collected for word counts
+    bool profile = phase_profiling && ngram == 1;
+    PhaseProfile single_profile{file, "single"}, multi_profile{file, "multi"};
+
     // Single-threaded
     auto start_single = std::chrono::high_resolution_clock::now();
-    auto word_count_single = process_file_single_thread(file);
+    std::unordered_map<std::string, int> word_count_single;
+    {
+      TraceSpan span("file", "single " + file);
+      word_count_single =
+          ngram > 1 ? ngram_string_counts(count_file_ngrams(file, ngram, 1))
+                    : process_file_single_thread(file, WordPolicy::LETTERS, profile ? &single_profile.total : nullptr);
+    }
     auto end_single = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed_single = end_single - start_single;
     std::cout << "  Single-threaded time: " << elapsed_single.count() << " seconds\n";
 
     // Multi-threaded
     auto start_multi = std::chrono::high_resolution_clock::now();
-    auto word_count_multi = process_file_multi_thread(file);
+    HotCacheStats cache_stats;
+    std::unordered_map<std::string, int> word_count_multi;
+    {
+      TraceSpan span("file", "multi " + file);
+      word_count_multi =
+          ngram > 1 ? ngram_string_counts(count_file_ngrams(file, ngram))
+                    : process_file_multi_thread(file, WordPolicy::LETTERS, backend, hot_cache_entries, &cache_stats,
+                                                profile ? &multi_profile : nullptr);
+    }
     auto end_multi = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed_multi = end_multi - start_multi;
     std::cout << "  Multi-threaded time:  " << elapsed_multi.count() << " seconds\n";
+    if (cache_stats.lookups > 0) {
+      std::cout << "  Hot-word cache hits:  " << cache_stats.hits << " of " << cache_stats.lookups << " words ("
+                << (int)(1000.0 * cache_stats.hits / cache_stats.lookups) / 10.0 << "%)\n";
+    }
 
     // Check results (word counts should match)
     if (word_count_single == word_count_multi) {
@@ -160,18 +205,75 @@ void compare_performance(const std::vector<std::string> &files) {
     } else {
       std::cout << "  Results mismatch for file: " << file << "\n";
     }
+    if (profile) {
+      phase_profiles.push_back(std::move(single_profile));
+      phase_profiles.push_back(std::move(multi_profile));
+    }
+  }
+}
+
+// Record a forked child sends back for its file; small enough that each
+// write to the shared pipe is atomic
+struct ChildReport {
+  uint32_t index; // Position of the file in the list
+  int count;
+  PhaseTimes times;
+  uint32_t threads;                // Entries filled in thread_cpu (0 when not measured)
+  double thread_cpu[MAX_THREADS];  // User + system seconds of each counting thread
+};
+
+// Resource usage of one forked child, as collected by wait4
+struct ChildUsage {
+  bool reaped = false;
+  struct rusage usage;
+  uint32_t threads = 0;
+  double thread_cpu[MAX_THREADS];
+};
+
+// Function to convert a timeval to seconds
+double timeval_seconds(const struct timeval &tv) { return tv.tv_sec + tv.tv_usec / 1e6; }
+
+// Function to print the per-file resource table for the forked children
+void print_child_usage(const std::vector<std::string> &files, const std::vector<ChildUsage> &children) {
+  std::cout << "\nPer-child resource usage:\n";
+  std::cout << "  " << std::left << std::setw(24) << "File" << std::right << std::setw(9) << "User s" << std::setw(9)
+            << "Sys s" << std::setw(12) << "Max RSS KB" << std::setw(10) << "Vol CS" << std::setw(10) << "Invol CS"
+            << std::setw(10) << "Minflt" << std::setw(8) << "Majflt" << "  Thread CPU s\n";
+  for (size_t i = 0; i < files.size(); i++) {
+    const ChildUsage &child = children[i];
+    if (!child.reaped) {
+      continue;
+    }
+    const struct rusage &usage = child.usage;
+    std::ostringstream user, sys, threads;
+    user << std::fixed << std::setprecision(3) << timeval_seconds(usage.ru_utime);
+    sys << std::fixed << std::setprecision(3) << timeval_seconds(usage.ru_stime);
+    threads << std::fixed << std::setprecision(3);
+    for (uint32_t t = 0; t < child.threads; t++) {
+      threads << (t > 0 ? " " : "") << child.thread_cpu[t];
+    }
+    std::cout << "  " << std::left << std::setw(24) << files[i] << std::right << std::setw(9) << user.str()
+              << std::setw(9) << sys.str() << std::setw(12) << usage.ru_maxrss << std::setw(10) << usage.ru_nvcsw
+              << std::setw(10) << usage.ru_nivcsw << std::setw(10) << usage.ru_minflt << std::setw(8)
+              << usage.ru_majflt << "  " << (child.threads > 0 ? threads.str() : "-") << "\n";
   }
+  std::cout << std::left;
 }
 
 // Function to process files using multiprocessing (fork) and print file name with word count
-void process_files_with_fork(const std::vector<std::string> &files) {
+void process_files_with_fork(const std::vector<std::string> &files, int ngram = 1,
+                             CountBackend backend = CountBackend::LOCAL_MAP) {
   int fd[2];
   if (pipe(fd) == -1) {
     std::cerr << "Error creating pipe" << std::endl;
     exit(1);
   }
 
-  for (const std::string &file : files) {
+  std::vector<pid_t> pids;
+  for (size_t index = 0; index < files.size(); index++) {
+    const std::string &file = files[index];
+    // Anything still buffered would otherwise be printed again by the child
+    std::cout.flush();
     pid_t pid = fork();
     if (pid == -1) {
       std::cerr << "Error in fork" << std::endl;
@@ -180,45 +282,101 @@ void process_files_with_fork(const std::vector<std::string> &files) {
 
     if (pid == 0) { // Child process
       close(fd[0]); // Close reading end
-      std::unordered_map<std::string, int> word_count = process_file_multi_thread(file);
-      int count = word_count.size();
-
-      // Send count to parent process
-      if (write(fd[1], &count, sizeof(count)) == -1) {
-        std::cerr << "Error writing to pipe" << std::endl;
-        exit(1);
+      if (tracing_enabled) {
+        trace_after_fork("child " + file);
+      }
+      std::optional<TraceSpan> file_span(std::in_place, "file", "fork " + file);
+      std::vector<std::pair<std::string, int>> top_words;
+      ChildReport report{(uint32_t)index, 0, {}, 0, {}};
+      bool profile = phase_profiling && ngram == 1;
+      PhaseProfile file_profile;
+      PhaseTimes *times = profile ? &file_profile.total : nullptr;
+      if (ngram > 1) {
+        NgramCounts ngrams = count_file_ngrams(file, ngram);
+        report.count = ngrams.counts.size();
+        top_words = get_top_ngrams(ngrams);
+      } else {
+        std::vector<struct rusage> thread_usage;
+        std::unordered_map<std::string, int> word_count = process_file_multi_thread(
+            file, WordPolicy::LETTERS, backend, 0, nullptr, profile ? &file_profile : nullptr, &thread_usage);
+        report.count = word_count.size();
+        report.threads = thread_usage.size();
+        for (size_t t = 0; t < thread_usage.size(); t++) {
+          report.thread_cpu[t] = timeval_seconds(thread_usage[t].ru_utime) + timeval_seconds(thread_usage[t].ru_stime);
+        }
+        top_words = get_top_frequent_words(word_count, 10, times);
       }
 
       // Display the most frequent words for the file
-      std::vector<std::pair<std::string, int>> top_words = get_top_frequent_words(word_count);
-      std::cout << "\n  Most frequent words in file " << file << ":\n";
-      for (const auto &pair : top_words) {
-        std::cout << "    " << std::left << std::setw(15) << pair.first << ": " << pair.second << "\n";
+      {
+        PhaseTimer timer(times, PHASE_OUTPUT);
+        std::cout << "\n  Most frequent words in file " << file << ":\n";
+        for (const auto &pair : top_words) {
+          std::cout << "    " << std::left << std::setw(15) << pair.first << ": " << pair.second << "\n";
+        }
+        std::cout.flush();
+      }
+
+      // Send count (and phase times) to parent process
+      report.times = file_profile.total;
+      file_span.reset();
+      if (tracing_enabled) {
+        write_trace_fragment();
+      }
+      if (write(fd[1], &report, sizeof(report)) == -1) {
+        std::cerr << "Error writing to pipe" << std::endl;
+        exit(1);
       }
 
       close(fd[1]);
       exit(0);
     }
+    pids.push_back(pid);
+    trace_children.push_back(pid);
   }
 
   close(fd[1]); // Close writing end
-  int total_count = 0, word_count;
+  int total_count = 0;
+  std::vector<ChildUsage> children(files.size());
 
   for (size_t i = 0; i < files.size(); i++) {
-    if (read(fd[0], &word_count, sizeof(word_count)) == -1) {
+    // Children finish in any order; the report says which file it belongs to
+    ChildReport report;
+    if (read(fd[0], &report, sizeof(report)) != (ssize_t)sizeof(report) || report.index >= files.size()) {
       std::cerr << "Error reading from pipe" << std::endl;
       exit(1);
     }
     // Print the file name and word count for each file
-    std::cout << "\n  Word count in file: " << files[i] << ": " << word_count << "\n";
-    total_count += word_count;
-
-    // Wait for child processes to finish
-    wait(nullptr);
+    std::cout << "\n  Word count in file: " << files[report.index] << ": " << report.count << "\n";
+    total_count += report.count;
+    if (phase_profiling && ngram == 1) {
+      phase_profiles.push_back({files[report.index], "fork", report.times, {}});
+    }
+    ChildUsage &child = children[report.index];
+    child.threads = std::min<uint32_t>(report.threads, MAX_THREADS);
+    std::copy(report.thread_cpu, report.thread_cpu + child.threads, child.thread_cpu);
   }
   close(fd[0]);
 
+  // Reap the children, keeping each one's own resource usage
+  for (size_t i = 0; i < pids.size(); i++) {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid == -1) {
+      std::cerr << "Error waiting for child process" << std::endl;
+      break;
+    }
+    auto it = std::find(pids.begin(), pids.end(), pid);
+    if (it != pids.end()) {
+      ChildUsage &child = children[it - pids.begin()];
+      child.reaped = true;
+      child.usage = usage;
+    }
+  }
+
   std::cout << "\nTotal word count across all files: " << total_count << std::endl;
+  print_child_usage(files, children);
 }
 
 // Function to measure and print resource usage (CPU time, memory usage)
@@ -229,30 +387,2378 @@ void print_resource_usage() {
     std::cout << "  CPU time used (user):    " << usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 << " seconds\n";
     std::cout << "  CPU time used (system):  " << usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 << " seconds\n";
     std::cout << "  Maximum memory usage:    " << usage.ru_maxrss << " kilobytes\n";
+    if (arena_stats.allocations > 0) {
+      std::cout << "  Arena allocations:       " << arena_stats.allocations << " (" << arena_stats.bytes / 1024
+                << " kilobytes) served from " << arena_stats.upstream_allocations << " heap blocks ("
+                << arena_stats.upstream_bytes / 1024 << " kilobytes)\n";
+    }
   } else {
     std::cerr << "Error retrieving resource usage data\n";
   }
+
+  // RUSAGE_SELF excludes forked children; report the reaped ones separately
+  struct rusage children;
+  if (getrusage(RUSAGE_CHILDREN, &children) == 0 &&
+      (children.ru_utime.tv_sec || children.ru_utime.tv_usec || children.ru_stime.tv_sec ||
+       children.ru_stime.tv_usec || children.ru_maxrss)) {
+    std::cout << "  Children CPU (user):     " << timeval_seconds(children.ru_utime) << " seconds\n";
+    std::cout << "  Children CPU (system):   " << timeval_seconds(children.ru_stime) << " seconds\n";
+    std::cout << "  Largest child memory:    " << children.ru_maxrss << " kilobytes\n";
+    std::cout << "  Children page faults:    " << children.ru_minflt << " minor, " << children.ru_majflt
+              << " major\n";
+    std::cout << "  Children context sw.:    " << children.ru_nvcsw << " voluntary, " << children.ru_nivcsw
+              << " involuntary\n";
+  }
 }
 
-int main() {
-  // List of files to process
-  std::vector<std::string> files = {
-      "calgary/bib",   "calgary/paper1", "calgary/paper2", "calgary/progc",
-      "calgary/progl", "calgary/progp",  "calgary/trans"};
+// ---------------------------------------------------------------------------
+// Input enumeration: files, recursive directories, glob patterns and
+// NUL-separated file lists. Directories are walked with getdents64 relative
+// to an open directory fd, which avoids per-entry path lookups and stat calls
+// on large trees.
+// ---------------------------------------------------------------------------
 
-  // Compare single-threaded vs multi-threaded performance
-  compare_performance(files);
+// Layout of the records returned by getdents64 (not exported by glibc headers)
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
-  // Measure time for multiprocessing + multithreading
-  auto start = std::chrono::high_resolution_clock::now();
-  process_files_with_fork(files);
-  auto end = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed_seconds = end - start;
+// Function to emit every regular file below an open directory. Symlinked
+// directories are not followed, so cycles cannot occur. Subdirectories wait on
+// an explicit stack and each directory is closed before the next is opened, so
+// deep trees need neither deep recursion nor a descriptor per level. Takes
+// ownership of dir_fd.
+void walk_directory(int dir_fd, const std::string &dir_path, const std::function<void(std::string)> &emit) {
+  const size_t buffer_size = 64 * 1024;
+  std::unique_ptr<char[]> buffer(new char[buffer_size]); // One buffer for the whole walk
+  std::vector<std::string> pending;
+  std::string current = dir_path;
+  while (dir_fd != -1) {
+    long n;
+    while ((n = syscall(SYS_getdents64, dir_fd, buffer.get(), buffer_size)) > 0) {
+      for (long pos = 0; pos < n;) {
+        auto *entry = (LinuxDirent64 *)(buffer.get() + pos);
+        pos += entry->d_reclen;
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+          continue;
+        }
 
-  std::cout << "\nElapsed time for multiprocessing + multithreading: " << elapsed_seconds.count() << " seconds\n";
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+          // Some filesystems leave d_type empty; symlinks count as their target file
+          struct stat st;
+          int flags = type == DT_UNKNOWN ? AT_SYMLINK_NOFOLLOW : 0;
+          if (fstatat(dir_fd, name, &st, flags) == -1) {
+            continue;
+          }
+          type = S_ISREG(st.st_mode) ? DT_REG : (S_ISDIR(st.st_mode) && type == DT_UNKNOWN) ? DT_DIR : DT_UNKNOWN;
+        }
 
-  // Print resource usage (CPU and memory)
+        std::string path = current == "/" ? "/" + std::string(name) : current + "/" + name;
+        if (type == DT_REG) {
+          emit(path);
+        } else if (type == DT_DIR) {
+          pending.push_back(std::move(path));
+        }
+      }
+    }
+    if (n == -1) {
+      std::cerr << "Error reading directory " << current << ": " << strerror(errno) << std::endl;
+    }
+    close(dir_fd);
+
+    dir_fd = -1;
+    while (dir_fd == -1 && !pending.empty()) {
+      current = std::move(pending.back());
+      pending.pop_back();
+      dir_fd = open(current.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (dir_fd == -1) {
+        std::cerr << "Error opening directory " << current << ": " << strerror(errno) << std::endl;
+      }
+    }
+  }
+}
+
+// Function to expand one input spec (file, directory or glob pattern) into files
+void expand_input(const std::string &spec, const std::function<void(std::string)> &emit) {
+  struct stat st;
+  if (stat(spec.c_str(), &st) == 0) {
+    if (S_ISDIR(st.st_mode)) {
+      int dir_fd = open(spec.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir_fd == -1) {
+        std::cerr << "Error opening directory " << spec << ": " << strerror(errno) << std::endl;
+        return;
+      }
+      std::string path = spec.size() > 1 && spec.back() == '/' ? spec.substr(0, spec.size() - 1) : spec;
+      walk_directory(dir_fd, path, emit);
+    } else {
+      emit(spec);
+    }
+    return;
+  }
+
+  if (spec.find_first_of("*?[{") != std::string::npos) {
+    glob_t matches;
+    if (glob(spec.c_str(), GLOB_BRACE | GLOB_TILDE, nullptr, &matches) == 0) {
+      for (size_t i = 0; i < matches.gl_pathc; i++) {
+        if (stat(matches.gl_pathv[i], &st) == 0) {
+          expand_input(matches.gl_pathv[i], emit);
+        }
+      }
+    } else {
+      std::cerr << "No files match pattern: " << spec << std::endl;
+    }
+    globfree(&matches);
+    return;
+  }
+  std::cerr << "Error opening file: " << spec << std::endl;
+}
+
+// Function to read a NUL-separated list of input specs ("-" for stdin)
+void read_input_list(const std::string &list_path, const std::function<void(std::string)> &emit) {
+  int fd = list_path == "-" ? STDIN_FILENO : open(list_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    std::cerr << "Error opening file list " << list_path << ": " << strerror(errno) << std::endl;
+    return;
+  }
+  char buffer[64 * 1024];
+  std::string spec;
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n == -1 && errno == EINTR)) {
+    for (ssize_t i = 0; i < n; i++) {
+      if (buffer[i] != '\0') {
+        spec += buffer[i];
+      } else if (!spec.empty()) {
+        expand_input(spec, emit);
+        spec.clear();
+      }
+    }
+  }
+  if (!spec.empty()) {
+    expand_input(spec, emit);
+  }
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+}
+
+// Where input files come from: specs given on the command line and/or a list file
+struct InputSpec {
+  std::vector<std::string> paths;
+  std::string files0_from; // NUL-separated list, "-" for stdin
+};
+
+// Function to enumerate every input file, in order
+void enumerate_inputs(const InputSpec &spec, const std::function<void(std::string)> &emit) {
+  for (const std::string &path : spec.paths) {
+    expand_input(path, emit);
+  }
+  if (!spec.files0_from.empty()) {
+    read_input_list(spec.files0_from, emit);
+  }
+}
+
+// Function to expand input specs into a complete file list
+std::vector<std::string> collect_inputs(const InputSpec &spec) {
+  std::vector<std::string> files;
+  enumerate_inputs(spec, [&](std::string path) { files.push_back(std::move(path)); });
+  return files;
+}
+
+// Options that take a value, across all commands. Their values are never
+// mistaken for inputs, even when they start with "--".
+const char *const VALUE_OPTIONS[] = {
+    "--backend", "--baseline", "--chunk-size", "--chunk-sizes", "--engines", "--filter", "--hot-cache",
+    "--hw-counters", "--json", "--line-length", "--mem-budget", "--min-time", "--ngram", "--non-ascii",
+    "--output", "--profile", "--repeat", "--seed", "--show", "--size", "--spill-dir",
+    "--synthetic", "--threads", "--top", "--trace", "--vocab", "--word-length", "--words", "--zipf",
+};
+
+// Function to tell whether an option takes a value
+bool option_takes_value(const std::string &name) {
+  for (const char *option : VALUE_OPTIONS) {
+    if (name == option) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Function to split command arguments into input specs and the remaining
+// options. Options in VALUE_OPTIONS (and --files0-from) consume the next
+// argument, or take it after '='; other options stand alone, and everything not
+// starting with "--" is an input.
+InputSpec parse_inputs(const std::vector<std::string> &args, std::vector<std::string> &options) {
+  InputSpec spec;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i].compare(0, 2, "--") != 0) {
+      spec.paths.push_back(args[i]);
+      continue;
+    }
+    size_t equals = args[i].find('=');
+    std::string name = args[i].substr(0, equals);
+    bool has_value = equals != std::string::npos || i + 1 < args.size();
+    if (name == "--files0-from" && has_value) {
+      spec.files0_from = equals != std::string::npos ? args[i].substr(equals + 1) : args[++i];
+    } else if (option_takes_value(name) && has_value) {
+      options.push_back(name);
+      options.push_back(equals != std::string::npos ? args[i].substr(equals + 1) : args[++i]);
+    } else {
+      options.push_back(args[i]); // Unknown or missing its value; the command reports it
+    }
+  }
+  return spec;
+}
+
+// Largest --threads or client count a command accepts
+const int MAX_COMMAND_THREADS = 1024;
+
+// Function to parse a whole command-line number that must lie in
+// [min_value, max_value]; anything else is reported on stderr, after which the
+// caller prints its usage
+template <typename T>
+bool parse_number(const std::string &text, T &value, T min_value = 1, T max_value = std::numeric_limits<T>::max()) {
+  T parsed{};
+  auto result = std::from_chars(text.data(), text.data() + text.size(), parsed);
+  if (result.ec != std::errc() || result.ptr != text.data() + text.size() ||
+      !(parsed >= min_value && parsed <= max_value)) { // Written this way to reject NaN
+    std::cerr << "Invalid number: " << text << std::endl;
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+// Command: save <table> [inputs...]
+int run_save_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  if (args.empty()) {
+    std::cerr << "Usage: save <table> [inputs...]\n";
+    return 1;
+  }
+  std::vector<std::string> files = default_files;
+  if (args.size() > 1) {
+    files = collect_inputs(InputSpec{std::vector<std::string>(args.begin() + 1, args.end()), ""});
+  }
+  std::unordered_map<std::string, int> merged;
+  for (const std::string &file : files) {
+    for (const auto &pair : process_file_multi_thread(file)) {
+      merged[pair.first] += pair.second;
+    }
+  }
+  if (!save_count_table(args[0], merged)) {
+    std::cerr << last_error() << std::endl;
+    return 1;
+  }
+  std::cout << "Saved " << merged.size() << " words to " << args[0] << "\n";
+  return 0;
+}
+
+// Command: merge <output> <tables...>
+int run_merge_command(const std::vector<std::string> &args) {
+  if (args.size() < 2) {
+    std::cerr << "Usage: merge <output> <tables...>\n";
+    return 1;
+  }
+  std::vector<std::unique_ptr<CountTableView>> views;
+  std::vector<const CountTableView *> tables;
+  for (size_t i = 1; i < args.size(); i++) {
+    views.emplace_back(new CountTableView);
+    if (!views.back()->open(args[i])) {
+      std::cerr << last_error() << std::endl;
+      return 1;
+    }
+    tables.push_back(views.back().get());
+  }
+
+  std::string temp_path = args[0] + ".tmp";
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    std::cerr << "Error creating " << temp_path << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  CountTableWriter writer;
+  bool ok = writer.open(fd, true);
+  if (ok) {
+    merge_count_tables(tables, [&](std::string_view word, uint64_t count) { writer.add(word, count); });
+    ok = writer.finish();
+  }
+  close(fd);
+  if (ok && rename(temp_path.c_str(), args[0].c_str()) == -1) {
+    set_last_error("Error renaming " + temp_path + ": " + strerror(errno));
+    ok = false;
+  }
+  if (!ok) {
+    std::cerr << last_error() << std::endl;
+    unlink(temp_path.c_str());
+    return 1;
+  }
+  std::cout << "Merged " << tables.size() << " tables into " << args[0] << " (" << writer.num_words << " words)\n";
+  return 0;
+}
+
+// Command: dump <table> [limit]
+int run_dump_command(const std::vector<std::string> &args) {
+  uint64_t limit = 10;
+  if (args.empty() || (args.size() > 1 && !parse_number(args[1], limit))) {
+    std::cerr << "Usage: dump <table> [limit]\n";
+    return 1;
+  }
+  CountTableView table;
+  if (!table.open(args[0])) {
+    std::cerr << last_error() << std::endl;
+    return 1;
+  }
+  limit = std::min<uint64_t>(limit, table.size());
+  std::cout << "Table " << args[0] << ": " << table.size() << " words, " << table.header.total_count
+            << " occurrences, version " << table.header.version << "\n";
+  for (uint64_t r = 0; r < limit; r++) {
+    uint64_t i = table.rank ? table.ranked(r) : r;
+    std::cout << "  " << std::left << std::setw(15) << table.word(i) << ": " << table.count(i) << "\n";
+  }
+  return 0;
+}
+
+// Command: external [--mem-budget MB] [--spill-dir DIR] [--output TABLE] [--threads N] [--top N] inputs...
+int run_external_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  ExternalOptions options;
+  const char *tmpdir = getenv("TMPDIR");
+  options.spill_dir = tmpdir ? tmpdir : "/tmp";
+  std::vector<std::string> flags;
+  InputSpec spec = parse_inputs(args, flags);
+  for (size_t i = 0; i < flags.size(); i++) {
+    bool has_value = i + 1 < flags.size();
+    uint64_t budget_mb;
+    if (flags[i] == "--mem-budget" && has_value && parse_number(flags[i + 1], budget_mb, 1UL, UINT64_MAX >> 20)) {
+      options.memory_budget = budget_mb << 20;
+      i++;
+    } else if (flags[i] == "--spill-dir" && has_value) {
+      options.spill_dir = flags[++i];
+    } else if (flags[i] == "--output" && has_value) {
+      options.output = flags[++i];
+    } else if (flags[i] == "--threads" && has_value &&
+               parse_number(flags[i + 1], options.threads, 1, MAX_COMMAND_THREADS)) {
+      i++;
+    } else if (flags[i] == "--top" && has_value && parse_number(flags[i + 1], options.top_n)) {
+      i++;
+    } else {
+      std::cerr << "Usage: external [--mem-budget MB] [--spill-dir DIR] [--output TABLE] [--threads N] [--top N] "
+                   "[--files0-from LIST|-] inputs...\n";
+      return 1;
+    }
+  }
+  std::vector<std::string> files = default_files;
+  if (!spec.paths.empty() || !spec.files0_from.empty()) {
+    files = collect_inputs(spec);
+  }
+
+  TopWords top(options.top_n);
+  ExternalStats stats;
+  auto start = std::chrono::steady_clock::now();
+  if (!count_files_external(files, options, top, stats)) {
+    std::cerr << last_error() << std::endl;
+    return 1;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::cout << "  Spilled " << stats.runs << " runs (" << stats.bytes_spilled / (1 << 20) << " MB)";
+  if (stats.merge_passes > 0) {
+    std::cout << ", merged in " << stats.merge_passes + 1 << " passes";
+  }
+  std::cout << "\n";
+  std::cout << "\n  Most frequent words across " << files.size() << " files (" << stats.distinct_words << " distinct):\n";
+  for (const auto &pair : top.sorted()) {
+    std::cout << "    " << std::left << std::setw(15) << pair.first << ": " << pair.second << "\n";
+  }
+  std::cout << "\nElapsed time for external-memory count: " << elapsed.count() << " seconds\n";
   print_resource_usage();
+  return 0;
+}
+
+// Shared state for the streaming count command
+struct StreamingCount {
+  StringQueue *paths;
+  std::unordered_map<std::string, uint64_t> *word_count_map;
+  std::mutex *merge_mutex;
+  WordPolicy policy;
+  NgramCounts *ngrams; // Count n-grams (within each file) instead of words when set
+  uint64_t files = 0;
+  uint64_t bytes = 0;
+};
+
+// Thread body: count whole files taken from the path queue, merging once at the end
+void *count_files_worker(void *arg) {
+  auto *data = (StreamingCount *)arg;
+  ScopedArena arena;
+  ArenaCountMap local_word_count(arena.resource());
+  std::unique_ptr<LocalInterner> interner(data->ngrams ? new LocalInterner(*data->ngrams->words, arena.resource())
+                                                       : nullptr);
+  NgramCountMap local_ngrams(arena.resource());
+  std::string path;
+  while (data->paths->pop(path)) {
+    std::string file_content;
+    if (!read_input_file(path, file_content)) {
+      std::cerr << last_error() << std::endl;
+      continue;
+    }
+    if (data->ngrams) {
+      ChunkEdges edges; // A whole file has no neighbours to stitch to
+      count_chunk_ngrams(data->policy, file_content.data(), file_content.size(), data->ngrams->n, *interner,
+                         local_ngrams, edges);
+    } else {
+      for_each_word(data->policy, file_content.data(), file_content.size(),
+                    [&](const std::string &word) { local_word_count.add(word); });
+    }
+    data->files++;
+    data->bytes += file_content.size();
+  }
+
+  std::lock_guard<std::mutex> lock(*data->merge_mutex);
+  local_word_count.merge_into(*data->word_count_map);
+  for (const auto &pair : local_ngrams) {
+    data->ngrams->counts[pair.first] += pair.second;
+  }
+  return nullptr;
+}
+
+// Command: complete <prefix> [--top N] [inputs...]
+// Counts the inputs into a radix tree and lists the most frequent words that
+// start with the prefix.
+int run_complete_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  std::vector<std::string> options;
+  InputSpec spec = parse_inputs(args, options);
+  size_t top_n = 10;
+  if (options.size() == 2 && options[0] == "--top" && parse_number(options[1], top_n)) {
+    options.clear();
+  }
+  if (spec.paths.empty() || !options.empty()) {
+    std::cerr << "Usage: complete <prefix> [--top N] [inputs...]\n";
+    return 1;
+  }
+  std::string prefix = spec.paths[0];
+  spec.paths.erase(spec.paths.begin());
+  if (spec.paths.empty() && spec.files0_from.empty()) {
+    spec.paths = default_files;
+  }
+
+  std::vector<std::string> errors;
+  ArtCounts counts = count_files_art(collect_inputs(spec), &errors);
+  for (const std::string &error : errors) {
+    std::cerr << error << std::endl;
+  }
+  std::cout << "Words starting with \"" << prefix << "\" (" << counts.size() << " distinct words counted):\n";
+  for (const auto &pair : counts.complete(prefix, top_n)) {
+    std::cout << "    " << std::left << std::setw(15) << pair.first << ": " << pair.second << "\n";
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Synthetic corpus generator. Words are drawn from a Zipf distribution over a
+// generated vocabulary using Vose's alias method, so each word costs O(1).
+// The output is cut into fixed blocks. Each block has its own seed and is
+// written at its offset with pwrite, so the text depends on the options and
+// the seed but never on the number of threads.
+// ---------------------------------------------------------------------------
+
+// Small, fast generator (SplitMix64); plenty for synthetic text
+struct SplitMix64 {
+  uint64_t state;
+
+  uint64_t next() {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  // Uniform in [0, 1)
+  double uniform() { return (next() >> 11) * 0x1.0p-53; }
+
+  // Uniform in [0, n)
+  uint64_t below(uint64_t n) { return (uint64_t)(((unsigned __int128)next() * n) >> 64); }
+};
+
+// Table for drawing indices in proportion to their weights in O(1) (Vose's
+// method). A draw takes one random number and touches one 8-byte entry.
+class AliasTable {
+public:
+  explicit AliasTable(const std::vector<double> &weights) : entries_(weights.size()) {
+    size_t n = weights.size();
+    double total = 0;
+    for (double weight : weights) {
+      total += weight;
+    }
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+      scaled[i] = weights[i] * n / total;
+      (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    for (size_t i = 0; i < n; i++) {
+      entries_[i] = {UINT32_MAX, (uint32_t)i};
+    }
+    while (!small.empty() && !large.empty()) {
+      uint32_t under = small.back();
+      uint32_t over = large.back();
+      small.pop_back();
+      entries_[under] = {(uint32_t)(scaled[under] * 4294967296.0), over};
+      scaled[over] -= 1 - scaled[under];
+      if (scaled[over] < 1) {
+        large.pop_back();
+        small.push_back(over);
+      }
+    }
+    // Whatever is left keeps its own column; its weight is 1 up to rounding
+  }
+
+  // The high half of the number picks the column, the low half decides
+  // between the column and its alias
+  uint32_t sample(SplitMix64 &rng) const {
+    uint64_t random = rng.next();
+    const Entry &entry = entries_[((random >> 32) * entries_.size()) >> 32];
+    return (uint32_t)random < entry.threshold ? (uint32_t)(&entry - entries_.data()) : entry.alias;
+  }
+
+private:
+  struct Entry {
+    uint32_t threshold; // Keep the column if the low 32 random bits are below this
+    uint32_t alias;
+  };
+  std::vector<Entry> entries_;
+};
+
+struct CorpusOptions {
+  uint64_t size = 100 << 20;  // Bytes of output
+  uint32_t vocabulary = 100000;
+  double zipf = 1.0;          // Exponent s: the word of rank k has weight 1 / k^s
+  double word_length = 5.0;   // Mean letters per word
+  uint32_t line_length = 72;  // Lines break after the first word that reaches this many bytes
+  double non_ascii = 0.0;     // Fraction of the vocabulary spelled with some non-ASCII letters
+  uint64_t seed = 1;
+  int threads = MAX_THREADS;
+};
+
+// Vocabulary stored back to back. Word i starts at pool[words[i] >> 8] and is
+// words[i] & 0xFF bytes long; the pool is padded so any word can be copied
+// with a fixed 32-byte move.
+struct CorpusVocabulary {
+  std::string pool;
+  std::vector<uint64_t> words;
+};
+
+// Function to make options.vocabulary distinct lower-case words, shortest first
+// so that the most frequent ranks get the shortest words, as in natural text
+CorpusVocabulary make_corpus_vocabulary(const CorpusOptions &options) {
+  // Lower-case letters (already case-folded) from Latin-1, Greek, Cyrillic and CJK
+  std::vector<uint32_t> foreign_letters;
+  for (uint32_t c = 0xE0; c <= 0xFE; c++) {
+    if (c != 0xF7) {
+      foreign_letters.push_back(c);
+    }
+  }
+  for (uint32_t c = 0x3B1; c <= 0x3C9; c++) {
+    if (c != 0x3C2) {
+      foreign_letters.push_back(c);
+    }
+  }
+  for (uint32_t c = 0x430; c <= 0x44F; c++) {
+    foreign_letters.push_back(c);
+  }
+  for (uint32_t c = 0x4E00; c < 0x4E40; c++) {
+    foreign_letters.push_back(c);
+  }
+
+  SplitMix64 rng{options.seed};
+  // Word lengths are 1 + Poisson(mean - 1), capped at MAX_WORD_LENGTH
+  const int MAX_WORD_LENGTH = 24;
+  double poisson_limit = std::exp(-std::max(0.0, options.word_length - 1));
+  std::unordered_set<std::string> seen;
+  std::vector<std::string> words;
+  while (words.size() < options.vocabulary) {
+    int length = 1;
+    for (double product = rng.uniform(); product > poisson_limit && length < MAX_WORD_LENGTH; length++) {
+      product *= rng.uniform();
+    }
+    bool foreign = rng.uniform() < options.non_ascii;
+    int forced = rng.below(length); // A non-ASCII word has at least this one non-ASCII letter
+    std::string word;
+    for (int i = 0; i < length; i++) {
+      if (foreign && (i == forced || rng.uniform() < 0.3)) {
+        append_utf8(word, foreign_letters[rng.below(foreign_letters.size())]);
+      } else {
+        word += (char)('a' + rng.below(26));
+      }
+    }
+    // Lengthen duplicates until they are new, which also ends the loop when
+    // short lengths run out of combinations
+    while (!seen.insert(word).second) {
+      word += (char)('a' + rng.below(26));
+    }
+    words.push_back(std::move(word));
+  }
+  std::stable_sort(words.begin(), words.end(),
+                   [](const std::string &a, const std::string &b) { return a.size() < b.size(); });
+
+  CorpusVocabulary vocabulary;
+  for (const std::string &word : words) {
+    vocabulary.words.push_back((uint64_t)vocabulary.pool.size() << 8 | std::min<size_t>(word.size(), 255));
+    vocabulary.pool.append(word, 0, 255);
+  }
+  vocabulary.pool.append(32, ' ');
+  return vocabulary;
+}
+
+const size_t CORPUS_BLOCK_SIZE = 4 << 20;
+
+// Function to fill one block of the corpus. Blocks end in whitespace, padded if
+// the next word does not fit, so no word spans two blocks. out must have 32
+// bytes of room past size.
+void generate_corpus_block(const CorpusVocabulary &vocabulary, const AliasTable &ranks, const CorpusOptions &options,
+                           uint64_t block, char *out, size_t size) {
+  SplitMix64 rng{options.seed ^ ((block + 1) * 0xD1B54A32D192ED03ULL)};
+  const char *pool = vocabulary.pool.data();
+  const uint64_t *words = vocabulary.words.data();
+  size_t pos = 0, line = 0;
+  while (true) {
+    uint64_t word = words[ranks.sample(rng)];
+    size_t length = word & 0xFF;
+    if (pos + length + 1 > size) {
+      break;
+    }
+    if (length <= 32) {
+      memcpy(out + pos, pool + (word >> 8), 32);
+    } else {
+      memcpy(out + pos, pool + (word >> 8), length);
+    }
+    pos += length;
+    line += length + 1;
+    if (line >= options.line_length) {
+      out[pos++] = '\n';
+      line = 0;
+    } else {
+      out[pos++] = ' ';
+    }
+  }
+  memset(out + pos, ' ', size - pos);
+  if (size > 0) {
+    out[size - 1] = '\n';
+  }
+}
+
+// Per-thread arguments for generate_corpus_worker
+struct CorpusWriteData {
+  const CorpusVocabulary *vocabulary;
+  const AliasTable *ranks;
+  const CorpusOptions *options;
+  int fd;
+  std::atomic<uint64_t> *next_block;
+  std::atomic<bool> *failed;
+};
+
+// Thread body: generate blocks claimed from the shared counter and write each at its offset
+void *generate_corpus_worker(void *arg) {
+  auto *data = (CorpusWriteData *)arg;
+  uint64_t num_blocks = (data->options->size + CORPUS_BLOCK_SIZE - 1) / CORPUS_BLOCK_SIZE;
+  std::vector<char> buffer(CORPUS_BLOCK_SIZE + 32);
+  uint64_t block;
+  while (!*data->failed && (block = data->next_block->fetch_add(1)) < num_blocks) {
+    uint64_t offset = block * CORPUS_BLOCK_SIZE;
+    size_t size = std::min<uint64_t>(CORPUS_BLOCK_SIZE, data->options->size - offset);
+    generate_corpus_block(*data->vocabulary, *data->ranks, *data->options, block, buffer.data(), size);
+    for (size_t written = 0; written < size;) {
+      ssize_t n = pwrite(data->fd, buffer.data() + written, size - written, offset + written);
+      if (n <= 0) {
+        *data->failed = true;
+        break;
+      }
+      written += n;
+    }
+  }
+  return nullptr;
+}
+
+// Function to write a synthetic corpus to path
+bool generate_corpus(const std::string &path, const CorpusOptions &options) {
+  CorpusVocabulary vocabulary = make_corpus_vocabulary(options);
+  std::vector<double> weights(options.vocabulary);
+  for (size_t rank = 0; rank < weights.size(); rank++) {
+    weights[rank] = std::pow(rank + 1.0, -options.zipf);
+  }
+  AliasTable ranks(weights);
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1 || ftruncate(fd, options.size) == -1) {
+    std::cerr << "Error creating file: " << path << std::endl;
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+  std::atomic<uint64_t> next_block{0};
+  std::atomic<bool> failed{false};
+  std::vector<pthread_t> threads(options.threads);
+  std::vector<CorpusWriteData> thread_data(options.threads);
+  for (int i = 0; i < options.threads; i++) {
+    thread_data[i] = {&vocabulary, &ranks, &options, fd, &next_block, &failed};
+    if (pthread_create(&threads[i], nullptr, generate_corpus_worker, &thread_data[i]) != 0) {
+      std::cerr << "Error creating thread" << std::endl;
+      exit(1);
+    }
+  }
+  for (int i = 0; i < options.threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  if (close(fd) == -1 || failed) {
+    std::cerr << "Error writing file: " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Command: gen <output> [--size MB] [--vocab N] [--zipf S] [--word-length MEAN] [--line-length N]
+//              [--non-ascii FRACTION] [--seed N] [--threads N]
+// Writes deterministic Zipfian text for scale tests; the same options and seed
+// always give the same bytes.
+int run_gen_command(const std::vector<std::string> &args) {
+  CorpusOptions options;
+  std::string path;
+  bool ok = !args.empty();
+  for (size_t i = 0; ok && i < args.size(); i++) {
+    bool has_value = i + 1 < args.size();
+    uint64_t size_mb = 0;
+    if (args[i] == "--size" && has_value) {
+      ok = parse_number(args[++i], size_mb, 1UL, UINT64_MAX >> 20);
+      options.size = size_mb << 20;
+    } else if (args[i] == "--vocab" && has_value) {
+      ok = parse_number(args[++i], options.vocabulary);
+    } else if (args[i] == "--zipf" && has_value) {
+      ok = parse_number(args[++i], options.zipf, 0.0);
+    } else if (args[i] == "--word-length" && has_value) {
+      ok = parse_number(args[++i], options.word_length, 1.0);
+    } else if (args[i] == "--line-length" && has_value) {
+      ok = parse_number(args[++i], options.line_length);
+    } else if (args[i] == "--non-ascii" && has_value) {
+      ok = parse_number(args[++i], options.non_ascii, 0.0, 1.0);
+    } else if (args[i] == "--seed" && has_value) {
+      ok = parse_number(args[++i], options.seed, 0UL);
+    } else if (args[i] == "--threads" && has_value) {
+      ok = parse_number(args[++i], options.threads, 1, MAX_COMMAND_THREADS);
+    } else if (path.empty() && args[i].rfind("--", 0) != 0) {
+      path = args[i];
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok || path.empty()) {
+    std::cerr << "Usage: gen <output> [--size MB] [--vocab N] [--zipf S] [--word-length MEAN] [--line-length N] "
+                 "[--non-ascii FRACTION] [--seed N] [--threads N]\n";
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (!generate_corpus(path, options)) {
+    return 1;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "Wrote " << (options.size >> 20) << " MB to " << path << " (" << options.vocabulary
+            << " words, zipf " << options.zipf << ") in " << elapsed.count() << " seconds ("
+            << (options.size >> 20) / elapsed.count() << " MB/s)\n";
+  return 0;
+}
+
+// Command: sweep [--threads N] [--chunk-sizes KB,...] [--repeat R] [--backend NAME] [inputs...]
+// Times the multithreaded counter on each file for every thread count up to N
+// and every chunk size (0 = one part per thread), keeping the best of R runs.
+// Each file is read once up front, so only the counting itself is timed.
+// Speedup and efficiency are relative to one thread on one part; the serial
+// fraction is the Karp-Flatt estimate (1/S - 1/p) / (1 - 1/p).
+int run_sweep_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  std::vector<std::string> options;
+  InputSpec spec = parse_inputs(args, options);
+  int max_threads = std::max(2L, sysconf(_SC_NPROCESSORS_ONLN));
+  std::vector<size_t> chunk_sizes = {0, 64, 1024};
+  auto parse_chunk_sizes = [](const std::string &text, std::vector<size_t> &sizes) {
+    sizes.clear();
+    std::istringstream list(text);
+    std::string size;
+    while (std::getline(list, size, ',')) {
+      sizes.push_back(0); // 0 means one part per thread
+      if (!parse_number(size, sizes.back(), 0UL, SIZE_MAX >> 10)) {
+        return false;
+      }
+    }
+    return !sizes.empty();
+  };
+  int repeat = 3;
+  CountBackend backend = CountBackend::LOCAL_MAP;
+  for (size_t i = 0; i < options.size(); i++) {
+    bool has_value = i + 1 < options.size();
+    if (options[i] == "--threads" && has_value && parse_number(options[i + 1], max_threads, 1, MAX_COMMAND_THREADS)) {
+      i++;
+    } else if (options[i] == "--chunk-sizes" && has_value && parse_chunk_sizes(options[i + 1], chunk_sizes)) {
+      i++;
+    } else if (options[i] == "--repeat" && has_value && parse_number(options[i + 1], repeat)) {
+      i++;
+    } else if (options[i] == "--backend" && has_value && parse_count_backend(options[i + 1], backend)) {
+      i++;
+    } else {
+      std::cerr << "Usage: sweep [--threads N] [--chunk-sizes KB,...] [--repeat R] "
+                   "[--backend local|interned|sharded|lockfree|art] [inputs...]\n";
+      return 1;
+    }
+  }
+  if (spec.paths.empty() && spec.files0_from.empty()) {
+    spec.paths = default_files;
+  }
+
+  // Every count up to 16, then powers of two and the maximum itself
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads <= max_threads; threads = threads < 16 ? threads + 1 : threads * 2) {
+    thread_counts.push_back(threads);
+  }
+  if (thread_counts.back() != max_threads) {
+    thread_counts.push_back(max_threads);
+  }
+
+  for (const std::string &file : collect_inputs(spec)) {
+    std::string file_content;
+    if (!read_input_file(file, file_content)) {
+      std::cerr << last_error() << std::endl;
+      continue;
+    }
+    std::unordered_map<std::string, int> baseline;
+    auto best_time = [&](int threads, size_t chunk_kb, bool &matches) {
+      double best = 0;
+      for (int run = 0; run < repeat; run++) {
+        std::unordered_map<std::string, int> word_count;
+        auto start = std::chrono::steady_clock::now();
+        bool counted = count_text_multi_thread<LettersPolicy>(file_content, word_count, backend, 0, nullptr, nullptr,
+                                                              nullptr, threads, chunk_kb << 10);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+        if (!counted) {
+          std::cerr << last_error() << std::endl;
+          matches = false;
+        } else if (baseline.empty()) {
+          baseline = std::move(word_count);
+        } else if (word_count != baseline) {
+          matches = false;
+        }
+      }
+      return best;
+    };
+
+    bool matches = true;
+    double serial_time = best_time(1, 0, matches);
+    std::cout << "\nScaling sweep for file: " << file << " (one thread: " << serial_time << " seconds)\n";
+    std::cout << "  " << std::right << std::setw(8) << "threads" << std::setw(12) << "chunk KB" << std::setw(11)
+              << "seconds" << std::setw(9) << "speedup" << std::setw(12) << "efficiency" << std::setw(13)
+              << "serial frac"
+              << "\n";
+    int best_threads = 1;
+    size_t best_chunk = 0;
+    double best_seconds = serial_time;
+    for (size_t chunk_kb : chunk_sizes) {
+      for (int threads : thread_counts) {
+        double seconds = threads == 1 && chunk_kb == 0 ? serial_time : best_time(threads, chunk_kb, matches);
+        double speedup = serial_time / seconds;
+        std::cout << "  " << std::setw(8) << threads << std::setw(12)
+                  << (chunk_kb > 0 ? std::to_string(chunk_kb) : "per-thread") << std::fixed << std::setprecision(4)
+                  << std::setw(11) << seconds << std::setprecision(2) << std::setw(9) << speedup << std::setw(12)
+                  << speedup / threads;
+        if (threads > 1) {
+          std::cout << std::setprecision(3) << std::setw(13) << (1 / speedup - 1.0 / threads) / (1 - 1.0 / threads);
+        } else {
+          std::cout << std::setw(13) << "-";
+        }
+        std::cout << std::defaultfloat << std::setprecision(6) << "\n";
+        if (seconds < best_seconds) {
+          best_seconds = seconds;
+          best_threads = threads;
+          best_chunk = chunk_kb;
+        }
+      }
+    }
+    std::cout << "  Fastest: " << best_threads << " threads, "
+              << (best_chunk > 0 ? std::to_string(best_chunk) + " KB chunks" : "one part per thread") << " ("
+              << best_seconds << " seconds)\n";
+    if (!matches) {
+      std::cout << "  Results mismatch for file: " << file << "\n";
+    }
+  }
+  std::cout << std::left;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Microbenchmarks for the tokenizer, counting-table, merge and top-K kernels.
+// Each kernel runs on data prepared up front (text, tokenized words, filled
+// tables). The iteration count grows until one run lasts --min-time, and the
+// best of three such runs is reported. Results can be written as JSON, one
+// benchmark per line, and compared against a file from another commit with
+// --baseline.
+// ---------------------------------------------------------------------------
+
+struct Microbenchmark {
+  std::string name;
+  uint64_t bytes;                  // Input bytes per iteration, 0 if not meaningful
+  uint64_t items;                  // Words or entries per iteration
+  std::function<uint64_t()> body;  // Returns a value derived from the work so it cannot be optimized away
+};
+
+struct MicrobenchResult {
+  std::string name;
+  uint64_t iterations;
+  double ns_per_iteration;
+  double bytes_per_second;
+  double items_per_second;
+};
+
+volatile uint64_t microbench_sink;
+
+// Function to time one benchmark
+MicrobenchResult run_microbenchmark(const Microbenchmark &bench, double min_time) {
+  microbench_sink = microbench_sink + bench.body(); // Warm-up
+  uint64_t iterations = 1;
+  double best_ns = 0;
+  for (int round = 0; round < 3;) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+      sum += bench.body();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    microbench_sink = microbench_sink + sum;
+    if (elapsed.count() < min_time) {
+      iterations *= elapsed.count() < min_time / 10 ? 10 : 2;
+      continue;
+    }
+    double ns = elapsed.count() * 1e9 / iterations;
+    best_ns = round++ == 0 ? ns : std::min(best_ns, ns);
+  }
+  return {bench.name, iterations, best_ns, bench.bytes * 1e9 / best_ns, bench.items * 1e9 / best_ns};
+}
+
+// Function to read the ns_per_iteration of each benchmark from a file written by --json
+std::unordered_map<std::string, double> read_microbench_baseline(const std::string &path) {
+  std::unordered_map<std::string, double> baseline;
+  std::ifstream in(path);
+  std::string line;
+  const std::string name_key = "{\"name\": \"", time_key = "\"ns_per_iteration\": ";
+  while (std::getline(in, line)) {
+    size_t name = line.find(name_key);
+    size_t time = line.find(time_key);
+    if (name == std::string::npos || time == std::string::npos) {
+      continue;
+    }
+    name += name_key.size();
+    double ns_per_iteration;
+    const char *number = line.data() + time + time_key.size();
+    if (std::from_chars(number, line.data() + line.size(), ns_per_iteration).ec == std::errc()) {
+      baseline[line.substr(name, line.find('"', name) - name)] = ns_per_iteration;
+    }
+  }
+  return baseline;
+}
+
+// Function to add the benchmarks for one data set to the list
+void add_microbenchmarks(std::vector<Microbenchmark> &benches, const std::string &set, const std::string &text) {
+  // Shared, immutable inputs for the kernels of this data set
+  auto words = std::make_shared<std::vector<std::string>>();
+  for_each_word<LettersPolicy>(text.data(), text.size(), [&](const std::string &word) { words->push_back(word); });
+  auto counts = std::make_shared<std::unordered_map<std::string, int>>();
+  for (const std::string &word : *words) {
+    (*counts)[word]++;
+  }
+  auto text_ptr = std::make_shared<std::string>(text);
+  uint64_t bytes = text.size(), num_words = words->size(), distinct = counts->size();
+
+  // Tokenizers
+  auto tokenize = [&](const char *policy_name, auto policy) {
+    using Policy = decltype(policy);
+    benches.push_back({std::string("tokenize/") + policy_name + "/" + set, bytes, num_words, [text_ptr]() {
+                         uint64_t letters = 0;
+                         for_each_word<Policy>(text_ptr->data(), text_ptr->size(),
+                                               [&](const std::string &word) { letters += word.size(); });
+                         return letters;
+                       }});
+  };
+  tokenize("letters", LettersPolicy());
+  tokenize("ascii", AsciiLettersPolicy());
+  tokenize("alnum", AlnumPolicy());
+  tokenize("apostrophe", ApostrophePolicy());
+
+  // Counting tables, each filled from empty with every word
+  benches.push_back({"table/unordered_map/" + set, 0, num_words, [words]() {
+                       std::unordered_map<std::string, int> table;
+                       for (const std::string &word : *words) {
+                         table[word]++;
+                       }
+                       return (uint64_t)table.size();
+                     }});
+  benches.push_back({"table/arena_map/" + set, 0, num_words, [words]() {
+                       ScopedArena arena;
+                       ArenaCountMap table(arena.resource());
+                       for (const std::string &word : *words) {
+                         table.add(word);
+                       }
+                       return (uint64_t)table.size();
+                     }});
+  benches.push_back({"table/hot_cache+unordered_map/" + set, 0, num_words, [words]() {
+                       std::unordered_map<std::string, int> table;
+                       HotWordCache cache(256);
+                       auto add = [&](const std::string &word, uint64_t count) { table[word] += count; };
+                       for (const std::string &word : *words) {
+                         cache.add(word, add);
+                       }
+                       cache.flush(add);
+                       return (uint64_t)table.size();
+                     }});
+  benches.push_back({"table/interned/" + set, 0, num_words, [words]() {
+                       ConcurrentInterner interner;
+                       LocalInterner local(interner);
+                       std::vector<uint32_t> table;
+                       for (const std::string &word : *words) {
+                         uint32_t id = local.intern(word);
+                         if (id >= table.size()) {
+                           table.resize(std::max<size_t>(id + 1, table.size() * 2));
+                         }
+                         table[id]++;
+                       }
+                       return (uint64_t)interner.size();
+                     }});
+  benches.push_back({"table/sharded/" + set, 0, num_words, [words]() {
+                       ShardedCountMap table;
+                       for (const std::string &word : *words) {
+                         table.add(word);
+                       }
+                       return (uint64_t)table.to_map().size();
+                     }});
+  benches.push_back({"table/lockfree/" + set, 0, num_words, [words]() {
+                       LockFreeCountMap table;
+                       for (const std::string &word : *words) {
+                         table.add(word);
+                       }
+                       return (uint64_t)table.to_map().size();
+                     }});
+  benches.push_back({"table/art/" + set, 0, num_words, [words]() {
+                       ArtCounts table;
+                       for (const std::string &word : *words) {
+                         table.add(word);
+                       }
+                       return (uint64_t)table.size();
+                     }});
+  benches.push_back({"table/arena_art/" + set, 0, num_words, [words]() {
+                       ScopedArena arena;
+                       ArtCounts table(arena.resource());
+                       for (const std::string &word : *words) {
+                         table.add(word);
+                       }
+                       return (uint64_t)table.size();
+                     }});
+
+  // Merge strategies over MAX_THREADS per-thread results of consecutive parts
+  auto part_maps = std::make_shared<std::vector<std::unordered_map<std::string, int>>>(MAX_THREADS);
+  auto interner = std::make_shared<ConcurrentInterner>();
+  auto part_ids = std::make_shared<std::vector<std::vector<uint32_t>>>(MAX_THREADS);
+  for (int part = 0; part < MAX_THREADS; part++) {
+    LocalInterner local(*interner);
+    for (size_t i = num_words * part / MAX_THREADS; i < num_words * (part + 1) / MAX_THREADS; i++) {
+      (*part_maps)[part][(*words)[i]]++;
+      uint32_t id = local.intern((*words)[i]);
+      std::vector<uint32_t> &ids = (*part_ids)[part];
+      if (id >= ids.size()) {
+        ids.resize(std::max<size_t>(id + 1, ids.size() * 2));
+      }
+      ids[id]++;
+    }
+  }
+  uint64_t part_entries = 0;
+  for (const auto &map : *part_maps) {
+    part_entries += map.size();
+  }
+  benches.push_back({"merge/string_maps/" + set, 0, part_entries, [part_maps]() {
+                       std::unordered_map<std::string, int> total;
+                       for (const auto &map : *part_maps) {
+                         for (const auto &pair : map) {
+                           total[pair.first] += pair.second;
+                         }
+                       }
+                       return (uint64_t)total.size();
+                     }});
+  benches.push_back({"merge/id_vectors/" + set, 0, part_entries, [part_ids]() {
+                       std::vector<uint32_t> total;
+                       for (const auto &ids : *part_ids) {
+                         if (total.size() < ids.size()) {
+                           total.resize(ids.size());
+                         }
+                         for (size_t id = 0; id < ids.size(); id++) {
+                           total[id] += ids[id];
+                         }
+                       }
+                       return (uint64_t)total.size();
+                     }});
+  benches.push_back({"merge/id_vectors_to_map/" + set, 0, part_entries, [part_ids, interner]() {
+                       std::vector<uint32_t> total;
+                       for (const auto &ids : *part_ids) {
+                         if (total.size() < ids.size()) {
+                           total.resize(ids.size());
+                         }
+                         for (size_t id = 0; id < ids.size(); id++) {
+                           total[id] += ids[id];
+                         }
+                       }
+                       return (uint64_t)id_counts_to_map(*interner, total).size();
+                     }});
+
+  // Top-K selection over the full table
+  const size_t k = 10;
+  benches.push_back({"topk/full_sort/" + set, 0, distinct, [counts, k]() {
+                       return (uint64_t)get_top_frequent_words(*counts, k).size();
+                     }});
+  benches.push_back({"topk/partial_sort/" + set, 0, distinct, [counts, k]() {
+                       std::vector<std::pair<std::string, int>> entries(counts->begin(), counts->end());
+                       size_t n = std::min(k, entries.size());
+                       std::partial_sort(entries.begin(), entries.begin() + n, entries.end(),
+                                         [](const auto &a, const auto &b) { return a.second > b.second; });
+                       return (uint64_t)n;
+                     }});
+  benches.push_back({"topk/nth_element/" + set, 0, distinct, [counts, k]() {
+                       std::vector<std::pair<std::string_view, int>> entries(counts->begin(), counts->end());
+                       size_t n = std::min(k, entries.size());
+                       auto by_count = [](const auto &a, const auto &b) { return a.second > b.second; };
+                       std::nth_element(entries.begin(), entries.begin() + n, entries.end(), by_count);
+                       std::sort(entries.begin(), entries.begin() + n, by_count);
+                       return (uint64_t)n;
+                     }});
+  benches.push_back({"topk/bounded_heap/" + set, 0, distinct, [counts, k]() {
+                       TopWords top(k);
+                       for (const auto &pair : *counts) {
+                         top.offer(pair.first, pair.second);
+                       }
+                       return (uint64_t)top.sorted().size();
+                     }});
+}
+
+// Command: microbench [--filter TEXT] [--min-time SECONDS] [--synthetic MB] [--json FILE] [--baseline FILE] [inputs...]
+// Runs the kernels over the inputs (calgary by default) concatenated, and over
+// Zipfian text from the generator with and without non-ASCII words.
+int run_microbench_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  std::vector<std::string> options;
+  InputSpec spec = parse_inputs(args, options);
+  std::string filter, json_path, baseline_path;
+  double min_time = 0.1;
+  uint64_t synthetic_mb = 4;
+  for (size_t i = 0; i < options.size(); i++) {
+    bool has_value = i + 1 < options.size();
+    if (options[i] == "--filter" && has_value) {
+      filter = options[++i];
+    } else if (options[i] == "--min-time" && has_value && parse_number(options[i + 1], min_time, 0.001)) {
+      i++;
+    } else if (options[i] == "--synthetic" && has_value &&
+               parse_number(options[i + 1], synthetic_mb, 1UL, UINT64_MAX >> 20)) {
+      i++;
+    } else if (options[i] == "--json" && has_value) {
+      json_path = options[++i];
+    } else if (options[i] == "--baseline" && has_value) {
+      baseline_path = options[++i];
+    } else {
+      std::cerr << "Usage: microbench [--filter TEXT] [--min-time SECONDS] [--synthetic MB] [--json FILE] "
+                   "[--baseline FILE] [inputs...]\n";
+      return 1;
+    }
+  }
+  if (spec.paths.empty() && spec.files0_from.empty()) {
+    spec.paths = default_files;
+  }
+
+  // Data sets: the inputs, then synthetic text made with the generator's defaults
+  std::vector<std::pair<std::string, std::string>> sets;
+  std::string inputs;
+  for (const std::string &file : collect_inputs(spec)) {
+    std::string content;
+    if (read_input_file(file, content)) {
+      inputs += content;
+      inputs += '\n';
+    }
+  }
+  sets.emplace_back("inputs", std::move(inputs));
+  for (double non_ascii : {0.0, 0.2}) {
+    CorpusOptions corpus;
+    corpus.size = synthetic_mb << 20;
+    corpus.non_ascii = non_ascii;
+    CorpusVocabulary vocabulary = make_corpus_vocabulary(corpus);
+    std::vector<double> weights(corpus.vocabulary);
+    for (size_t rank = 0; rank < weights.size(); rank++) {
+      weights[rank] = std::pow(rank + 1.0, -corpus.zipf);
+    }
+    AliasTable ranks(weights);
+    std::string text(corpus.size + 32, '\0');
+    for (uint64_t offset = 0; offset < corpus.size; offset += CORPUS_BLOCK_SIZE) {
+      generate_corpus_block(vocabulary, ranks, corpus, offset / CORPUS_BLOCK_SIZE, &text[offset],
+                            std::min<uint64_t>(CORPUS_BLOCK_SIZE, corpus.size - offset));
+    }
+    text.resize(corpus.size);
+    // The size is part of the name so only like runs are compared against a baseline
+    sets.emplace_back((non_ascii > 0 ? "zipf_utf8_" : "zipf_") + std::to_string(synthetic_mb) + "mb", std::move(text));
+  }
+
+  std::vector<Microbenchmark> benches;
+  for (const auto &set : sets) {
+    add_microbenchmarks(benches, set.first, set.second);
+  }
+  std::unordered_map<std::string, double> baseline;
+  if (!baseline_path.empty()) {
+    baseline = read_microbench_baseline(baseline_path);
+  }
+
+  std::vector<MicrobenchResult> results;
+  std::cout << std::left << std::setw(40) << "benchmark" << std::right << std::setw(14) << "ns/iter" << std::setw(12)
+            << "MB/s" << std::setw(14) << "Mitems/s" << std::setw(10) << "iters" << (baseline.empty() ? "" : "    change")
+            << "\n";
+  for (const Microbenchmark &bench : benches) {
+    if (bench.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    MicrobenchResult result = run_microbenchmark(bench, min_time);
+    char throughput[16] = "-";
+    if (bench.bytes > 0) {
+      snprintf(throughput, sizeof(throughput), "%.1f", result.bytes_per_second / 1e6);
+    }
+    std::cout << std::left << std::setw(40) << result.name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << result.ns_per_iteration << std::setw(12) << throughput << std::setprecision(2)
+              << std::setw(14) << result.items_per_second / 1e6 << std::setw(10) << result.iterations;
+    auto old = baseline.find(result.name);
+    if (old != baseline.end()) {
+      std::cout << std::showpos << std::setprecision(1) << std::setw(9)
+                << 100.0 * (result.ns_per_iteration - old->second) / old->second << "%" << std::noshowpos;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6) << std::endl;
+    results.push_back(result);
+  }
+  std::cout << std::left;
+
+  if (!json_path.empty()) {
+    std::ofstream out(json_path);
+    out << "{\"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+      const MicrobenchResult &result = results[i];
+      char numbers[160];
+      snprintf(numbers, sizeof(numbers),
+               "\"iterations\": %llu, \"ns_per_iteration\": %.1f, \"bytes_per_second\": %.0f, \"items_per_second\": %.0f",
+               (unsigned long long)result.iterations, result.ns_per_iteration, result.bytes_per_second,
+               result.items_per_second);
+      out << "{\"name\": " << json_string(result.name) << ", " << numbers << "}" << (i + 1 < results.size() ? "," : "")
+          << "\n";
+    }
+    out << "]}\n";
+    if (!out) {
+      std::cerr << "Error writing results to " << json_path << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Differential verification. Every counting engine runs on the same input,
+// and its table is compared with a deliberately naive reference: a
+// byte-at-a-time tokenizer with no ASCII block fast path and no class tables,
+// feeding a plain map. Any difference is reported with the first words that
+// disagree.
+// ---------------------------------------------------------------------------
+
+// Function to load every entry of a mapped count table into a map
+std::unordered_map<std::string, int> count_table_to_map(const CountTableView &table) {
+  std::unordered_map<std::string, int> word_count_map;
+  word_count_map.reserve(table.size());
+  for (uint64_t i = 0; i < table.size(); i++) {
+    word_count_map.emplace(table.word(i), (int)table.count(i));
+  }
+  return word_count_map;
+}
+
+// Function to count a file in a forked child, which sends its table back
+// through a memfd in the binary table format
+bool count_file_in_child(const std::string &file, std::unordered_map<std::string, int> &word_count_map) {
+  int fd = memfd_create("wordfreq-verify", MFD_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid == 0) {
+    bool ok = write_count_table(fd, process_file_multi_thread(file));
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  bool ok = pid != -1 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  CountTableView table;
+  ok = ok && table.map(fd);
+  close(fd);
+  if (ok) {
+    word_count_map = count_table_to_map(table);
+  }
+  return ok;
+}
+
+// Function to describe how two tables differ, listing at most show words in
+// sorted order; returns the number of words that differ
+size_t diff_word_counts(const std::unordered_map<std::string, int> &expected,
+                        const std::unordered_map<std::string, int> &actual, size_t show, std::ostream &out) {
+  std::vector<std::string> differing;
+  for (const auto &pair : expected) {
+    auto it = actual.find(pair.first);
+    if (it == actual.end() || it->second != pair.second) {
+      differing.push_back(pair.first);
+    }
+  }
+  for (const auto &pair : actual) {
+    if (expected.find(pair.first) == expected.end()) {
+      differing.push_back(pair.first);
+    }
+  }
+  std::sort(differing.begin(), differing.end());
+  for (size_t i = 0; i < differing.size() && i < show; i++) {
+    auto count_text = [&](const std::unordered_map<std::string, int> &map) {
+      auto it = map.find(differing[i]);
+      return it == map.end() ? std::string("missing") : std::to_string(it->second);
+    };
+    out << "      " << std::left << std::setw(20) << json_string(differing[i]) << " expected " << std::setw(10)
+        << count_text(expected) << " got " << count_text(actual) << "\n";
+  }
+  return differing.size();
+}
+
+// A counting engine under test: fills the map for a file, returns false on errors
+struct VerifyEngine {
+  std::string name;
+  std::function<bool(const std::string &, std::unordered_map<std::string, int> &)> count;
+};
+
+// Function to list every engine; scratch_dir holds temporary tables and spill runs
+std::vector<VerifyEngine> make_verify_engines(const std::string &scratch_dir) {
+  std::vector<VerifyEngine> engines;
+  engines.push_back({"single", [](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                       counts = process_file_single_thread(file);
+                       return true;
+                     }});
+  const std::pair<const char *, CountBackend> backends[] = {{"local", CountBackend::LOCAL_MAP},
+                                                            {"interned", CountBackend::INTERNED},
+                                                            {"sharded", CountBackend::SHARDED},
+                                                            {"lockfree", CountBackend::LOCKFREE},
+                                                            {"art", CountBackend::ART}};
+  for (const auto &backend : backends) {
+    CountBackend kind = backend.second;
+    engines.push_back({std::string("multi-") + backend.first,
+                       [kind](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                         counts = process_file_multi_thread(file, WordPolicy::LETTERS, kind);
+                         return true;
+                       }});
+  }
+  engines.push_back({"multi-chunked", [](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                       counts = process_file_multi_thread(file, WordPolicy::LETTERS, CountBackend::LOCAL_MAP, 0,
+                                                          nullptr, nullptr, nullptr, MAX_THREADS, 16 << 10);
+                       return true;
+                     }});
+  engines.push_back({"multi-hot-cache", [](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                       counts = process_file_multi_thread(file, WordPolicy::LETTERS, CountBackend::LOCAL_MAP, 64);
+                       return true;
+                     }});
+  engines.push_back({"segments", [](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                       std::string content;
+                       if (!read_input_file(file, content)) {
+                         return false;
+                       }
+                       // Segments of 1 byte to 4 KB, so words straddle and span whole segments
+                       SplitMix64 random{content.size()};
+                       std::vector<std::string_view> segments;
+                       for (size_t offset = 0; offset < content.size();) {
+                         size_t length = std::min<size_t>(content.size() - offset, 1 + random.below(4096));
+                         segments.emplace_back(content.data() + offset, length);
+                         offset += length;
+                       }
+                       return count_segments_multi_thread(segments, counts, WordPolicy::LETTERS,
+                                                          CountBackend::LOCAL_MAP, 0, nullptr, nullptr, nullptr,
+                                                          MAX_THREADS, 16 << 10);
+                     }});
+  engines.push_back({"fork", count_file_in_child});
+  engines.push_back({"stream", [](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                       int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+                       if (fd == -1) {
+                         return false;
+                       }
+                       // Small chunks so many chunk boundaries are exercised
+                       std::unordered_map<std::string, uint64_t> wide_counts;
+                       bool ok = count_stream(fd, MAX_THREADS, 16 << 10, wide_counts);
+                       close(fd);
+                       counts.insert(wide_counts.begin(), wide_counts.end());
+                       return ok;
+                     }});
+  engines.push_back({"external", [scratch_dir](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                       // A tiny budget forces several spilled runs and a real k-way merge
+                       ExternalOptions options;
+                       options.memory_budget = 256 << 10;
+                       options.chunk_size = 64 << 10;
+                       options.spill_dir = scratch_dir;
+                       options.output = scratch_dir + "/external.wft";
+                       options.merge_fan_in = 2; // Merge in several passes through intermediate runs
+                       TopWords top(0);
+                       ExternalStats stats;
+                       CountTableView table;
+                       bool ok = count_files_external({file}, options, top, stats) && table.open(options.output);
+                       if (ok) {
+                         counts = count_table_to_map(table);
+                       }
+                       unlink(options.output.c_str());
+                       return ok;
+                     }});
+  engines.push_back({"table-mmap", [scratch_dir](const std::string &file, std::unordered_map<std::string, int> &counts) {
+                       // Save and reload through the mmap reader
+                       std::string path = scratch_dir + "/saved.wft";
+                       CountTableView table;
+                       bool ok = save_count_table(path, process_file_single_thread(file)) && table.open(path);
+                       if (ok) {
+                         counts = count_table_to_map(table);
+                       }
+                       unlink(path.c_str());
+                       return ok;
+                     }});
+  return engines;
+}
+
+// Command: verify [--engines NAME,...] [--show N] [inputs...]
+// Runs every engine (or the listed ones) on each input and diffs its table
+// against the reference count. Exits with 1 if any engine disagrees or fails.
+int run_verify_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  std::vector<std::string> options;
+  InputSpec spec = parse_inputs(args, options);
+  std::vector<std::string> selected;
+  size_t show = 5;
+  for (size_t i = 0; i < options.size(); i++) {
+    bool has_value = i + 1 < options.size();
+    if (options[i] == "--engines" && has_value) {
+      std::istringstream list(options[++i]);
+      std::string name;
+      while (std::getline(list, name, ',')) {
+        selected.push_back(name);
+      }
+    } else if (options[i] == "--show" && has_value && parse_number(options[i + 1], show)) {
+      i++;
+    } else {
+      std::cerr << "Usage: verify [--engines NAME,...] [--show N] [inputs...]\n";
+      return 1;
+    }
+  }
+  if (spec.paths.empty() && spec.files0_from.empty()) {
+    spec.paths = default_files;
+  }
+
+  const char *tmpdir = getenv("TMPDIR");
+  std::string scratch_dir = std::string(tmpdir ? tmpdir : "/tmp") + "/wordfreq-verify-XXXXXX";
+  if (mkdtemp(&scratch_dir[0]) == nullptr) {
+    std::cerr << "Error creating " << scratch_dir << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  std::vector<VerifyEngine> engines;
+  for (VerifyEngine &engine : make_verify_engines(scratch_dir)) {
+    if (selected.empty() || std::find(selected.begin(), selected.end(), engine.name) != selected.end()) {
+      engines.push_back(std::move(engine));
+    }
+  }
+  if (engines.size() < std::max<size_t>(1, selected.size())) {
+    std::cerr << "Unknown engine in --engines" << std::endl;
+    rmdir(scratch_dir.c_str());
+    return 1;
+  }
+
+  size_t failures = 0;
+  for (const std::string &file : collect_inputs(spec)) {
+    std::string content;
+    if (!read_input_file(file, content)) {
+      std::cerr << last_error() << std::endl;
+      failures++;
+      continue;
+    }
+    std::unordered_map<std::string, int> expected = count_words_reference(content);
+    std::cout << "Verifying " << file << " (" << expected.size() << " distinct words)\n";
+    for (const VerifyEngine &engine : engines) {
+      std::unordered_map<std::string, int> actual;
+      std::ostringstream details;
+      set_last_error("");
+      if (!engine.count(file, actual)) {
+        std::cout << "  " << std::left << std::setw(18) << engine.name << "FAILED to run"
+                  << (last_error().empty() ? "" : ": " + last_error()) << "\n";
+        failures++;
+        continue;
+      }
+      size_t differing = diff_word_counts(expected, actual, show, details);
+      if (differing == 0) {
+        std::cout << "  " << std::left << std::setw(18) << engine.name << "ok\n";
+      } else {
+        std::cout << "  " << std::left << std::setw(18) << engine.name << "MISMATCH in " << differing << " words\n"
+                  << details.str();
+        failures++;
+      }
+    }
+  }
+  rmdir(scratch_dir.c_str());
+  if (failures > 0) {
+    std::cout << failures << " engine runs disagreed or failed\n";
+    return 1;
+  }
+  std::cout << "All engines agree\n";
+  return 0;
+}
+
+// Command: count [--threads N] [--top N] [--chunk-size KB] [--words POLICY] [--ngram N] [--files0-from LIST|-] inputs...
+// The inputs are enumerated on their own thread while workers already count the
+// first files, so huge trees start producing work immediately. An input of "-"
+// streams standard input through the chunked reader.
+int run_count_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  std::vector<std::string> options;
+  InputSpec spec = parse_inputs(args, options);
+  int num_threads = MAX_THREADS;
+  size_t top_n = 10;
+  size_t stdin_chunk_size = 4 * DEFAULT_CHUNK_SIZE;
+  WordPolicy policy = WordPolicy::LETTERS;
+  int ngram = 1;
+  for (size_t i = 0; i < options.size(); i++) {
+    bool has_value = i + 1 < options.size();
+    if (options[i] == "--threads" && has_value && parse_number(options[i + 1], num_threads, 1, MAX_COMMAND_THREADS)) {
+      i++;
+    } else if (options[i] == "--top" && has_value && parse_number(options[i + 1], top_n)) {
+      i++;
+    } else if (options[i] == "--chunk-size" && has_value &&
+               parse_number(options[i + 1], stdin_chunk_size, 1UL, SIZE_MAX >> 10)) {
+      stdin_chunk_size <<= 10;
+      i++;
+    } else if (options[i] == "--words" && has_value && parse_word_policy(options[i + 1], policy)) {
+      i++;
+    } else if (options[i] == "--ngram" && has_value && parse_number(options[i + 1], ngram, 1, MAX_NGRAM)) {
+      i++;
+    } else {
+      std::cerr << "Usage: count [--threads N] [--top N] [--chunk-size KB] [--words letters|ascii|alnum|apostrophe] "
+                   "[--ngram 1-" << MAX_NGRAM << "] [--files0-from LIST|-] inputs...\n";
+      return 1;
+    }
+  }
+  if (spec.paths.empty() && spec.files0_from.empty()) {
+    spec.paths = default_files;
+  }
+  auto stdin_spec = std::find(spec.paths.begin(), spec.paths.end(), "-");
+  bool read_stdin = stdin_spec != spec.paths.end();
+  if (read_stdin) {
+    if (spec.files0_from == "-") {
+      std::cerr << "Standard input cannot be both an input and the file list" << std::endl;
+      return 1;
+    }
+    spec.paths.erase(stdin_spec);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  StringQueue paths(1024);
+  std::unordered_map<std::string, uint64_t> total_word_count;
+  NgramCounts ngrams;
+  ngrams.n = ngram;
+  NgramCounts *ngrams_or_null = ngram > 1 ? &ngrams : nullptr;
+  std::mutex merge_mutex;
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<StreamingCount> thread_data(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    thread_data[i] = {&paths, &total_word_count, &merge_mutex, policy, ngrams_or_null};
+    if (pthread_create(&threads[i], nullptr, count_files_worker, &thread_data[i]) != 0) {
+      std::cerr << "Error creating thread" << std::endl;
+      exit(1);
+    }
+  }
+
+  enumerate_inputs(spec, [&](std::string path) { paths.push(std::move(path)); });
+  paths.close();
+
+  uint64_t files = 0, bytes = 0, total_words = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], nullptr);
+    files += thread_data[i].files;
+    bytes += thread_data[i].bytes;
+  }
+  if (read_stdin) {
+    if (!count_stream(STDIN_FILENO, num_threads, stdin_chunk_size, total_word_count, &bytes, policy, ngrams_or_null)) {
+      std::cerr << last_error() << std::endl;
+      return 1;
+    }
+    files++;
+  }
+  for (const auto &pair : total_word_count) {
+    total_words += pair.second;
+  }
+  for (const auto &pair : ngrams.counts) {
+    total_words += pair.second;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  const char *unit = ngram > 1 ? "n-grams" : "words";
+  std::cout << "Counted " << files << " inputs (" << bytes << " bytes): " << total_words << " " << unit << ", "
+            << (ngram > 1 ? ngrams.counts.size() : total_word_count.size()) << " distinct\n";
+  std::cout << "\n  Most frequent " << unit << ":\n";
+  std::vector<std::pair<std::string, uint64_t>> top_words;
+  if (ngram > 1) {
+    for (auto &pair : get_top_ngrams(ngrams, top_n)) {
+      top_words.emplace_back(std::move(pair.first), pair.second);
+    }
+  } else {
+    top_words = get_top_frequent_words(total_word_count, top_n);
+  }
+  for (const auto &pair : top_words) {
+    std::cout << "    " << std::left << std::setw(15) << pair.first << ": " << pair.second << "\n";
+  }
+  std::cout << "\nElapsed time: " << elapsed.count() << " seconds\n";
+  print_resource_usage();
+  return files > 0 ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// Query server: keeps a merged word count table in memory and answers
+// count(word), top(N) and prefix(word) queries over a Unix domain socket.
+//
+// Every frame is [type:u8][length:u32][payload]. Requests carry a QueryOp,
+// responses a QueryStatus. Integers are in host byte order since both ends
+// always live on the same machine.
+// ---------------------------------------------------------------------------
+
+enum QueryOp : uint8_t {
+  QUERY_COUNT = 1,  // payload: word                  -> u64 count
+  QUERY_TOP = 2,    // payload: u32 n                 -> entry list
+  QUERY_PREFIX = 3  // payload: u32 limit, prefix     -> entry list
+};
+
+enum QueryStatus : uint8_t { QUERY_OK = 0, QUERY_BAD_REQUEST = 1 };
+
+const size_t QUERY_HEADER_SIZE = 5;
+
+const uint32_t QUERY_MAX_PAYLOAD = 64 * 1024;
+
+// Unwritten response bytes a connection may hold before the server stops
+// reading its requests
+const size_t QUERY_MAX_PENDING_OUTPUT = 1 << 20;
+
+// Function to look up the count of a single word (0 if absent)
+uint64_t query_count(const CountTableView &table, std::string_view word) {
+  uint64_t i = table.find(word);
+  return i == CountTableView::npos ? 0 : table.count(i);
+}
+
+// Function to return the N most frequent words
+std::vector<std::pair<std::string, uint64_t>> query_top(const CountTableView &table, size_t n) {
+  std::vector<std::pair<std::string, uint64_t>> result;
+  n = std::min<uint64_t>(n, table.size());
+  for (size_t r = 0; r < n; r++) {
+    uint64_t i = table.ranked(r);
+    result.emplace_back(table.word(i), table.count(i));
+  }
+  return result;
+}
+
+// Function to return the most frequent words starting with a prefix
+std::vector<std::pair<std::string, uint64_t>> query_prefix(const CountTableView &table, std::string_view prefix, size_t limit) {
+  // Bounded min-heap of the best entries seen so far in the prefix range
+  auto better = [&](uint64_t a, uint64_t b) {
+    return table.count(a) > table.count(b) || (table.count(a) == table.count(b) && a < b);
+  };
+  std::vector<uint64_t> heap;
+  for (uint64_t i = table.lower_bound(prefix); i < table.size() && table.word(i).substr(0, prefix.size()) == prefix; i++) {
+    if (heap.size() < limit) {
+      heap.push_back(i);
+      std::push_heap(heap.begin(), heap.end(), better);
+    } else if (limit > 0 && better(i, heap.front())) {
+      std::pop_heap(heap.begin(), heap.end(), better);
+      heap.back() = i;
+      std::push_heap(heap.begin(), heap.end(), better);
+    }
+  }
+  std::sort(heap.begin(), heap.end(), better);
+
+  std::vector<std::pair<std::string, uint64_t>> result;
+  for (uint64_t i : heap) {
+    result.emplace_back(table.word(i), table.count(i));
+  }
+  return result;
+}
+
+// Helpers to append and read fixed-size integers in frames
+template <typename T>
+void append_int(std::string &buffer, T value) {
+  buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+T read_int(const char *data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Function to append a complete frame to an output buffer
+void append_frame(std::string &buffer, uint8_t type, const std::string &payload) {
+  buffer.push_back(static_cast<char>(type));
+  append_int<uint32_t>(buffer, payload.size());
+  buffer += payload;
+}
+
+// Function to encode a list of (word, count) entries as a response payload
+std::string encode_entries(const std::vector<std::pair<std::string, uint64_t>> &entries) {
+  std::string payload;
+  append_int<uint32_t>(payload, entries.size());
+  for (const auto &entry : entries) {
+    uint16_t length = std::min<size_t>(entry.first.size(), UINT16_MAX);
+    append_int<uint16_t>(payload, length);
+    payload.append(entry.first, 0, length);
+    append_int<uint64_t>(payload, entry.second);
+  }
+  return payload;
+}
+
+// Function to decode an entry list payload; returns false if it is malformed
+bool decode_entries(const std::string &payload, std::vector<std::pair<std::string, uint64_t>> &entries) {
+  if (payload.size() < 4) {
+    return false;
+  }
+  uint32_t count = read_int<uint32_t>(payload.data());
+  size_t pos = 4;
+  for (uint32_t i = 0; i < count; i++) {
+    if (pos + 2 > payload.size()) {
+      return false;
+    }
+    uint16_t length = read_int<uint16_t>(payload.data() + pos);
+    pos += 2;
+    if (pos + length + 8 > payload.size()) {
+      return false;
+    }
+    std::string word = payload.substr(pos, length);
+    pos += length;
+    entries.emplace_back(word, read_int<uint64_t>(payload.data() + pos));
+    pos += 8;
+  }
+  return true;
+}
+
+// Function to answer one request; the response frame is appended to out
+void handle_query(const CountTableView &table, uint8_t op, const std::string &payload, std::string &out) {
+  std::string response;
+  switch (op) {
+  case QUERY_COUNT:
+    append_int<uint64_t>(response, query_count(table, payload));
+    break;
+  case QUERY_TOP:
+    if (payload.size() != 4) {
+      append_frame(out, QUERY_BAD_REQUEST, "");
+      return;
+    }
+    response = encode_entries(query_top(table, read_int<uint32_t>(payload.data())));
+    break;
+  case QUERY_PREFIX:
+    if (payload.size() < 4) {
+      append_frame(out, QUERY_BAD_REQUEST, "");
+      return;
+    }
+    response = encode_entries(query_prefix(table, std::string_view(payload).substr(4), read_int<uint32_t>(payload.data())));
+    break;
+  default:
+    append_frame(out, QUERY_BAD_REQUEST, "");
+    return;
+  }
+  append_frame(out, QUERY_OK, response);
+}
+
+// Helpers for blocking I/O that retry on partial transfers and EINTR
+bool write_all(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+bool read_all(int fd, char *data, size_t length) {
+  while (length > 0) {
+    ssize_t received = read(fd, data, length);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    data += received;
+    length -= received;
+  }
+  return true;
+}
+
+// Set by SIGINT/SIGTERM to make the server loop exit cleanly
+volatile sig_atomic_t server_stop_requested = 0;
+
+void handle_server_signal(int) { server_stop_requested = 1; }
+
+// Per-client state for the epoll loop
+struct QueryConnection {
+  std::string in;      // Bytes received but not yet parsed into requests
+  std::string out;     // Encoded responses waiting to be written
+  size_t out_pos = 0;  // How much of out has already been written
+  uint32_t events = EPOLLIN; // Interest set currently registered with epoll
+
+  bool output_full() const { return out.size() - out_pos >= QUERY_MAX_PENDING_OUTPUT; }
+};
+
+// Function to create a listening Unix domain socket at the given path
+int open_query_listener(const std::string &socket_path) {
+  sockaddr_un addr{};
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << socket_path << std::endl;
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    std::cerr << "Error creating socket: " << strerror(errno) << std::endl;
+    return -1;
+  }
+  unlink(socket_path.c_str()); // Remove a stale socket left by a previous run
+  if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+    std::cerr << "Error binding socket " << socket_path << ": " << strerror(errno) << std::endl;
+    close(listen_fd);
+    return -1;
+  }
+  return listen_fd;
+}
+
+// Function to answer the complete requests buffered on a connection until its
+// output is full; returns how many
+size_t process_query_input(const CountTableView &table, QueryConnection &conn) {
+  size_t pos = 0, handled = 0;
+  while (!conn.output_full() && conn.in.size() - pos >= QUERY_HEADER_SIZE) {
+    uint8_t op = conn.in[pos];
+    uint32_t length = read_int<uint32_t>(conn.in.data() + pos + 1);
+    if (conn.in.size() - pos - QUERY_HEADER_SIZE < length) {
+      break; // Wait for the rest of the payload
+    }
+    handle_query(table, op, conn.in.substr(pos + QUERY_HEADER_SIZE, length), conn.out);
+    pos += QUERY_HEADER_SIZE + length;
+    handled++;
+  }
+  conn.in.erase(0, pos);
+  return handled;
+}
+
+// Function to run the epoll loop until a stop signal arrives
+int run_query_server(const CountTableView &table, const std::string &socket_path) {
+  int listen_fd = open_query_listener(socket_path);
+  if (listen_fd == -1) {
+    return 1;
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    std::cerr << "Error creating epoll instance: " << strerror(errno) << std::endl;
+    close(listen_fd);
+    return 1;
+  }
+  epoll_event listen_event{};
+  listen_event.events = EPOLLIN;
+  listen_event.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+
+  // No SA_RESTART so that epoll_wait returns EINTR when a signal arrives
+  struct sigaction action {};
+  action.sa_handler = handle_server_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::cout << "Serving " << table.size() << " words on " << socket_path << std::endl;
+
+  std::unordered_map<int, QueryConnection> connections;
+  const int MAX_EVENTS = 64;
+  epoll_event events[MAX_EVENTS];
+  char buffer[64 * 1024];
+  uint64_t requests_served = 0;
+
+  auto close_connection = [&](int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections.erase(fd);
+  };
+
+  while (!server_stop_requested) {
+    int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Error in epoll_wait: " << strerror(errno) << std::endl;
+      break;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == listen_fd) {
+        int client_fd;
+        while ((client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+          epoll_event client_event{};
+          client_event.events = EPOLLIN;
+          client_event.data.fd = client_fd;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event);
+          connections[client_fd];
+        }
+        continue;
+      }
+
+      QueryConnection &conn = connections[fd];
+      bool closed = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+
+      if ((events[i].events & EPOLLIN) && !conn.output_full()) {
+        ssize_t received;
+        while ((received = read(fd, buffer, sizeof(buffer))) > 0) {
+          conn.in.append(buffer, received);
+        }
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+          closed = true;
+        }
+      }
+
+      // Answer buffered requests and flush the responses; once a full output
+      // drains, requests held back by it are answered in the next round
+      while (!closed) {
+        size_t handled = process_query_input(table, conn);
+        requests_served += handled;
+        // A header announcing an oversized payload can never be satisfied
+        if (conn.in.size() >= QUERY_HEADER_SIZE && read_int<uint32_t>(conn.in.data() + 1) > QUERY_MAX_PAYLOAD) {
+          closed = true;
+        }
+
+        // Flush as much pending output as the socket accepts
+        while (!closed && conn.out_pos < conn.out.size()) {
+          ssize_t written = write(fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos);
+          if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+              closed = true;
+            }
+            break;
+          }
+          conn.out_pos += written;
+        }
+
+        if (conn.out_pos == conn.out.size()) {
+          conn.out.clear();
+          conn.out_pos = 0;
+        }
+        if (handled == 0 || !conn.out.empty()) {
+          break;
+        }
+      }
+
+      if (closed) {
+        close_connection(fd);
+        continue;
+      }
+
+      // Stop reading while the output is full, and only ask for EPOLLOUT
+      // while there is output the socket would not take
+      uint32_t wanted = 0;
+      if (!conn.output_full()) {
+        wanted |= EPOLLIN;
+      }
+      if (!conn.out.empty()) {
+        wanted |= EPOLLOUT;
+      }
+      if (wanted != conn.events) {
+        epoll_event client_event{};
+        client_event.events = wanted;
+        client_event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &client_event);
+        conn.events = wanted;
+      }
+    }
+  }
+
+  for (auto &entry : connections) {
+    close(entry.first);
+  }
+  close(epoll_fd);
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  std::cout << "Server stopped after " << requests_served << " requests" << std::endl;
+  return 0;
+}
+
+// Function to connect to a running query server
+int connect_query_server(const std::string &socket_path) {
+  sockaddr_un addr{};
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << socket_path << std::endl;
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
+    std::cerr << "Error connecting to " << socket_path << ": " << strerror(errno) << std::endl;
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// Function to send one request and wait for its response; returns false on I/O errors
+bool send_query(int fd, uint8_t op, const std::string &payload, uint8_t &status, std::string &response) {
+  std::string request;
+  append_frame(request, op, payload);
+  if (!write_all(fd, request.data(), request.size())) {
+    return false;
+  }
+  char header[QUERY_HEADER_SIZE];
+  if (!read_all(fd, header, sizeof(header))) {
+    return false;
+  }
+  status = header[0];
+  response.resize(read_int<uint32_t>(header + 1));
+  return read_all(fd, &response[0], response.size());
+}
+
+// Command: serve <socket> [--index <table> | inputs...]
+int run_serve_command(const std::vector<std::string> &args, const std::vector<std::string> &default_files) {
+  if (args.empty()) {
+    std::cerr << "Usage: serve <socket> [--index <table> | inputs...]\n";
+    return 1;
+  }
+
+  CountTableView table;
+  if (args.size() == 3 && args[1] == "--index") {
+    // Serve a saved table in place
+    if (!table.open(args[2])) {
+      std::cerr << last_error() << std::endl;
+      return 1;
+    }
+  } else {
+    std::vector<std::string> files = default_files;
+    if (args.size() > 1) {
+      files = collect_inputs(InputSpec{std::vector<std::string>(args.begin() + 1, args.end()), ""});
+    }
+    std::unordered_map<std::string, int> merged;
+    for (const std::string &file : files) {
+      for (const auto &pair : process_file_multi_thread(file)) {
+        merged[pair.first] += pair.second;
+      }
+    }
+    // Serialize into an anonymous in-memory file so both modes share one index layout
+    int fd = memfd_create("wordfreq-table", MFD_CLOEXEC);
+    bool ok = fd != -1 && write_count_table(fd, merged) && table.map(fd);
+    if (fd != -1) {
+      close(fd);
+    }
+    if (!ok) {
+      std::cerr << "Error building in-memory count table: " << (fd == -1 ? strerror(errno) : last_error()) << std::endl;
+      return 1;
+    }
+  }
+  if (!table.rank) {
+    std::cerr << "Count table has no rank index; rebuild it with merge" << std::endl;
+    return 1;
+  }
+  return run_query_server(table, args[0]);
+}
+
+// Command: query <socket> count <word> | top <n> | prefix <prefix> [limit]
+int run_query_command(const std::vector<std::string> &args) {
+  if (args.size() < 3) {
+    std::cerr << "Usage: query <socket> count <word> | top <n> | prefix <prefix> [limit]\n";
+    return 1;
+  }
+  const std::string &kind = args[1];
+  uint32_t limit = 10;
+  uint8_t op;
+  std::string payload;
+  if (kind == "count") {
+    op = QUERY_COUNT;
+    payload = args[2];
+  } else if (kind == "top" && parse_number(args[2], limit)) {
+    op = QUERY_TOP;
+    append_int<uint32_t>(payload, limit);
+  } else if (kind == "prefix" && (args.size() < 4 || parse_number(args[3], limit))) {
+    op = QUERY_PREFIX;
+    append_int<uint32_t>(payload, limit);
+    payload += args[2];
+  } else if (kind == "top" || kind == "prefix") {
+    std::cerr << "Usage: query <socket> count <word> | top <n> | prefix <prefix> [limit]\n";
+    return 1;
+  } else {
+    std::cerr << "Unknown query: " << kind << std::endl;
+    return 1;
+  }
+
+  int fd = connect_query_server(args[0]);
+  if (fd == -1) {
+    return 1;
+  }
+  uint8_t status;
+  std::string response;
+  bool ok = send_query(fd, op, payload, status, response);
+  close(fd);
+  if (!ok || status != QUERY_OK) {
+    std::cerr << "Query failed" << std::endl;
+    return 1;
+  }
+
+  if (op == QUERY_COUNT) {
+    if (response.size() < sizeof(uint64_t)) {
+      std::cerr << "Malformed response" << std::endl;
+      return 1;
+    }
+    std::cout << args[2] << ": " << read_int<uint64_t>(response.data()) << "\n";
+    return 0;
+  }
+  std::vector<std::pair<std::string, uint64_t>> entries;
+  if (!decode_entries(response, entries)) {
+    std::cerr << "Malformed response" << std::endl;
+    return 1;
+  }
+  for (const auto &entry : entries) {
+    std::cout << "  " << std::left << std::setw(15) << entry.first << ": " << entry.second << "\n";
+  }
+  return 0;
+}
+
+// Latency samples collected by one benchmark client
+struct QueryBenchClient {
+  std::string socket_path;
+  std::vector<std::string> words;
+  size_t queries;
+  unsigned seed;
+  std::vector<double> latencies_us;
+  bool failed = false;
+};
+
+// Thread body for the latency benchmark: issue count queries one at a time
+void *run_query_bench_client(void *arg) {
+  auto *client = (QueryBenchClient *)arg;
+  int fd = connect_query_server(client->socket_path);
+  if (fd == -1) {
+    client->failed = true;
+    return nullptr;
+  }
+  std::mt19937 rng(client->seed);
+  std::uniform_int_distribution<size_t> pick(0, client->words.size() - 1);
+  client->latencies_us.reserve(client->queries);
+
+  uint8_t status;
+  std::string response;
+  for (size_t i = 0; i < client->queries; i++) {
+    const std::string &word = client->words[pick(rng)];
+    auto start = std::chrono::steady_clock::now();
+    if (!send_query(fd, QUERY_COUNT, word, status, response) || status != QUERY_OK) {
+      client->failed = true;
+      break;
+    }
+    auto end = std::chrono::steady_clock::now();
+    client->latencies_us.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  close(fd);
+  return nullptr;
+}
+
+// Command: query-bench <socket> [queries per client] [clients]
+int run_query_bench_command(const std::vector<std::string> &args) {
+  size_t queries = 100000;
+  int clients = 1;
+  if (args.empty() || (args.size() > 1 && !parse_number(args[1], queries)) ||
+      (args.size() > 2 && !parse_number(args[2], clients, 1, MAX_COMMAND_THREADS))) {
+    std::cerr << "Usage: query-bench <socket> [queries per client] [clients]\n";
+    return 1;
+  }
+
+  // Sample real words from the server so lookups hit the table
+  int fd = connect_query_server(args[0]);
+  if (fd == -1) {
+    return 1;
+  }
+  std::string payload, response;
+  uint8_t status;
+  append_int<uint32_t>(payload, 1000);
+  std::vector<std::pair<std::string, uint64_t>> entries;
+  bool ok = send_query(fd, QUERY_TOP, payload, status, response) && decode_entries(response, entries);
+  close(fd);
+  if (!ok || entries.empty()) {
+    std::cerr << "Could not fetch words from server" << std::endl;
+    return 1;
+  }
+
+  std::vector<QueryBenchClient> bench_clients(clients);
+  std::vector<pthread_t> threads(clients);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < clients; i++) {
+    bench_clients[i].socket_path = args[0];
+    for (const auto &entry : entries) {
+      bench_clients[i].words.push_back(entry.first);
+    }
+    bench_clients[i].queries = queries;
+    bench_clients[i].seed = i + 1;
+    if (pthread_create(&threads[i], nullptr, run_query_bench_client, &bench_clients[i]) != 0) {
+      std::cerr << "Error creating benchmark thread" << std::endl;
+      exit(1);
+    }
+  }
+  std::vector<double> latencies;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(threads[i], nullptr);
+    if (bench_clients[i].failed) {
+      std::cerr << "Benchmark client " << i << " failed" << std::endl;
+      return 1;
+    }
+    latencies.insert(latencies.end(), bench_clients[i].latencies_us.begin(), bench_clients[i].latencies_us.end());
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) { return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+  double sum = 0;
+  for (double latency : latencies) {
+    sum += latency;
+  }
+
+  std::cout << "Query latency over " << latencies.size() << " requests (" << clients << " clients):\n";
+  std::cout << "  Throughput: " << latencies.size() / elapsed.count() << " queries/sec\n";
+  std::cout << "  Mean:       " << sum / latencies.size() << " us\n";
+  std::cout << "  p50:        " << percentile(0.50) << " us\n";
+  std::cout << "  p99:        " << percentile(0.99) << " us\n";
+  std::cout << "  p99.9:      " << percentile(0.999) << " us\n";
+  std::cout << "  Max:        " << latencies.back() << " us\n";
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  // List of files to process
+  std::vector<std::string> files = {
+      "calgary/bib",   "calgary/paper1", "calgary/paper2", "calgary/progc",
+      "calgary/progl", "calgary/progp",  "calgary/trans"};
+
+  // Subcommands; any other arguments are inputs (files, directories, globs) for the demo
+  int ngram = 1;
+  CountBackend backend = CountBackend::LOCAL_MAP;
+  size_t hot_cache_entries = 0;
+  std::string profile_path;
+  std::string trace_output;
+  if (argc > 1) {
+    std::string command = argv[1];
+    std::vector<std::string> args(argv + 2, argv + argc);
+    if (command == "serve") {
+      return run_serve_command(args, files);
+    } else if (command == "query") {
+      return run_query_command(args);
+    } else if (command == "query-bench") {
+      return run_query_bench_command(args);
+    } else if (command == "save") {
+      return run_save_command(args, files);
+    } else if (command == "merge") {
+      return run_merge_command(args);
+    } else if (command == "dump") {
+      return run_dump_command(args);
+    } else if (command == "external") {
+      return run_external_command(args, files);
+    } else if (command == "count") {
+      return run_count_command(args, files);
+    } else if (command == "complete") {
+      return run_complete_command(args, files);
+    } else if (command == "sweep") {
+      return run_sweep_command(args, files);
+    } else if (command == "gen") {
+      return run_gen_command(args);
+    } else if (command == "microbench") {
+      return run_microbench_command(args, files);
+    } else if (command == "verify") {
+      return run_verify_command(args, files);
+    }
+
+    std::vector<std::string> options;
+    InputSpec spec = parse_inputs(std::vector<std::string>(argv + 1, argv + argc), options);
+    bool options_ok = options.size() % 2 == 0;
+    for (size_t i = 0; options_ok && i < options.size(); i += 2) {
+      if (options[i] == "--ngram") {
+        options_ok = parse_number(options[i + 1], ngram, 1, MAX_NGRAM);
+      } else if (options[i] == "--backend") {
+        options_ok = parse_count_backend(options[i + 1], backend);
+      } else if (options[i] == "--hot-cache") {
+        options_ok = parse_number(options[i + 1], hot_cache_entries, 0UL); // 0 disables the cache
+      } else if (options[i] == "--profile") {
+        profile_path = options[i + 1];
+        phase_profiling = true;
+      } else if (options[i] == "--hw-counters") {
+        options_ok = options[i + 1] == "on" || options[i + 1] == "off";
+        hw_counters_enabled = options[i + 1] == "on";
+      } else if (options[i] == "--trace") {
+        trace_output = options[i + 1];
+      } else {
+        options_ok = false;
+      }
+    }
+    if (!spec.paths.empty() || !spec.files0_from.empty()) {
+      files = collect_inputs(spec);
+    }
+    if (!options_ok || (hw_counters_enabled && !phase_profiling) || files.empty() || ngram < 1 || ngram > MAX_NGRAM) {
+      std::cerr << "Usage: " << argv[0] << " [inputs...] [--files0-from LIST|-] [--ngram N] [--backend local|interned|sharded|lockfree|art]\n"
+                << "       " << argv[0] << " ... [--hot-cache ENTRIES] [--profile JSON [--hw-counters on|off]] [--trace JSON]\n"
+                << "       " << argv[0] << " serve|query|query-bench|save|merge|dump|external|count|complete|sweep|gen|microbench|verify ...\n";
+      return 1;
+    }
+  }
+  if (!trace_output.empty()) {
+    start_trace(trace_output);
+  }
+  if (hw_counters_enabled && !hw_counters_available()) {
+    std::cerr << last_error() << std::endl;
+  }
+
+  // Compare single-threaded vs multi-threaded performance
+  compare_performance(files, ngram, backend, hot_cache_entries);
+
+  // Measure time for multiprocessing + multithreading
+  auto start = std::chrono::high_resolution_clock::now();
+  process_files_with_fork(files, ngram, backend);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end - start;
+
+  std::cout << "\nElapsed time for multiprocessing + multithreading: " << elapsed_seconds.count() << " seconds\n";
+
+  // Print resource usage (CPU and memory)
+  print_resource_usage();
+
+  if (phase_profiling) {
+    print_phase_report(std::cout);
+    if (!write_phase_json(profile_path)) {
+      std::cerr << last_error() << std::endl;
+      return 1;
+    }
+  }
+  if (tracing_enabled && !finish_trace()) {
+    std::cerr << last_error() << std::endl;
+    return 1;
+  }
 
   return 0;
 }
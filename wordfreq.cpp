@@ -0,0 +1,2430 @@
+#include "wordfreq.h"
+#include "wordfreq_internal.h"
+
+#include <linux/perf_event.h>
+
+#ifdef WORDFREQ_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WORDFREQ_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef WORDFREQ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// ---------------------------------------------------------------------------
+// Error reporting
+// ---------------------------------------------------------------------------
+
+static thread_local std::string last_error_message;
+
+void set_last_error(const std::string &message) {
+  last_error_message = message;
+}
+
+const std::string &last_error() {
+  return last_error_message;
+}
+
+// ---------------------------------------------------------------------------
+// Tokenizer
+// ---------------------------------------------------------------------------
+
+bool is_unicode_letter(uint32_t codepoint) {
+  auto it = std::upper_bound(std::begin(UNICODE_LETTER_RANGES), std::end(UNICODE_LETTER_RANGES), codepoint,
+                             [](uint32_t value, const CodepointRange &range) { return value < range.first; });
+  return it != std::begin(UNICODE_LETTER_RANGES) && codepoint <= (it - 1)->last;
+}
+
+uint32_t fold_case(uint32_t c) {
+  auto fold_pair = [](uint32_t cp, uint32_t first, uint32_t last, uint32_t parity) {
+    return cp >= first && cp <= last && (cp & 1) == parity;
+  };
+  if ((c >= 0xC0 && c <= 0xDE && c != 0xD7) || (c >= 0x391 && c <= 0x3AB && c != 0x3A2) || (c >= 0x410 && c <= 0x42F) ||
+      (c >= 0xFF21 && c <= 0xFF3A)) {
+    return c + 0x20;
+  }
+  if (fold_pair(c, 0x100, 0x137, 0) || fold_pair(c, 0x139, 0x148, 1) || fold_pair(c, 0x14A, 0x177, 0) ||
+      fold_pair(c, 0x179, 0x17E, 1) || fold_pair(c, 0x460, 0x481, 0) || fold_pair(c, 0x48A, 0x4BF, 0) ||
+      fold_pair(c, 0x4C1, 0x4CE, 1) || fold_pair(c, 0x4D0, 0x52F, 0) || fold_pair(c, 0x1E00, 0x1E95, 0) ||
+      fold_pair(c, 0x1EA0, 0x1EFF, 0)) {
+    return c + 1;
+  }
+  if (c >= 0x400 && c <= 0x40F) {
+    return c + 0x50;
+  }
+  if (c >= 0x531 && c <= 0x556) {
+    return c + 0x30;
+  }
+  if (c >= 0x10A0 && c <= 0x10C5) {
+    return c + 0x1C60;
+  }
+  switch (c) {
+  case 0x178: return 0xFF;
+  case 0x17F: return 's';
+  case 0x386: return 0x3AC;
+  case 0x388: case 0x389: case 0x38A: return c + 0x25;
+  case 0x38C: return 0x3CC;
+  case 0x38E: case 0x38F: return c + 0x3F;
+  case 0x3C2: return 0x3C3;
+  case 0x4C0: return 0x4CF;
+  case 0x1E9E: return 0xDF;
+  default: return c;
+  }
+}
+
+size_t decode_utf8(const unsigned char *s, size_t available, uint32_t &codepoint) {
+  unsigned char c = s[0];
+  size_t length;
+  uint32_t minimum;
+  if (c >= 0xC2 && c <= 0xDF) {
+    length = 2, minimum = 0x80, codepoint = c & 0x1F;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    length = 3, minimum = 0x800, codepoint = c & 0x0F;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    length = 4, minimum = 0x10000, codepoint = c & 0x07;
+  } else {
+    return 0;
+  }
+  if (available < length) {
+    return 0;
+  }
+  for (size_t i = 1; i < length; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+    codepoint = (codepoint << 6) | (s[i] & 0x3F);
+  }
+  if (codepoint < minimum || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+    return 0;
+  }
+  return length;
+}
+
+void append_utf8(std::string &out, uint32_t codepoint) {
+  if (codepoint < 0x80) {
+    out += (char)codepoint;
+  } else if (codepoint < 0x800) {
+    out += (char)(0xC0 | (codepoint >> 6));
+    out += (char)(0x80 | (codepoint & 0x3F));
+  } else if (codepoint < 0x10000) {
+    out += (char)(0xE0 | (codepoint >> 12));
+    out += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+    out += (char)(0x80 | (codepoint & 0x3F));
+  } else {
+    out += (char)(0xF0 | (codepoint >> 18));
+    out += (char)(0x80 | ((codepoint >> 12) & 0x3F));
+    out += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+    out += (char)(0x80 | (codepoint & 0x3F));
+  }
+}
+
+std::unordered_map<std::string, int> count_words_reference(const std::string &text) {
+  std::unordered_map<std::string, int> counts;
+  const unsigned char *s = (const unsigned char *)text.data();
+  std::string word;
+  size_t i = 0;
+  while (i <= text.size()) {
+    uint32_t codepoint = 0;
+    size_t length = 1;
+    bool letter = false;
+    if (i < text.size()) {
+      if (s[i] < 0x80) {
+        codepoint = s[i];
+        letter = (codepoint >= 'a' && codepoint <= 'z') || (codepoint >= 'A' && codepoint <= 'Z');
+        if (codepoint >= 'A' && codepoint <= 'Z') {
+          codepoint += 'a' - 'A';
+        }
+      } else if ((length = decode_utf8(s + i, text.size() - i, codepoint)) > 0) {
+        letter = is_unicode_letter(codepoint);
+        codepoint = fold_case(codepoint);
+      } else {
+        length = 1;
+      }
+    }
+    if (letter) {
+      append_utf8(word, codepoint);
+    } else if (!word.empty()) {
+      counts[word]++;
+      word.clear();
+    }
+    i += length;
+  }
+  return counts;
+}
+
+// Word policies: which bytes form words, whether UTF-8 letters count, and which
+// character is trimmed from both ends of a word (0 for none).
+
+bool parse_word_policy(const std::string &name, WordPolicy &policy) {
+  if (name == "letters") {
+    policy = WordPolicy::LETTERS;
+  } else if (name == "ascii") {
+    policy = WordPolicy::ASCII;
+  } else if (name == "alnum") {
+    policy = WordPolicy::ALNUM;
+  } else if (name == "apostrophe") {
+    policy = WordPolicy::APOSTROPHE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+size_t last_word_boundary(const char *text, size_t length) {
+  size_t i = length;
+  while (i > 0 && !is_split_byte(text[i - 1])) {
+    i--;
+  }
+  return i;
+}
+
+// ---------------------------------------------------------------------------
+// Word interning
+// ---------------------------------------------------------------------------
+
+bool parse_count_backend(const std::string &name, CountBackend &backend) {
+  if (name == "local") {
+    backend = CountBackend::LOCAL_MAP;
+  } else if (name == "interned") {
+    backend = CountBackend::INTERNED;
+  } else if (name == "sharded") {
+    backend = CountBackend::SHARDED;
+  } else if (name == "lockfree") {
+    backend = CountBackend::LOCKFREE;
+  } else if (name == "art") {
+    backend = CountBackend::ART;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Per-phase instrumentation
+// ---------------------------------------------------------------------------
+
+const char *const PHASE_NAMES[NUM_PHASES] = {"read", "tokenize", "count", "merge", "top_n", "output"};
+
+const char *const HW_COUNTER_NAMES[NUM_HW_COUNTERS] = {"cycles",        "instructions", "cache_misses",
+                                                      "branch_misses", "llc_misses",   "dtlb_misses"};
+
+bool hw_counters_enabled = false;
+
+bool phase_profiling = false;
+
+std::vector<PhaseProfile> phase_profiles;
+
+ArenaStats arena_stats;
+
+// Hardware counters of the calling thread, opened as one perf_event_open group
+// so they are scheduled onto the PMU together. Only user-space events are
+// counted, which perf_event_paranoid <= 2 permits without privileges. Events
+// the CPU lacks are left out; if the group cannot be opened at all (no PMU,
+// e.g. in many VMs and containers) reads fail and last_error() says why.
+class PerfCounterGroup {
+public:
+  // Function to get the group of the calling thread, reopening it after fork
+  static PerfCounterGroup &for_thread() {
+    thread_local PerfCounterGroup group;
+    if (group.pid_ != getpid()) {
+      group.close_all();
+      group.open_all();
+    }
+    return group;
+  }
+
+  ~PerfCounterGroup() { close_all(); }
+
+  // Function to read the running totals, scaled up if the group was multiplexed
+  bool read(uint64_t values[NUM_HW_COUNTERS]) {
+    if (leader_ == -1) {
+      return false;
+    }
+    uint64_t buffer[3 + NUM_HW_COUNTERS]; // nr, time_enabled, time_running, values...
+    if (::read(leader_, buffer, sizeof(buffer)) < (ssize_t)(3 * sizeof(uint64_t))) {
+      return false;
+    }
+    double scale = buffer[2] > 0 && buffer[2] < buffer[1] ? (double)buffer[1] / buffer[2] : 1.0;
+    for (int counter = 0; counter < NUM_HW_COUNTERS; counter++) {
+      values[counter] = slots_[counter] >= 0 ? (uint64_t)(buffer[3 + slots_[counter]] * scale) : 0;
+    }
+    return true;
+  }
+
+private:
+  PerfCounterGroup() = default;
+
+  static void describe(HwCounter counter, perf_event_attr &attr) {
+    auto cache_miss = [](uint64_t cache) {
+      return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (counter) {
+    case HW_CYCLES:
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case HW_INSTRUCTIONS:
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case HW_CACHE_MISSES:
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case HW_BRANCH_MISSES:
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    case HW_LLC_MISSES:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = cache_miss(PERF_COUNT_HW_CACHE_LL);
+      break;
+    default:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = cache_miss(PERF_COUNT_HW_CACHE_DTLB);
+      break;
+    }
+  }
+
+  void open_all() {
+    pid_ = getpid();
+    int next_slot = 0;
+    for (int counter = 0; counter < NUM_HW_COUNTERS; counter++) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      describe((HwCounter)counter, attr);
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fds_[counter] = syscall(SYS_perf_event_open, &attr, 0, -1, leader_, PERF_FLAG_FD_CLOEXEC);
+      slots_[counter] = fds_[counter] == -1 ? -1 : next_slot++;
+      if (counter == 0 && fds_[counter] == -1) {
+        // Without the cycles leader there is no group to read
+        set_last_error(std::string("Hardware counters unavailable (perf_event_open: ") + strerror(errno) +
+                       "); check /proc/sys/kernel/perf_event_paranoid");
+        return;
+      }
+      if (counter == 0) {
+        leader_ = fds_[counter];
+      }
+    }
+  }
+
+  void close_all() {
+    for (int counter = 0; counter < NUM_HW_COUNTERS; counter++) {
+      if (fds_[counter] != -1) {
+        close(fds_[counter]);
+        fds_[counter] = -1;
+      }
+      slots_[counter] = -1;
+    }
+    leader_ = -1;
+  }
+
+  pid_t pid_ = 0;
+  int leader_ = -1;
+  int fds_[NUM_HW_COUNTERS] = {-1, -1, -1, -1, -1, -1};
+  int slots_[NUM_HW_COUNTERS] = {-1, -1, -1, -1, -1, -1}; // Position in the group read, -1 if not opened
+};
+
+bool read_hw_counters(uint64_t values[NUM_HW_COUNTERS]) {
+  return PerfCounterGroup::for_thread().read(values);
+}
+
+bool hw_counters_available() {
+  uint64_t values[NUM_HW_COUNTERS];
+  return read_hw_counters(values);
+}
+
+// ---------------------------------------------------------------------------
+// Timeline tracing
+// ---------------------------------------------------------------------------
+
+// Event ring written by one thread at a time. Pushing never blocks: the owner
+// stores the event and publishes the new head, and the dump only reads once
+// the writers are done. When full, the oldest events are overwritten.
+class TraceRing {
+public:
+  static constexpr uint64_t CAPACITY = 1 << 15;
+
+  TraceRing() : events_(new TraceEvent[CAPACITY]) {}
+
+  void push(const TraceEvent &event) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    events_[head % CAPACITY] = event;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  template <typename Fn> void for_each(Fn &&fn) const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    for (uint64_t i = head > CAPACITY ? head - CAPACITY : 0; i < head; i++) {
+      fn(events_[i % CAPACITY]);
+    }
+  }
+
+  void clear() { head_.store(0, std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> head_{0};
+  std::unique_ptr<TraceEvent[]> events_;
+};
+
+bool tracing_enabled = false;
+
+std::vector<pid_t> trace_children;
+
+static std::string trace_path;
+
+static std::string trace_process_name = "wordfreq";
+
+static uint64_t trace_epoch_ns = 0; // Shared with forked children, so their timelines line up
+
+// All rings of this process; a thread borrows one for its lifetime and hands
+// it back on exit, so the number of rings follows the peak thread count
+static std::mutex trace_mutex;
+
+static std::vector<std::unique_ptr<TraceRing>> trace_rings;
+
+static std::vector<TraceRing *> free_trace_rings;
+
+uint64_t trace_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Function to get the calling thread's ring, borrowing one on first use
+static TraceRing &trace_ring() {
+  struct Lease {
+    TraceRing *ring = nullptr;
+    ~Lease() {
+      if (ring != nullptr) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        free_trace_rings.push_back(ring);
+      }
+    }
+  };
+  thread_local Lease lease;
+  if (lease.ring == nullptr) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if (free_trace_rings.empty()) {
+      trace_rings.push_back(std::make_unique<TraceRing>());
+      lease.ring = trace_rings.back().get();
+    } else {
+      lease.ring = free_trace_rings.back();
+      free_trace_rings.pop_back();
+    }
+  }
+  return *lease.ring;
+}
+
+void record_trace_event(const TraceEvent &event) {
+  trace_ring().push(event);
+}
+
+void start_trace(const std::string &path) {
+  tracing_enabled = true;
+  trace_path = path;
+  trace_epoch_ns = trace_now_ns();
+}
+
+void trace_after_fork(const std::string &process_name) {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  for (auto &ring : trace_rings) {
+    ring->clear();
+  }
+  trace_children.clear();
+  trace_process_name = process_name;
+}
+
+void print_phase_report(std::ostream &out) {
+  out << "\nPhase profile (milliseconds; worker threads summed):\n";
+  out << "  " << std::left << std::setw(32) << "file" << std::setw(10) << "variant";
+  for (const char *name : PHASE_NAMES) {
+    out << std::right << std::setw(10) << name;
+  }
+  out << "\n";
+  for (const PhaseProfile &profile : phase_profiles) {
+    auto print_row = [&](const std::string &label, const std::string &variant, const PhaseTimes &times) {
+      out << "  " << std::left << std::setw(32) << label << std::setw(10) << variant << std::right << std::fixed
+          << std::setprecision(2);
+      for (uint64_t ns : times.ns) {
+        out << std::setw(10) << ns / 1e6;
+      }
+      out << std::defaultfloat << std::setprecision(6) << "\n";
+    };
+    print_row(profile.file, profile.variant, profile.total);
+    for (size_t i = 0; i < profile.threads.size(); i++) {
+      print_row("    thread " + std::to_string(i), "", profile.threads[i]);
+    }
+  }
+
+  if (!hw_counters_enabled) {
+    return;
+  }
+  out << "\nHardware counters per phase (worker threads summed; misses per 1000 instructions):\n";
+  out << "  " << std::left << std::setw(32) << "file" << std::setw(10) << "variant" << std::setw(10) << "phase"
+      << std::right << std::setw(14) << "cycles" << std::setw(14) << "instructions" << std::setw(7) << "IPC";
+  for (int counter = HW_CACHE_MISSES; counter < NUM_HW_COUNTERS; counter++) {
+    out << std::setw(15) << HW_COUNTER_NAMES[counter];
+  }
+  out << "\n";
+  bool any_counts = false;
+  for (const PhaseProfile &profile : phase_profiles) {
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+      const uint64_t *counts = profile.total.counters[phase];
+      if (counts[HW_CYCLES] == 0) {
+        continue;
+      }
+      any_counts = true;
+      double kilo_instructions = std::max<uint64_t>(1, counts[HW_INSTRUCTIONS]) / 1000.0;
+      out << "  " << std::left << std::setw(32) << profile.file << std::setw(10) << profile.variant << std::setw(10)
+          << PHASE_NAMES[phase] << std::right << std::setw(14) << counts[HW_CYCLES] << std::setw(14)
+          << counts[HW_INSTRUCTIONS] << std::fixed << std::setprecision(2) << std::setw(7)
+          << (double)counts[HW_INSTRUCTIONS] / counts[HW_CYCLES];
+      for (int counter = HW_CACHE_MISSES; counter < NUM_HW_COUNTERS; counter++) {
+        out << std::setw(15) << counts[counter] / kilo_instructions;
+      }
+      out << std::defaultfloat << std::setprecision(6) << "\n";
+    }
+  }
+  if (!any_counts) {
+    out << "  (none recorded; the counters could not be opened)\n";
+  }
+}
+
+std::string json_string(const std::string &text) {
+  std::string quoted = "\"";
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      quoted += escape;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+bool write_phase_json(const std::string &path) {
+  auto phases_object = [](const PhaseTimes &times) {
+    std::string object = "{";
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+      object += (phase > 0 ? ", " : "") + json_string(PHASE_NAMES[phase]) + ": " + std::to_string(times.ns[phase] / 1e9);
+    }
+    return object + "}";
+  };
+  // Phases that recorded hardware events, each as {"cycles": N, ...}
+  auto counters_object = [](const PhaseTimes &times) {
+    std::string object = "{";
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+      if (times.counters[phase][HW_CYCLES] == 0) {
+        continue;
+      }
+      object += (object.size() > 1 ? ", " : "") + json_string(PHASE_NAMES[phase]) + ": {";
+      for (int counter = 0; counter < NUM_HW_COUNTERS; counter++) {
+        object += (counter > 0 ? ", " : "") + json_string(HW_COUNTER_NAMES[counter]) + ": " +
+                  std::to_string(times.counters[phase][counter]);
+      }
+      object += "}";
+    }
+    return object + "}";
+  };
+
+  std::ofstream out(path);
+  out << "{\n  \"profiles\": [";
+  for (size_t i = 0; i < phase_profiles.size(); i++) {
+    const PhaseProfile &profile = phase_profiles[i];
+    out << (i > 0 ? "," : "") << "\n    {\"file\": " << json_string(profile.file)
+        << ", \"variant\": " << json_string(profile.variant) << ",\n     \"seconds\": " << phases_object(profile.total);
+    if (hw_counters_enabled) {
+      out << ",\n     \"counters\": " << counters_object(profile.total);
+    }
+    out << ",\n     \"threads\": [";
+    for (size_t t = 0; t < profile.threads.size(); t++) {
+      out << (t > 0 ? ", " : "") << phases_object(profile.threads[t]);
+    }
+    out << "]}";
+  }
+  out << "\n  ]\n}\n";
+  if (!out) {
+    set_last_error("Error writing profile to " + path);
+    return false;
+  }
+  return true;
+}
+
+void write_trace_events(std::ostream &out) {
+  pid_t pid = getpid();
+  out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << pid
+      << ", \"args\": {\"name\": " << json_string(trace_process_name) << "}}\n";
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  for (const auto &ring : trace_rings) {
+    ring->for_each([&](const TraceEvent &event) {
+      char times[64];
+      snprintf(times, sizeof(times), "\"ts\": %.3f, \"dur\": %.3f", (event.start_ns - trace_epoch_ns) / 1e3,
+               event.duration_ns / 1e3);
+      out << "{\"name\": " << json_string(event.name) << ", \"cat\": \"" << event.category << "\", \"ph\": \"X\", "
+          << times << ", \"pid\": " << pid << ", \"tid\": " << event.tid << "}\n";
+    });
+  }
+}
+
+void write_trace_fragment() {
+  std::ofstream out(trace_path + "." + std::to_string(getpid()));
+  write_trace_events(out);
+}
+
+bool finish_trace() {
+  std::ostringstream events;
+  write_trace_events(events);
+  for (pid_t child : trace_children) {
+    std::string fragment_path = trace_path + "." + std::to_string(child);
+    std::ifstream fragment(fragment_path);
+    events << fragment.rdbuf();
+    unlink(fragment_path.c_str());
+  }
+
+  std::ofstream out(trace_path);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  std::istringstream lines(events.str());
+  std::string line;
+  bool first = true;
+  while (std::getline(lines, line)) {
+    if (!line.empty()) {
+      out << (first ? "" : ",\n") << line;
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+  if (!out) {
+    set_last_error("Error writing trace to " + trace_path);
+    return false;
+  }
+  return true;
+}
+
+void *run_counting_thread(void *arg) {
+  auto *data = (ThreadData *)arg;
+  if (data->chunks == nullptr) {
+    TraceSpan span("chunk", "chunk " + std::to_string(data->text_part.size()) + " bytes");
+    data->worker(arg);
+  } else {
+    size_t index;
+    while ((index = data->next_chunk->fetch_add(1, std::memory_order_relaxed)) < data->chunks->size()) {
+      data->text_part = (*data->chunks)[index];
+      TraceSpan span("chunk", "chunk " + std::to_string(index));
+      data->worker(arg);
+    }
+  }
+  if (data->usage != nullptr) {
+    getrusage(RUSAGE_THREAD, data->usage);
+  }
+  return nullptr;
+}
+
+std::vector<std::string_view> split_at_whitespace(std::string_view text, int num_parts) {
+  std::vector<std::string_view> parts(num_parts);
+  size_t start = 0;
+  for (int i = 0; i < num_parts; i++) {
+    size_t end = std::max(start, (i + 1) * text.length() / num_parts);
+    while (end < text.length() && !is_split_byte(text[end])) {
+      end++;
+    }
+    parts[i] = text.substr(start, end - start);
+    start = end;
+  }
+  return parts;
+}
+
+std::vector<std::string_view> split_segments(const std::vector<std::string_view> &segments, size_t part_size,
+                                             std::string &seams) {
+  std::vector<std::string_view> parts;
+  std::string word; // Partial word carried over from the previous segments
+  for (size_t s = 0; s < segments.size(); s++) {
+    std::string_view segment = segments[s];
+    size_t begin = 0;
+    if (!word.empty()) {
+      while (begin < segment.size() && !is_split_byte(segment[begin])) {
+        begin++;
+      }
+      word.append(segment.data(), begin);
+      if (begin == segment.size()) {
+        continue; // The word runs on into the next segment
+      }
+      seams += word;
+      seams += '\n';
+      word.clear();
+    }
+
+    // Hold back the partial word at the end, unless this is the last segment
+    size_t end = segment.size();
+    if (s + 1 < segments.size()) {
+      end = begin + last_word_boundary(segment.data() + begin, segment.size() - begin);
+    }
+    while (begin < end) {
+      size_t cut = std::min(end, begin + part_size);
+      while (cut < end && !is_split_byte(segment[cut])) {
+        cut++;
+      }
+      parts.push_back(segment.substr(begin, cut - begin));
+      begin = cut;
+    }
+    word.assign(segment.data() + end, segment.size() - end);
+  }
+  seams += word;
+  if (!seams.empty()) {
+    parts.push_back(seams);
+  }
+  return parts;
+}
+
+template <typename Count>
+bool count_text_multi_thread(std::string_view text, std::unordered_map<std::string, Count> &word_count_map,
+                             WordPolicy policy,
+                             CountBackend backend,
+                             size_t hot_cache_entries,
+                             HotCacheStats *hot_cache_stats,
+                             PhaseProfile *profile,
+                             std::vector<struct rusage> *thread_usage,
+                             int num_threads, size_t chunk_size) {
+  switch (policy) {
+  case WordPolicy::ASCII:
+    return count_text_multi_thread<AsciiLettersPolicy>(text, word_count_map, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                       thread_usage, num_threads, chunk_size);
+  case WordPolicy::ALNUM:
+    return count_text_multi_thread<AlnumPolicy>(text, word_count_map, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                thread_usage, num_threads, chunk_size);
+  case WordPolicy::APOSTROPHE:
+    return count_text_multi_thread<ApostrophePolicy>(text, word_count_map, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                     thread_usage, num_threads, chunk_size);
+  default:
+    return count_text_multi_thread<LettersPolicy>(text, word_count_map, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                  thread_usage, num_threads, chunk_size);
+  }
+}
+
+template <typename Count>
+bool count_segments_multi_thread(const std::vector<std::string_view> &segments,
+                                 std::unordered_map<std::string, Count> &word_count_map,
+                                 WordPolicy policy,
+                                 CountBackend backend,
+                                 size_t hot_cache_entries,
+                                 HotCacheStats *hot_cache_stats,
+                                 PhaseProfile *profile,
+                                 std::vector<struct rusage> *thread_usage,
+                                 int num_threads, size_t chunk_size) {
+  switch (policy) {
+  case WordPolicy::ASCII:
+    return count_segments_multi_thread<AsciiLettersPolicy>(segments, word_count_map, backend, hot_cache_entries, hot_cache_stats,
+                                                           profile, thread_usage, num_threads, chunk_size);
+  case WordPolicy::ALNUM:
+    return count_segments_multi_thread<AlnumPolicy>(segments, word_count_map, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                    thread_usage, num_threads, chunk_size);
+  case WordPolicy::APOSTROPHE:
+    return count_segments_multi_thread<ApostrophePolicy>(segments, word_count_map, backend, hot_cache_entries, hot_cache_stats,
+                                                         profile, thread_usage, num_threads, chunk_size);
+  default:
+    return count_segments_multi_thread<LettersPolicy>(segments, word_count_map, backend, hot_cache_entries, hot_cache_stats, profile,
+                                                      thread_usage, num_threads, chunk_size);
+  }
+}
+
+template bool count_text_multi_thread(std::string_view, std::unordered_map<std::string, int> &, WordPolicy, CountBackend,
+                                      size_t, HotCacheStats *, PhaseProfile *, std::vector<struct rusage> *, int, size_t);
+template bool count_text_multi_thread(std::string_view, std::unordered_map<std::string, uint64_t> &, WordPolicy,
+                                      CountBackend, size_t, HotCacheStats *, PhaseProfile *,
+                                      std::vector<struct rusage> *, int, size_t);
+template bool count_segments_multi_thread(const std::vector<std::string_view> &, std::unordered_map<std::string, int> &,
+                                          WordPolicy, CountBackend, size_t, HotCacheStats *, PhaseProfile *,
+                                          std::vector<struct rusage> *, int, size_t);
+template bool count_segments_multi_thread(const std::vector<std::string_view> &,
+                                          std::unordered_map<std::string, uint64_t> &, WordPolicy, CountBackend, size_t,
+                                          HotCacheStats *, PhaseProfile *, std::vector<struct rusage> *, int, size_t);
+
+ArtCounts count_files_art(const std::vector<std::string> &files, std::vector<std::string> *errors) {
+  std::deque<ScopedArena> arenas; // One per tree, outliving it; the merged tree is on the heap
+  std::vector<ArtCounts> trees;
+  for (const std::string &file : files) {
+    std::string file_content;
+    if (!read_input_file(file, file_content)) {
+      if (errors != nullptr) {
+        errors->push_back(last_error());
+      }
+      continue;
+    }
+    std::vector<std::string_view> parts = split_at_whitespace(file_content, MAX_THREADS);
+    size_t first = trees.size();
+    for (int i = 0; i < MAX_THREADS; i++) {
+      trees.emplace_back(arenas.emplace_back().resource());
+    }
+
+    pthread_t threads[MAX_THREADS];
+    bool started[MAX_THREADS];
+    ThreadData thread_data[MAX_THREADS];
+    for (int i = 0; i < MAX_THREADS; i++) {
+      thread_data[i].text_part = parts[i];
+      thread_data[i].art_counts = &trees[first + i];
+      started[i] = pthread_create(&threads[i], nullptr, count_words_art<LettersPolicy>, &thread_data[i]) == 0;
+      if (!started[i]) {
+        count_words_art<LettersPolicy>(&thread_data[i]); // Out of threads: count this part here instead
+      }
+    }
+    for (int i = 0; i < MAX_THREADS; i++) {
+      if (started[i]) {
+        pthread_join(threads[i], nullptr);
+      }
+    }
+  }
+  return ArtCounts::merge(trees, MAX_THREADS);
+}
+
+template <typename Count>
+static std::vector<std::pair<std::string, Count>> top_frequent_words(const std::unordered_map<std::string, Count> &word_count_map,
+                                                                     size_t top_n, PhaseTimes *times) {
+  PhaseTimer timer(times, PHASE_TOP_N);
+  std::vector<std::pair<std::string, Count>> word_freqs(word_count_map.begin(), word_count_map.end());
+
+  // Sort by frequency in descending order
+  std::sort(word_freqs.begin(), word_freqs.end(), [](const auto &a, const auto &b) {
+    return a.second > b.second;
+  });
+
+  if (word_freqs.size() > top_n) {
+    word_freqs.resize(top_n); // Keep only the top N words
+  }
+
+  return word_freqs;
+}
+
+std::vector<std::pair<std::string, int>> get_top_frequent_words(const std::unordered_map<std::string, int> &word_count_map, int top_n,
+                                                                PhaseTimes *times) {
+  return top_frequent_words(word_count_map, top_n, times);
+}
+
+std::vector<std::pair<std::string, uint64_t>> get_top_frequent_words(const std::unordered_map<std::string, uint64_t> &word_count_map,
+                                                                     int top_n, PhaseTimes *times) {
+  return top_frequent_words(word_count_map, top_n, times);
+}
+
+// ---------------------------------------------------------------------------
+// N-gram counting
+// ---------------------------------------------------------------------------
+
+void count_chunk_ngrams(WordPolicy policy, const char *text, size_t length, int n, LocalInterner &interner,
+                        NgramCountMap &counts, ChunkEdges &edges) {
+  switch (policy) {
+  case WordPolicy::ASCII:
+    count_chunk_ngrams<AsciiLettersPolicy>(text, length, n, interner, counts, edges);
+    break;
+  case WordPolicy::ALNUM:
+    count_chunk_ngrams<AlnumPolicy>(text, length, n, interner, counts, edges);
+    break;
+  case WordPolicy::APOSTROPHE:
+    count_chunk_ngrams<ApostrophePolicy>(text, length, n, interner, counts, edges);
+    break;
+  default:
+    count_chunk_ngrams<LettersPolicy>(text, length, n, interner, counts, edges);
+    break;
+  }
+}
+
+void count_crossing_ngrams(const std::vector<ChunkEdges> &chunks, int n, NgramCountMap &counts) {
+  std::vector<uint32_t> history; // Last n-1 word IDs before the current chunk
+  for (const ChunkEdges &chunk : chunks) {
+    // An n-gram ending at the k-th word of this chunk takes n-k words from before it
+    for (size_t k = 1; k <= chunk.head.size(); k++) {
+      if (history.size() + k < (size_t)n) {
+        continue;
+      }
+      NgramKey key{};
+      std::copy(history.end() - (n - k), history.end(), key.ids);
+      std::copy(chunk.head.begin(), chunk.head.begin() + k, key.ids + (n - k));
+      counts[key]++;
+    }
+    if (chunk.words >= (uint64_t)n - 1) {
+      history = chunk.tail;
+    } else {
+      // Short chunk: its head holds all its words, so extend the history with them
+      history.insert(history.end(), chunk.head.begin(), chunk.head.end());
+      if (history.size() > (size_t)n - 1) {
+        history.erase(history.begin(), history.end() - (n - 1));
+      }
+    }
+  }
+}
+
+std::string ngram_text(const NgramCounts &ngrams, const NgramKey &key) {
+  std::string text;
+  for (int k = 0; k < ngrams.n; k++) {
+    if (k > 0) {
+      text += ' ';
+    }
+    text += ngrams.words->word(key.ids[k]);
+  }
+  return text;
+}
+
+std::unordered_map<std::string, int> ngram_string_counts(const NgramCounts &ngrams) {
+  std::unordered_map<std::string, int> word_count_map;
+  word_count_map.reserve(ngrams.counts.size());
+  for (const auto &pair : ngrams.counts) {
+    word_count_map[ngram_text(ngrams, pair.first)] += pair.second;
+  }
+  return word_count_map;
+}
+
+std::vector<std::pair<std::string, int>> get_top_ngrams(const NgramCounts &ngrams, size_t top_n) {
+  std::vector<std::pair<NgramKey, int>> entries(ngrams.counts.begin(), ngrams.counts.end());
+  top_n = std::min(top_n, entries.size());
+  std::partial_sort(entries.begin(), entries.begin() + top_n, entries.end(),
+                    [](const auto &a, const auto &b) { return a.second > b.second; });
+
+  std::vector<std::pair<std::string, int>> top;
+  for (size_t i = 0; i < top_n; i++) {
+    top.emplace_back(ngram_text(ngrams, entries[i].first), entries[i].second);
+  }
+  return top;
+}
+
+// ---------------------------------------------------------------------------
+// Binary count table format (.wfct)
+// ---------------------------------------------------------------------------
+
+uint64_t hash_word(std::string_view word) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : word) {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool CountTableWriter::open(int fd, bool index) {
+  with_index = index;
+  int out_fd = dup(fd);
+  out = out_fd == -1 ? nullptr : fdopen(out_fd, "w");
+  offsets = tmpfile();
+  counts = tmpfile();
+  if (!out || !offsets || !counts) {
+    set_last_error(std::string("Error opening count table output: ") + strerror(errno));
+    failed = true;
+    return false;
+  }
+  CountTableHeader header{}; // Placeholder, rewritten by finish()
+  put(out, &header, sizeof(header));
+  return !failed;
+}
+
+void CountTableWriter::add(std::string_view word, uint64_t count) {
+  if (failed) {
+    return;
+  }
+  if (num_words > 0 && word <= last_word) {
+    set_last_error("Count table words must be added in increasing order");
+    failed = true;
+    return;
+  }
+  last_word.assign(word.data(), word.size());
+  put(offsets, &pool_size, sizeof(pool_size));
+  put(counts, &count, sizeof(count));
+  put(out, word.data(), word.size());
+  if (with_index) {
+    hashes.push_back(hash_word(word));
+    index_counts.push_back(count);
+  }
+  pool_size += word.size();
+  total_count += count;
+  num_words++;
+}
+
+bool CountTableWriter::finish() {
+  if (failed) {
+    close_files();
+    return false;
+  }
+  CountTableHeader header{};
+  memcpy(header.magic, COUNT_TABLE_MAGIC, sizeof(header.magic));
+  header.version = COUNT_TABLE_VERSION;
+  header.num_words = num_words;
+  header.total_count = total_count;
+  header.pool_offset = sizeof(CountTableHeader);
+  header.pool_size = pool_size;
+
+  uint64_t position = header.pool_offset + pool_size;
+  pad_to_alignment(position);
+  header.offsets_offset = position;
+  put(offsets, &pool_size, sizeof(pool_size)); // Terminating offset
+  position += append_file(offsets);
+  header.counts_offset = position;
+  position += append_file(counts);
+
+  if (with_index) {
+    header.flags = COUNT_TABLE_HAS_HASH | COUNT_TABLE_HAS_RANK;
+    header.hash_buckets = 16;
+    while (header.hash_buckets < num_words * 2) {
+      header.hash_buckets <<= 1;
+    }
+    std::vector<uint32_t> buckets(header.hash_buckets, 0);
+    for (uint64_t i = 0; i < num_words; i++) {
+      uint64_t slot = hashes[i] & (header.hash_buckets - 1);
+      while (buckets[slot] != 0) {
+        slot = (slot + 1) & (header.hash_buckets - 1);
+      }
+      buckets[slot] = i + 1;
+    }
+    header.hash_offset = position;
+    put(out, buckets.data(), buckets.size() * sizeof(uint32_t));
+    position += buckets.size() * sizeof(uint32_t);
+
+    std::vector<uint32_t> rank(num_words);
+    for (uint64_t i = 0; i < num_words; i++) {
+      rank[i] = i;
+    }
+    std::stable_sort(rank.begin(), rank.end(), [&](uint32_t a, uint32_t b) { return index_counts[a] > index_counts[b]; });
+    pad_to_alignment(position);
+    header.rank_offset = position;
+    put(out, rank.data(), rank.size() * sizeof(uint32_t));
+  }
+
+  // The header goes in last, so a table is only complete once everything before it was written
+  bool ok = !failed && fflush(out) == 0 && !ferror(out) &&
+            pwrite(fileno(out), &header, sizeof(header), 0) == sizeof(header);
+  if (!ok && !failed) {
+    set_last_error(std::string("Error writing count table: ") + strerror(errno));
+  }
+  close_files();
+  return ok;
+}
+
+void CountTableWriter::put(FILE *file, const void *data, size_t bytes) {
+  if (bytes > 0 && !failed && fwrite(data, 1, bytes, file) != bytes) {
+    set_last_error(std::string("Error writing count table: ") + strerror(errno));
+    failed = true;
+  }
+}
+
+void CountTableWriter::pad_to_alignment(uint64_t &position) {
+  static const char zeros[8] = {};
+  size_t padding = (8 - position % 8) % 8;
+  put(out, zeros, padding);
+  position += padding;
+}
+
+uint64_t CountTableWriter::append_file(FILE *side) {
+  char buffer[64 * 1024];
+  uint64_t copied = 0;
+  size_t n;
+  if (fflush(side) != 0 && !failed) {
+    set_last_error(std::string("Error writing count table: ") + strerror(errno));
+    failed = true;
+  }
+  rewind(side);
+  while (!failed && (n = fread(buffer, 1, sizeof(buffer), side)) > 0) {
+    put(out, buffer, n);
+    copied += n;
+  }
+  if (ferror(side) && !failed) {
+    set_last_error(std::string("Error reading count table side file: ") + strerror(errno));
+    failed = true;
+  }
+  return copied;
+}
+
+void CountTableWriter::close_files() {
+  for (FILE **file : {&out, &offsets, &counts}) {
+    if (*file) {
+      fclose(*file);
+      *file = nullptr;
+    }
+  }
+}
+
+bool CountTableView::open(const std::string &path, int advice) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    set_last_error("Error opening count table " + path + ": " + strerror(errno));
+    return false;
+  }
+  bool ok = map(fd, advice);
+  close(fd);
+  if (!ok) {
+    set_last_error("Invalid count table: " + path);
+  }
+  return ok;
+}
+
+bool CountTableView::map(int fd, int advice) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CountTableHeader)) {
+    return false;
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  base = (const char *)data;
+  length = st.st_size;
+  memcpy(&header, base, sizeof(header));
+
+  uint64_t n = header.num_words;
+  auto section_fits = [&](uint64_t offset, uint64_t bytes) {
+    return offset % 8 == 0 && offset <= length && bytes <= length - offset;
+  };
+  bool valid = memcmp(header.magic, COUNT_TABLE_MAGIC, sizeof(header.magic)) == 0 &&
+               header.version == COUNT_TABLE_VERSION && n < UINT32_MAX &&
+               header.pool_offset <= length && header.pool_size <= length - header.pool_offset &&
+               section_fits(header.offsets_offset, (n + 1) * 8) && section_fits(header.counts_offset, n * 8);
+  if (valid && (header.flags & COUNT_TABLE_HAS_HASH)) {
+    valid = header.hash_buckets > 0 && (header.hash_buckets & (header.hash_buckets - 1)) == 0 &&
+            header.hash_offset % 4 == 0 && header.hash_offset <= length &&
+            header.hash_buckets <= (length - header.hash_offset) / 4;
+  }
+  if (valid && (header.flags & COUNT_TABLE_HAS_RANK)) {
+    valid = section_fits(header.rank_offset, n * 4);
+  }
+  if (!valid) {
+    munmap(data, length);
+    base = nullptr;
+    return false;
+  }
+
+  pool = base + header.pool_offset;
+  offsets = (const uint64_t *)(base + header.offsets_offset);
+  counts = (const uint64_t *)(base + header.counts_offset);
+  hash = (header.flags & COUNT_TABLE_HAS_HASH) ? (const uint32_t *)(base + header.hash_offset) : nullptr;
+  rank = (header.flags & COUNT_TABLE_HAS_RANK) ? (const uint32_t *)(base + header.rank_offset) : nullptr;
+
+  // Every index must stay inside its section: word bounds never decrease and
+  // end at the pool size, and hash slots and ranks name words of the table. A
+  // table opened for one sequential pass drops the checked offsets as it goes,
+  // so opening many runs for a merge does not make all their offsets resident.
+  const uint64_t CHECK_WINDOW = 1 << 16;
+  bool streamed = advice == MADV_SEQUENTIAL;
+  valid = offsets[n] == header.pool_size;
+  for (uint64_t i = 0; valid && i < n; i++) {
+    valid = offsets[i] <= offsets[i + 1];
+    if (streamed && (i + 1) % CHECK_WINDOW == 0) {
+      release_before(i + 1);
+    }
+  }
+  for (uint64_t slot = 0; valid && hash && slot < header.hash_buckets; slot++) {
+    valid = hash[slot] <= n; // Slots hold word index + 1, or 0 when empty
+  }
+  for (uint64_t r = 0; valid && rank && r < n; r++) {
+    valid = rank[r] < n;
+  }
+  if (!valid) {
+    munmap(data, length);
+    base = nullptr;
+    pool = nullptr;
+    offsets = counts = nullptr;
+    hash = rank = nullptr;
+    return false;
+  }
+  if (streamed) {
+    release_before(n);
+  }
+  madvise(data, length, advice);
+  return true;
+}
+
+void CountTableView::release_before(uint64_t i) const {
+  long page = sysconf(_SC_PAGESIZE);
+  auto release = [&](const char *begin, const char *end) {
+    const char *aligned = base + ((begin - base + page - 1) / page) * page;
+    const char *last = base + ((end - base) / page) * page;
+    if (last > aligned) {
+      madvise((void *)aligned, last - aligned, MADV_DONTNEED);
+    }
+  };
+  release(pool, pool + offsets[i]);
+  release((const char *)offsets, (const char *)(offsets + i));
+  release((const char *)counts, (const char *)(counts + i));
+}
+
+bool write_count_table(int fd, const std::unordered_map<std::string, int> &word_count_map, bool with_index) {
+  std::vector<const std::pair<const std::string, int> *> entries;
+  entries.reserve(word_count_map.size());
+  for (const auto &pair : word_count_map) {
+    entries.push_back(&pair);
+  }
+  std::sort(entries.begin(), entries.end(), [](const auto *a, const auto *b) { return a->first < b->first; });
+
+  CountTableWriter writer;
+  if (!writer.open(fd, with_index)) {
+    return false;
+  }
+  for (const auto *entry : entries) {
+    writer.add(entry->first, entry->second);
+  }
+  return writer.finish();
+}
+
+bool save_count_table(const std::string &path, const std::unordered_map<std::string, int> &word_count_map) {
+  std::string temp_path = path + ".tmp";
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    set_last_error("Error creating " + temp_path + ": " + strerror(errno));
+    return false;
+  }
+  bool ok = write_count_table(fd, word_count_map);
+  close(fd);
+  if (ok && rename(temp_path.c_str(), path.c_str()) == -1) {
+    set_last_error("Error renaming " + temp_path + ": " + strerror(errno));
+    ok = false;
+  }
+  if (!ok) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void merge_count_tables(const std::vector<const CountTableView *> &tables,
+                        const std::function<void(std::string_view, uint64_t)> &emit, size_t release_bytes) {
+  // Entries per release: an entry costs its word plus its offset and count
+  std::vector<uint64_t> release_interval(tables.size());
+  for (size_t t = 0; t < tables.size(); t++) {
+    uint64_t words = tables[t]->size();
+    uint64_t entry_bytes = 2 * sizeof(uint64_t) + (words > 0 ? tables[t]->header.pool_size / words : 0);
+    release_interval[t] = std::max<uint64_t>(1, release_bytes / entry_bytes);
+  }
+
+  // Heap of (table, position), smallest word on top
+  auto greater = [&](const std::pair<size_t, uint64_t> &a, const std::pair<size_t, uint64_t> &b) {
+    return tables[a.first]->word(a.second) > tables[b.first]->word(b.second);
+  };
+  std::vector<std::pair<size_t, uint64_t>> heap;
+  for (size_t t = 0; t < tables.size(); t++) {
+    if (tables[t]->size() > 0) {
+      heap.emplace_back(t, 0);
+    }
+  }
+  std::make_heap(heap.begin(), heap.end(), greater);
+
+  while (!heap.empty()) {
+    std::string_view word = tables[heap.front().first]->word(heap.front().second);
+    uint64_t count = 0;
+    while (!heap.empty() && tables[heap.front().first]->word(heap.front().second) == word) {
+      std::pop_heap(heap.begin(), heap.end(), greater);
+      auto &top = heap.back();
+      count += tables[top.first]->count(top.second);
+      if (++top.second % release_interval[top.first] == 0) {
+        tables[top.first]->release_before(top.second); // Keep RSS flat while streaming runs
+      }
+      if (top.second < tables[top.first]->size()) {
+        std::push_heap(heap.begin(), heap.end(), greater);
+      } else {
+        heap.pop_back();
+      }
+    }
+    emit(word, count);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Byte sources: plain descriptors and streaming decompressors
+// ---------------------------------------------------------------------------
+
+Compression detect_compression(const unsigned char *magic, size_t length) {
+  if (length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return Compression::GZIP;
+  }
+  if (length >= 3 && magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h') {
+    return Compression::BZIP2;
+  }
+  if (length >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+    return Compression::ZSTD;
+  }
+  return Compression::NONE;
+}
+
+const char *compression_name(Compression compression) {
+  switch (compression) {
+  case Compression::GZIP:
+    return "gzip";
+  case Compression::BZIP2:
+    return "bzip2";
+  case Compression::ZSTD:
+    return "zstd";
+  default:
+    return "plain";
+  }
+}
+
+// Reads a descriptor, first returning any bytes already consumed for sniffing
+struct FdSource : ByteSource {
+  int fd;
+  std::string pending;
+  size_t pending_pos = 0;
+
+  explicit FdSource(int input_fd, std::string prefix = "") : fd(input_fd), pending(std::move(prefix)) {}
+
+  ssize_t read(char *buffer, size_t length) override {
+    if (pending_pos < pending.size()) {
+      size_t n = std::min(length, pending.size() - pending_pos);
+      memcpy(buffer, pending.data() + pending_pos, n);
+      pending_pos += n;
+      return n;
+    }
+    ssize_t n;
+    while ((n = ::read(fd, buffer, length)) == -1 && errno == EINTR) {
+    }
+    if (n == -1) {
+      set_last_error(std::string("Error reading input: ") + strerror(errno));
+    }
+    return n;
+  }
+};
+
+const size_t COMPRESSED_BUFFER_SIZE = 256 * 1024;
+#ifdef WORDFREQ_HAVE_ZLIB
+// Streaming gzip/zlib decoder; concatenated gzip members are decoded back to back
+struct GzipSource : ByteSource {
+  std::unique_ptr<ByteSource> input;
+  z_stream stream{};
+  std::vector<char> in_buffer;
+  bool at_end = false;
+  bool input_done = false;
+
+  explicit GzipSource(std::unique_ptr<ByteSource> compressed)
+      : input(std::move(compressed)), in_buffer(COMPRESSED_BUFFER_SIZE) {
+    inflateInit2(&stream, 15 + 32); // Auto-detect gzip or zlib headers
+  }
+  ~GzipSource() override { inflateEnd(&stream); }
+
+  ssize_t read(char *buffer, size_t length) override {
+    stream.next_out = (Bytef *)buffer;
+    stream.avail_out = length;
+    while (stream.avail_out == length && !at_end) {
+      if (stream.avail_in == 0 && !input_done) {
+        ssize_t n = input->read(in_buffer.data(), in_buffer.size());
+        if (n < 0) {
+          return -1;
+        }
+        input_done = n == 0;
+        stream.next_in = (Bytef *)in_buffer.data();
+        stream.avail_in = n;
+      }
+      int result = inflate(&stream, Z_NO_FLUSH);
+      if (result == Z_STREAM_END) {
+        // Another member may follow (cat a.gz b.gz, pigz --independent output)
+        if (stream.avail_in == 0 && !input_done) {
+          ssize_t n = input->read(in_buffer.data(), in_buffer.size());
+          if (n < 0) {
+            return -1;
+          }
+          input_done = n == 0;
+          stream.next_in = (Bytef *)in_buffer.data();
+          stream.avail_in = n;
+        }
+        if (stream.avail_in == 0) {
+          at_end = true;
+        } else {
+          inflateReset(&stream);
+        }
+      } else if (result != Z_OK && !(result == Z_BUF_ERROR && stream.avail_in == 0 && !input_done)) {
+        set_last_error(std::string("gzip decompression failed: ") + (stream.msg ? stream.msg : "truncated input"));
+        return -1;
+      }
+    }
+    return length - stream.avail_out;
+  }
+};
+
+// Function to decode one complete gzip member held in memory
+bool decode_gzip_member(const char *data, size_t size, std::string &output) {
+  z_stream stream{};
+  if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+    set_last_error("gzip decompression failed: out of memory");
+    return false;
+  }
+  // BGZF and plain gzip members end with ISIZE, the uncompressed size mod 2^32
+  uint32_t expected = 0;
+  if (size >= 4) {
+    memcpy(&expected, data + size - 4, sizeof(expected));
+  }
+  output.resize(expected);
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = size;
+  int result = Z_OK;
+  while (result == Z_OK) {
+    if (stream.total_out == output.size()) {
+      output.resize(output.size() * 2 + 4096);
+    }
+    stream.next_out = (Bytef *)&output[stream.total_out];
+    stream.avail_out = output.size() - stream.total_out;
+    result = inflate(&stream, Z_FINISH);
+    if (result == Z_BUF_ERROR && stream.avail_out == 0) {
+      result = Z_OK; // Output buffer too small, grow and continue
+    }
+  }
+  output.resize(stream.total_out);
+  inflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    set_last_error(std::string("gzip decompression failed: ") + (stream.msg ? stream.msg : "truncated input"));
+    return false;
+  }
+  return true;
+}
+
+// Function to split a BGZF file into its blocks; returns false if it is not BGZF
+bool split_bgzf_blocks(const unsigned char *data, size_t size, std::vector<std::pair<size_t, size_t>> &blocks) {
+  size_t pos = 0;
+  while (pos < size) {
+    // Fixed 10-byte header with FEXTRA set, then a BC subfield holding BSIZE
+    if (size - pos < 18 || data[pos] != 0x1f || data[pos + 1] != 0x8b || data[pos + 2] != 8 || !(data[pos + 3] & 4)) {
+      return false;
+    }
+    uint16_t extra_length = data[pos + 10] | (data[pos + 11] << 8);
+    size_t block_size = 0;
+    for (size_t field = pos + 12; field + 4 <= pos + 12 + extra_length && field + 4 <= size;) {
+      uint16_t field_length = data[field + 2] | (data[field + 3] << 8);
+      if (data[field] == 'B' && data[field + 1] == 'C' && field_length == 2 && field + 6 <= size) {
+        block_size = (data[field + 4] | (data[field + 5] << 8)) + 1;
+      }
+      field += 4 + field_length;
+    }
+    if (block_size == 0 || block_size > size - pos) {
+      return false;
+    }
+    blocks.emplace_back(pos, block_size);
+    pos += block_size;
+  }
+  return blocks.size() > 1;
+}
+#endif
+#ifdef WORDFREQ_HAVE_BZIP2
+// Streaming bzip2 decoder; concatenated streams (pbzip2 output) are decoded back to back
+struct Bzip2Source : ByteSource {
+  std::unique_ptr<ByteSource> input;
+  bz_stream stream{};
+  std::vector<char> in_buffer;
+  bool at_end = false;
+  bool input_done = false;
+
+  explicit Bzip2Source(std::unique_ptr<ByteSource> compressed)
+      : input(std::move(compressed)), in_buffer(COMPRESSED_BUFFER_SIZE) {
+    BZ2_bzDecompressInit(&stream, 0, 0);
+  }
+  ~Bzip2Source() override { BZ2_bzDecompressEnd(&stream); }
+
+  bool refill() {
+    ssize_t n = input->read(in_buffer.data(), in_buffer.size());
+    if (n < 0) {
+      return false;
+    }
+    input_done = n == 0;
+    stream.next_in = in_buffer.data();
+    stream.avail_in = n;
+    return true;
+  }
+
+  ssize_t read(char *buffer, size_t length) override {
+    stream.next_out = buffer;
+    stream.avail_out = length;
+    while (stream.avail_out == length && !at_end) {
+      if (stream.avail_in == 0 && !input_done && !refill()) {
+        return -1;
+      }
+      if (stream.avail_in == 0 && input_done) {
+        set_last_error("bzip2 decompression failed: truncated input");
+        return -1;
+      }
+      int result = BZ2_bzDecompress(&stream);
+      if (result == BZ_STREAM_END) {
+        if (stream.avail_in == 0 && !input_done && !refill()) {
+          return -1;
+        }
+        if (stream.avail_in == 0) {
+          at_end = true;
+        } else {
+          // Restart the decoder for the next stream, keeping the unread input
+          char *next_in = stream.next_in;
+          unsigned int avail_in = stream.avail_in;
+          char *next_out = stream.next_out;
+          unsigned int avail_out = stream.avail_out;
+          BZ2_bzDecompressEnd(&stream);
+          stream = bz_stream{};
+          BZ2_bzDecompressInit(&stream, 0, 0);
+          stream.next_in = next_in;
+          stream.avail_in = avail_in;
+          stream.next_out = next_out;
+          stream.avail_out = avail_out;
+        }
+      } else if (result != BZ_OK) {
+        set_last_error("bzip2 decompression failed (error " + std::to_string(result) + ")");
+        return -1;
+      }
+    }
+    return length - stream.avail_out;
+  }
+};
+#endif
+#ifdef WORDFREQ_HAVE_ZSTD
+// Streaming zstd decoder; multiple frames are handled by the library
+struct ZstdSource : ByteSource {
+  std::unique_ptr<ByteSource> input;
+  ZSTD_DCtx *context;
+  std::vector<char> in_buffer;
+  ZSTD_inBuffer in{nullptr, 0, 0};
+  bool input_done = false;
+  size_t last_result = 0;
+
+  explicit ZstdSource(std::unique_ptr<ByteSource> compressed)
+      : input(std::move(compressed)), context(ZSTD_createDCtx()), in_buffer(ZSTD_DStreamInSize()) {}
+  ~ZstdSource() override { ZSTD_freeDCtx(context); }
+
+  ssize_t read(char *buffer, size_t length) override {
+    ZSTD_outBuffer out{buffer, length, 0};
+    while (out.pos == 0) {
+      if (in.pos == in.size) {
+        if (input_done) {
+          if (last_result != 0) {
+            set_last_error("zstd decompression failed: truncated input");
+            return -1;
+          }
+          return 0;
+        }
+        ssize_t n = input->read(in_buffer.data(), in_buffer.size());
+        if (n < 0) {
+          return -1;
+        }
+        input_done = n == 0;
+        in = ZSTD_inBuffer{in_buffer.data(), (size_t)n, 0};
+        if (n == 0) {
+          continue;
+        }
+      }
+      last_result = ZSTD_decompressStream(context, &out, &in);
+      if (ZSTD_isError(last_result)) {
+        set_last_error(std::string("zstd decompression failed: ") + ZSTD_getErrorName(last_result));
+        return -1;
+      }
+    }
+    return out.pos;
+  }
+};
+
+// Function to decode one complete zstd frame (or skippable frame) held in memory
+bool decode_zstd_frame(const char *data, size_t size, std::string &output) {
+  ZSTD_DCtx *context = ZSTD_createDCtx();
+  ZSTD_inBuffer in{data, size, 0};
+  size_t result = 1;
+  output.clear();
+  while (in.pos < in.size && result != 0) {
+    size_t start = output.size();
+    output.resize(start + ZSTD_DStreamOutSize());
+    ZSTD_outBuffer out{&output[start], ZSTD_DStreamOutSize(), 0};
+    result = ZSTD_decompressStream(context, &out, &in);
+    output.resize(start + out.pos);
+    if (ZSTD_isError(result)) {
+      set_last_error(std::string("zstd decompression failed: ") + ZSTD_getErrorName(result));
+      break;
+    }
+  }
+  ZSTD_freeDCtx(context);
+  return result == 0;
+}
+
+// Function to split a zstd file into its frames; returns false if any frame is invalid
+bool split_zstd_frames(const char *data, size_t size, std::vector<std::pair<size_t, size_t>> &frames) {
+  size_t pos = 0;
+  while (pos < size) {
+    size_t frame_size = ZSTD_findFrameCompressedSize(data + pos, size - pos);
+    if (ZSTD_isError(frame_size)) {
+      return false;
+    }
+    frames.emplace_back(pos, frame_size);
+    pos += frame_size;
+  }
+  return true;
+}
+#endif
+
+// Decodes independent compressed frames of a mapped file on worker threads and
+// returns their output in order. At most `window` decoded frames are held at once.
+struct ParallelFrameSource : ByteSource {
+  typedef bool (*DecodeFrame)(const char *, size_t, std::string &);
+
+  struct Slot {
+    std::string output;
+    bool ready = false;
+    bool failed = false;
+    std::string error; // Decoder's message when failed
+  };
+
+  const char *data;
+  size_t size;
+  std::vector<std::pair<size_t, size_t>> frames;
+  DecodeFrame decode;
+  std::vector<Slot> slots;
+  std::vector<pthread_t> threads;
+  std::mutex mutex;
+  std::condition_variable changed;
+  size_t next_claim = 0;   // Next frame a decoder thread will take
+  size_t next_deliver = 0; // Frame currently returned by read()
+  size_t deliver_pos = 0;
+  bool stopping = false;
+
+  ParallelFrameSource(const char *mapped, size_t mapped_size, std::vector<std::pair<size_t, size_t>> frame_list,
+                      DecodeFrame decoder, int num_threads)
+      : data(mapped), size(mapped_size), frames(std::move(frame_list)), decode(decoder), slots(2 * num_threads),
+        threads(num_threads) {
+    for (size_t i = 0; i < threads.size(); i++) {
+      if (pthread_create(&threads[i], nullptr, decode_worker, this) != 0) {
+        threads.resize(i); // Run with the decoders that did start; none means the caller must fall back
+        break;
+      }
+    }
+  }
+
+  ~ParallelFrameSource() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      changed.notify_all();
+    }
+    for (pthread_t thread : threads) {
+      pthread_join(thread, nullptr);
+    }
+    munmap((void *)data, size);
+  }
+
+  static void *decode_worker(void *arg) {
+    auto *source = (ParallelFrameSource *)arg;
+    std::unique_lock<std::mutex> lock(source->mutex);
+    for (;;) {
+      // Only run ahead of the reader by the window size
+      source->changed.wait(lock, [&] {
+        return source->stopping || source->next_claim >= source->frames.size() ||
+               source->next_claim < source->next_deliver + source->slots.size();
+      });
+      if (source->stopping || source->next_claim >= source->frames.size()) {
+        return nullptr;
+      }
+      size_t frame = source->next_claim++;
+      Slot &slot = source->slots[frame % source->slots.size()];
+      lock.unlock();
+      std::string output;
+      bool ok = source->decode(source->data + source->frames[frame].first, source->frames[frame].second, output);
+      lock.lock();
+      slot.output = std::move(output);
+      slot.failed = !ok;
+      if (!ok) {
+        slot.error = last_error();
+      }
+      slot.ready = true;
+      source->changed.notify_all();
+    }
+  }
+
+  ssize_t read(char *buffer, size_t length) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (next_deliver >= frames.size()) {
+        return 0;
+      }
+      Slot &slot = slots[next_deliver % slots.size()];
+      changed.wait(lock, [&] { return slot.ready; });
+      if (slot.failed) {
+        set_last_error(slot.error);
+        return -1;
+      }
+      if (deliver_pos < slot.output.size()) {
+        size_t n = std::min(length, slot.output.size() - deliver_pos);
+        memcpy(buffer, slot.output.data() + deliver_pos, n);
+        deliver_pos += n;
+        return n;
+      }
+      // Frame fully delivered: free its slot for the decoders
+      slot = Slot();
+      next_deliver++;
+      deliver_pos = 0;
+      changed.notify_all();
+    }
+  }
+};
+
+std::unique_ptr<ByteSource> open_input_source(int fd, int num_threads) {
+  unsigned char magic[4];
+  size_t magic_length = 0;
+  ssize_t n;
+  while (magic_length < sizeof(magic) &&
+         ((n = ::read(fd, magic + magic_length, sizeof(magic) - magic_length)) > 0 || (n == -1 && errno == EINTR))) {
+    magic_length += n > 0 ? n : 0;
+  }
+  Compression compression = detect_compression(magic, magic_length);
+  std::unique_ptr<ByteSource> raw(new FdSource(fd, std::string((const char *)magic, magic_length)));
+  if (compression == Compression::NONE) {
+    return raw;
+  }
+
+  // Independent frames of a regular file can be found without decoding them
+  struct stat st;
+  if (num_threads > 1 && (compression == Compression::ZSTD || compression == Compression::GZIP) &&
+      fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      std::vector<std::pair<size_t, size_t>> frames;
+      ParallelFrameSource::DecodeFrame decoder = nullptr;
+#ifdef WORDFREQ_HAVE_ZSTD
+      if (compression == Compression::ZSTD && split_zstd_frames((const char *)mapped, st.st_size, frames) &&
+          frames.size() > 1) {
+        decoder = decode_zstd_frame;
+      }
+#endif
+#ifdef WORDFREQ_HAVE_ZLIB
+      if (compression == Compression::GZIP && split_bgzf_blocks((const unsigned char *)mapped, st.st_size, frames)) {
+        decoder = decode_gzip_member;
+      }
+#endif
+      if (decoder) {
+        madvise(mapped, st.st_size, MADV_WILLNEED);
+        std::unique_ptr<ParallelFrameSource> parallel(
+            new ParallelFrameSource((const char *)mapped, st.st_size, std::move(frames), decoder, num_threads));
+        if (!parallel->threads.empty()) {
+          return parallel;
+        }
+        // No decoder thread could be started (the source unmaps the file): decode the stream serially
+      } else {
+        munmap(mapped, st.st_size);
+      }
+    }
+  }
+
+  switch (compression) {
+#ifdef WORDFREQ_HAVE_ZLIB
+  case Compression::GZIP:
+    return std::unique_ptr<ByteSource>(new GzipSource(std::move(raw)));
+#endif
+#ifdef WORDFREQ_HAVE_BZIP2
+  case Compression::BZIP2:
+    return std::unique_ptr<ByteSource>(new Bzip2Source(std::move(raw)));
+#endif
+#ifdef WORDFREQ_HAVE_ZSTD
+  case Compression::ZSTD:
+    return std::unique_ptr<ByteSource>(new ZstdSource(std::move(raw)));
+#endif
+  default:
+    set_last_error(std::string("Input is ") + compression_name(compression) +
+                   " compressed, but this build has no support for it");
+    return nullptr;
+  }
+}
+
+// Function to read a whole input file into memory, decompressing it if needed
+bool read_input_file(const std::string &path, std::string &content) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    set_last_error("Error opening file: " + path + ": " + strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    content.reserve(st.st_size);
+  }
+  std::unique_ptr<ByteSource> source = open_input_source(fd);
+  bool ok = source != nullptr;
+  char buffer[256 * 1024];
+  ssize_t n = 0;
+  while (ok && (n = source->read(buffer, sizeof(buffer))) > 0) {
+    content.append(buffer, n);
+  }
+  source.reset();
+  close(fd);
+  if (!ok || n != 0) {
+    set_last_error("Error reading " + path + ": " + last_error());
+  }
+  return ok && n == 0;
+}
+
+// ---------------------------------------------------------------------------
+// Chunked input and external-memory counting
+// ---------------------------------------------------------------------------
+
+bool read_chunks(ByteSource &source, StringQueue &queue, size_t chunk_size, uint64_t *bytes_read) {
+  std::string chunk;
+  bool ok = true;
+  for (;;) {
+    // Fill a whole chunk; pipes often return much less than asked for
+    size_t start = chunk.size();
+    chunk.resize(start + chunk_size);
+    size_t filled = start;
+    while (filled < chunk.size()) {
+      ssize_t n = source.read(&chunk[filled], chunk.size() - filled);
+      if (n <= 0) {
+        ok = n == 0;
+        break;
+      }
+      filled += n;
+      if (bytes_read) {
+        *bytes_read += n;
+      }
+    }
+    bool at_end = filled < chunk.size();
+    chunk.resize(filled);
+    if (at_end) {
+      break;
+    }
+    size_t boundary = last_word_boundary(chunk.data(), chunk.size());
+    if (boundary == 0) {
+      continue; // One word spans the whole chunk so far; keep reading
+    }
+    std::string carry = chunk.substr(boundary);
+    chunk.resize(boundary);
+    queue.push(std::move(chunk));
+    chunk = std::move(carry);
+  }
+  if (!chunk.empty()) {
+    queue.push(std::move(chunk));
+  }
+  queue.close();
+  return ok;
+}
+
+bool spill_run(SpillContext &context, std::unordered_map<std::string, int> &word_count_map) {
+  std::string path = context.spill_dir + "/wordfreq-run-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd == -1) {
+    set_last_error("Error creating spill file in " + context.spill_dir + ": " + strerror(errno));
+    return false;
+  }
+  bool ok = write_count_table(fd, word_count_map, false);
+  struct stat st;
+  uint64_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+  close(fd);
+  if (!ok) {
+    unlink(path.c_str());
+    return false;
+  }
+  std::unordered_map<std::string, int>().swap(word_count_map); // Give the memory back
+
+  std::lock_guard<std::mutex> lock(context.runs_mutex);
+  context.runs.push_back(path);
+  context.bytes_spilled += size;
+  return true;
+}
+
+// Function to merge a group of runs into one new run in the spill directory;
+// the inputs are unlinked as soon as they are mapped, whether or not this succeeds
+static bool merge_runs(const std::vector<std::string> &paths, const std::string &spill_dir, size_t release_bytes,
+                       std::string &merged_path) {
+  std::vector<std::unique_ptr<CountTableView>> views;
+  std::vector<const CountTableView *> tables;
+  bool ok = true;
+  for (const std::string &path : paths) {
+    views.emplace_back(new CountTableView);
+    ok = ok && views.back()->open(path, MADV_SEQUENTIAL);
+    unlink(path.c_str());
+    tables.push_back(views.back().get());
+  }
+  if (!ok) {
+    return false;
+  }
+  merged_path = spill_dir + "/wordfreq-run-XXXXXX";
+  int fd = mkstemp(&merged_path[0]);
+  if (fd == -1) {
+    set_last_error("Error creating spill file in " + spill_dir + ": " + strerror(errno));
+    return false;
+  }
+  CountTableWriter writer;
+  ok = writer.open(fd, false);
+  close(fd); // The writer keeps its own duplicate
+  if (ok) {
+    merge_count_tables(tables, [&](std::string_view word, uint64_t count) { writer.add(word, count); }, release_bytes);
+    ok = writer.finish();
+  }
+  if (!ok) {
+    unlink(merged_path.c_str());
+  }
+  return ok;
+}
+
+void *spill_count_worker(void *arg) {
+  auto *data = (SpillThreadData *)arg;
+  // Not on an arena: each spill must give the table's memory back for the next run
+  std::unordered_map<std::string, int> local_word_count;
+  size_t estimated_bytes = 0;
+  std::string chunk;
+
+  while (data->queue->pop(chunk)) {
+    for_each_word(chunk.data(), chunk.size(), [&](const std::string &word) {
+      auto inserted = local_word_count.try_emplace(word, 0);
+      inserted.first->second++;
+      if (inserted.second) {
+        estimated_bytes += estimate_entry_bytes(word);
+        // Spill as soon as the table outgrows its share, even mid-chunk
+        if (estimated_bytes > data->context->thread_budget && !data->failed) {
+          data->failed = !spill_run(*data->context, local_word_count);
+          estimated_bytes = 0;
+        }
+      }
+    });
+  }
+  if (!local_word_count.empty() && !data->failed) {
+    data->failed = !spill_run(*data->context, local_word_count);
+  }
+  if (data->failed) {
+    data->error = last_error();
+  }
+  return nullptr;
+}
+
+bool count_files_external(const std::vector<std::string> &files, const ExternalOptions &options, TopWords &top,
+                          ExternalStats &stats) {
+  SpillContext context;
+  context.spill_dir = options.spill_dir;
+  size_t queue_chunks = 2 * options.threads;
+  size_t queue_bytes = (queue_chunks + options.threads) * options.chunk_size;
+  size_t table_budget = options.memory_budget > 2 * queue_bytes ? options.memory_budget - queue_bytes
+                                                                : options.memory_budget / 2;
+  context.thread_budget = table_budget / options.threads;
+
+  bool ok = true;
+  for (const std::string &file : files) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      set_last_error("Error opening file: " + file + ": " + strerror(errno));
+      ok = false;
+      break;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    StringQueue queue(queue_chunks);
+    std::vector<pthread_t> threads(options.threads);
+    std::vector<SpillThreadData> thread_data(options.threads);
+    int started = 0;
+    for (int i = 0; i < options.threads; i++) {
+      thread_data[i].queue = &queue;
+      thread_data[i].context = &context;
+      if (pthread_create(&threads[i], nullptr, spill_count_worker, &thread_data[i]) != 0) {
+        break;
+      }
+      started++;
+    }
+    std::unique_ptr<ByteSource> source = started > 0 ? open_input_source(fd, options.threads) : nullptr;
+    if (started == 0) {
+      set_last_error("Error creating threads for " + file);
+      queue.close();
+      ok = false;
+    } else if (source) {
+      ok = read_chunks(*source, queue, options.chunk_size);
+      if (!ok) {
+        set_last_error("Error reading " + file + ": " + last_error());
+      }
+    } else {
+      set_last_error(file + ": " + last_error());
+      queue.close();
+      ok = false;
+    }
+    for (int i = 0; i < started; i++) {
+      pthread_join(threads[i], nullptr);
+      if (ok && thread_data[i].failed) {
+        set_last_error(thread_data[i].error);
+        ok = false;
+      }
+    }
+    close(fd);
+    if (!ok) {
+      break;
+    }
+  }
+
+  // Merge groups of at most merge_fan_in runs into longer runs until one merge
+  // can take them all. Every mapped run streams through its share of the budget.
+  std::vector<std::string> runs = context.runs;
+  size_t fan_in = std::max<size_t>(2, options.merge_fan_in);
+  size_t release_bytes = options.memory_budget / std::max<size_t>(1, std::min(runs.size(), fan_in));
+  stats.runs = runs.size();
+  stats.bytes_spilled = context.bytes_spilled;
+  stats.merge_passes = 0;
+  while (ok && runs.size() > fan_in) {
+    std::vector<std::string> next;
+    size_t first = 0;
+    for (; ok && first < runs.size(); first += fan_in) {
+      std::vector<std::string> group(runs.begin() + first, runs.begin() + std::min(first + fan_in, runs.size()));
+      std::string merged = group[0];
+      ok = group.size() == 1 || merge_runs(group, options.spill_dir, release_bytes, merged);
+      if (ok) {
+        next.push_back(merged);
+      }
+    }
+    // After a failure the groups not reached yet are left for the cleanup below
+    next.insert(next.end(), runs.begin() + std::min(first, runs.size()), runs.end());
+    runs = std::move(next);
+    stats.merge_passes++;
+  }
+
+  // Map the remaining runs for the final merge; they are unlinked as soon as they are mapped
+  std::vector<std::unique_ptr<CountTableView>> views;
+  std::vector<const CountTableView *> tables;
+  for (const std::string &path : runs) {
+    views.emplace_back(new CountTableView);
+    ok = ok && views.back()->open(path, MADV_SEQUENTIAL);
+    unlink(path.c_str());
+    tables.push_back(views.back().get());
+  }
+  if (!ok) {
+    return false;
+  }
+
+  CountTableWriter writer;
+  std::string temp_path = options.output + ".tmp";
+  bool write_output = !options.output.empty();
+  if (write_output) {
+    int out_fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool opened = out_fd != -1 && writer.open(out_fd, false);
+    if (out_fd != -1) {
+      close(out_fd); // The writer keeps its own duplicate
+    }
+    if (!opened) {
+      if (out_fd == -1) {
+        set_last_error("Error creating " + temp_path + ": " + strerror(errno));
+      }
+      unlink(temp_path.c_str());
+      return false;
+    }
+  }
+  stats.distinct_words = 0;
+  merge_count_tables(
+      tables,
+      [&](std::string_view word, uint64_t count) {
+        top.offer(word, count);
+        stats.distinct_words++;
+        if (write_output) {
+          writer.add(word, count);
+        }
+      },
+      release_bytes);
+
+  if (write_output) {
+    ok = writer.finish();
+    if (ok && rename(temp_path.c_str(), options.output.c_str()) == -1) {
+      set_last_error("Error renaming " + temp_path + ": " + strerror(errno));
+      ok = false;
+    }
+    if (!ok) {
+      unlink(temp_path.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+void *count_chunks_worker(void *arg) {
+  auto *data = (ChunkCountData *)arg;
+  std::string chunk;
+  uint64_t sequence;
+
+  ScopedArena arena;
+  if (data->ngrams) {
+    LocalInterner interner(*data->ngrams->words, arena.resource());
+    NgramCountMap local_counts(arena.resource());
+    while (data->chunks->pop(chunk, &sequence)) {
+      ChunkEdges edges;
+      count_chunk_ngrams(data->policy, chunk.data(), chunk.size(), data->ngrams->n, interner, local_counts, edges);
+      std::lock_guard<std::mutex> lock(*data->merge_mutex);
+      if (data->edges->size() <= sequence) {
+        data->edges->resize(sequence + 1);
+      }
+      (*data->edges)[sequence] = std::move(edges);
+    }
+    std::lock_guard<std::mutex> lock(*data->merge_mutex);
+    for (const auto &pair : local_counts) {
+      data->ngrams->counts[pair.first] += pair.second;
+    }
+    return nullptr;
+  }
+
+  ArenaCountMap local_word_count(arena.resource());
+  while (data->chunks->pop(chunk)) {
+    for_each_word(data->policy, chunk.data(), chunk.size(), [&](const std::string &word) { local_word_count.add(word); });
+  }
+
+  std::lock_guard<std::mutex> lock(*data->merge_mutex);
+  local_word_count.merge_into(*data->word_count_map);
+  return nullptr;
+}
+
+bool count_stream(int fd, int num_threads, size_t chunk_size, std::unordered_map<std::string, uint64_t> &word_count_map,
+                  uint64_t *bytes_read, WordPolicy policy,
+                  NgramCounts *ngrams) {
+  // A larger pipe buffer lets the writer run further ahead of our reads
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+  } else {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  StringQueue chunks(2 * num_threads);
+  std::mutex merge_mutex;
+  std::vector<ChunkEdges> edges;
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<ChunkCountData> thread_data(num_threads);
+  int started = 0;
+  for (int i = 0; i < num_threads; i++) {
+    thread_data[i] = {&chunks, &word_count_map, &merge_mutex, policy, ngrams, &edges};
+    if (pthread_create(&threads[i], nullptr, count_chunks_worker, &thread_data[i]) != 0) {
+      break; // Run with the workers that did start
+    }
+    started++;
+  }
+  std::unique_ptr<ByteSource> source = started > 0 ? open_input_source(fd, num_threads) : nullptr;
+  bool ok = false;
+  if (source) {
+    ok = read_chunks(*source, chunks, chunk_size, bytes_read);
+  } else {
+    chunks.close();
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  if (ngrams) {
+    count_crossing_ngrams(edges, ngrams->n, ngrams->counts);
+  }
+  return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Public API (wordfreq.h)
+// ---------------------------------------------------------------------------
+
+namespace wordfreq {
+
+struct CountTable::Impl {
+  std::unordered_map<std::string, uint64_t> counts; // 64-bit, as tables grow across many buffers
+  uint64_t total = 0;
+};
+
+CountTable::CountTable() : impl_(new Impl) {}
+CountTable::~CountTable() = default;
+CountTable::CountTable(const CountTable &other) : impl_(new Impl(*other.impl_)) {}
+CountTable::CountTable(CountTable &&other) noexcept : impl_(std::move(other.impl_)) { other.impl_.reset(new Impl); }
+
+CountTable &CountTable::operator=(const CountTable &other) {
+  *impl_ = *other.impl_;
+  return *this;
+}
+
+CountTable &CountTable::operator=(CountTable &&other) noexcept {
+  std::swap(impl_, other.impl_);
+  return *this;
+}
+
+uint64_t CountTable::count(std::string_view word) const {
+  auto it = impl_->counts.find(std::string(word));
+  return it == impl_->counts.end() ? 0 : it->second;
+}
+
+size_t CountTable::size() const { return impl_->counts.size(); }
+
+uint64_t CountTable::total() const { return impl_->total; }
+
+void CountTable::add(std::string_view word, uint64_t count) {
+  impl_->counts[std::string(word)] += count;
+  impl_->total += count;
+}
+
+void CountTable::merge(const CountTable &other) {
+  if (impl_->counts.empty()) {
+    *impl_ = *other.impl_;
+    return;
+  }
+  for (const auto &pair : other.impl_->counts) {
+    impl_->counts[pair.first] += pair.second;
+  }
+  impl_->total += other.impl_->total;
+}
+
+void CountTable::clear() { *impl_ = Impl(); }
+
+void CountTable::for_each(const std::function<void(std::string_view word, uint64_t count)> &callback) const {
+  for (const auto &pair : impl_->counts) {
+    callback(pair.first, pair.second);
+  }
+}
+
+std::vector<std::pair<std::string, uint64_t>> CountTable::top(size_t k) const {
+  TopWords top_words(k);
+  for (const auto &pair : impl_->counts) {
+    top_words.offer(pair.first, pair.second);
+  }
+  return top_words.sorted();
+}
+
+bool CountTable::save(const std::string &path) const {
+  std::vector<const std::pair<const std::string, uint64_t> *> entries;
+  entries.reserve(impl_->counts.size());
+  for (const auto &pair : impl_->counts) {
+    entries.push_back(&pair);
+  }
+  std::sort(entries.begin(), entries.end(), [](const auto *a, const auto *b) { return a->first < b->first; });
+
+  std::string temp_path = path + ".tmp";
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    set_last_error("Error creating " + temp_path + ": " + strerror(errno));
+    return false;
+  }
+  CountTableWriter writer;
+  bool ok = writer.open(fd, true);
+  for (size_t i = 0; ok && i < entries.size(); i++) {
+    writer.add(entries[i]->first, entries[i]->second);
+  }
+  ok = ok && writer.finish();
+  close(fd);
+  if (ok && rename(temp_path.c_str(), path.c_str()) == -1) {
+    set_last_error("Error renaming " + temp_path + ": " + strerror(errno));
+    ok = false;
+  }
+  if (!ok) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CountTable::load(const std::string &path) {
+  CountTableView view;
+  if (!view.open(path, MADV_SEQUENTIAL)) {
+    return false;
+  }
+  Impl loaded;
+  loaded.counts.reserve(view.size());
+  for (uint64_t i = 0; i < view.size(); i++) {
+    loaded.counts.emplace(view.word(i), view.count(i));
+    loaded.total += view.count(i);
+  }
+  *impl_ = std::move(loaded);
+  return true;
+}
+
+struct TopK::Impl {
+  TopWords top_words;
+
+  explicit Impl(size_t k) : top_words(k) {}
+};
+
+TopK::TopK(size_t k) : impl_(new Impl(k)) {}
+TopK::~TopK() = default;
+TopK::TopK(TopK &&other) noexcept = default;
+TopK &TopK::operator=(TopK &&other) noexcept = default;
+
+void TopK::offer(std::string_view word, uint64_t count) { impl_->top_words.offer(word, count); }
+
+void TopK::offer(const CountTable &table) {
+  table.for_each([&](std::string_view word, uint64_t count) { impl_->top_words.offer(word, count); });
+}
+
+std::vector<std::pair<std::string, uint64_t>> TopK::sorted() const { return impl_->top_words.sorted(); }
+
+Engine::Engine(const Options &options) : options_(options) {
+  options_.threads = std::max(1, std::min(options_.threads, MAX_ENGINE_THREADS));
+}
+
+// Function to add a count map from the engine to a table's counts; an empty
+// table takes the map over instead of copying it
+static void add_counts(std::unordered_map<std::string, uint64_t> &word_count_map,
+                       std::unordered_map<std::string, uint64_t> &counts, uint64_t &total) {
+  for (const auto &pair : word_count_map) {
+    total += pair.second;
+  }
+  if (counts.empty()) {
+    counts = std::move(word_count_map);
+    return;
+  }
+  for (const auto &pair : word_count_map) {
+    counts[pair.first] += pair.second;
+  }
+}
+
+bool Engine::count(std::string_view text, CountTable &table) const {
+  // Tokenizer and Backend list their values in the order of WordPolicy and CountBackend
+  std::unordered_map<std::string, uint64_t> word_count_map;
+  if (!count_text_multi_thread(text, word_count_map, (WordPolicy)options_.tokenizer, (CountBackend)options_.backend,
+                               options_.hot_cache_entries, nullptr, nullptr, nullptr, options_.threads,
+                               options_.chunk_size)) {
+    return false;
+  }
+  add_counts(word_count_map, table.impl_->counts, table.impl_->total);
+  return true;
+}
+
+bool Engine::count(const std::vector<std::string_view> &segments, CountTable &table) const {
+  std::unordered_map<std::string, uint64_t> word_count_map;
+  if (!count_segments_multi_thread(segments, word_count_map, (WordPolicy)options_.tokenizer,
+                                   (CountBackend)options_.backend, options_.hot_cache_entries, nullptr, nullptr,
+                                   nullptr, options_.threads, options_.chunk_size)) {
+    return false;
+  }
+  add_counts(word_count_map, table.impl_->counts, table.impl_->total);
+  return true;
+}
+
+bool Engine::count(const struct iovec *iov, int iovcnt, CountTable &table) const {
+  std::vector<std::string_view> segments;
+  segments.reserve(std::max(0, iovcnt));
+  for (int i = 0; i < iovcnt; i++) {
+    segments.emplace_back((const char *)iov[i].iov_base, iov[i].iov_len);
+  }
+  return count(segments, table);
+}
+
+bool Engine::count_file(const std::string &path, CountTable &table) const {
+  std::string content;
+  return read_input_file(path, content) && count(content, table);
+}
+
+const std::string &last_error() {
+  return ::last_error();
+}
+
+} // namespace wordfreq
+
+struct wf_engine {
+  wordfreq::Engine engine;
+};
+
+struct wf_table {
+  wordfreq::CountTable table;
+};
+
+void wf_options_init(wf_options *options) {
+  wordfreq::Options defaults;
+  options->tokenizer = (int)defaults.tokenizer;
+  options->backend = (int)defaults.backend;
+  options->threads = defaults.threads;
+  options->chunk_size = defaults.chunk_size;
+  options->hot_cache_entries = defaults.hot_cache_entries;
+}
+
+wf_engine *wf_engine_new(const wf_options *options) {
+  wordfreq::Options engine_options;
+  if (options != nullptr) {
+    if (options->tokenizer < WF_TOKENIZER_LETTERS || options->tokenizer > WF_TOKENIZER_APOSTROPHE ||
+        options->backend < WF_BACKEND_LOCAL_MAP || options->backend > WF_BACKEND_ART) {
+      return nullptr;
+    }
+    engine_options.tokenizer = (wordfreq::Tokenizer)options->tokenizer;
+    engine_options.backend = (wordfreq::Backend)options->backend;
+    engine_options.threads = options->threads;
+    engine_options.chunk_size = options->chunk_size;
+    engine_options.hot_cache_entries = options->hot_cache_entries;
+  }
+  try {
+    return new wf_engine{wordfreq::Engine(engine_options)};
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void wf_engine_free(wf_engine *engine) { delete engine; }
+
+int wf_count_buffer(const wf_engine *engine, const char *data, size_t size, wf_table *table) {
+  try {
+    return engine->engine.count(std::string_view(data, size), table->table) ? 0 : -1;
+  } catch (...) {
+    return -1;
+  }
+}
+
+int wf_count_iovec(const wf_engine *engine, const struct iovec *iov, int iovcnt, wf_table *table) {
+  if (iovcnt < 0) {
+    return -1;
+  }
+  try {
+    return engine->engine.count(iov, iovcnt, table->table) ? 0 : -1;
+  } catch (...) {
+    return -1;
+  }
+}
+
+int wf_count_file(const wf_engine *engine, const char *path, wf_table *table) {
+  try {
+    return engine->engine.count_file(path, table->table) ? 0 : -1;
+  } catch (...) {
+    return -1;
+  }
+}
+
+wf_table *wf_table_new(void) {
+  try {
+    return new wf_table;
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+wf_table *wf_table_load(const char *path) {
+  try {
+    std::unique_ptr<wf_table> table(new wf_table);
+    return table->table.load(path) ? table.release() : nullptr;
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void wf_table_free(wf_table *table) { delete table; }
+
+uint64_t wf_table_count(const wf_table *table, const char *word, size_t length) {
+  try {
+    return table->table.count(std::string_view(word, length));
+  } catch (...) {
+    return 0;
+  }
+}
+
+size_t wf_table_size(const wf_table *table) { return table->table.size(); }
+
+uint64_t wf_table_total(const wf_table *table) { return table->table.total(); }
+
+int wf_table_merge(wf_table *table, const wf_table *other) {
+  try {
+    table->table.merge(other->table);
+    return 0;
+  } catch (...) {
+    return -1;
+  }
+}
+
+const char *wf_last_error(void) {
+  return last_error().c_str();
+}
+
+int wf_table_save(const wf_table *table, const char *path) {
+  try {
+    return table->table.save(path) ? 0 : -1;
+  } catch (...) {
+    return -1;
+  }
+}
+
+size_t wf_table_top(const wf_table *table, size_t k, wf_entry *entries) {
+  // Point the entries at the table's own keys, which stay put until the table changes
+  auto better = [](const std::pair<std::string_view, uint64_t> &a, const std::pair<std::string_view, uint64_t> &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  };
+  std::vector<std::pair<std::string_view, uint64_t>> top; // Heap with the weakest entry on top
+  try {
+    table->table.for_each([&](std::string_view word, uint64_t count) {
+      top.emplace_back(word, count);
+      std::push_heap(top.begin(), top.end(), better);
+      if (top.size() > k) {
+        std::pop_heap(top.begin(), top.end(), better);
+        top.pop_back();
+      }
+    });
+  } catch (...) {
+    return 0;
+  }
+  std::sort_heap(top.begin(), top.end(), better);
+  for (size_t i = 0; i < top.size(); i++) {
+    entries[i] = {top[i].first.data(), top[i].first.size(), top[i].second};
+  }
+  return top.size();
+}
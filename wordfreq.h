@@ -0,0 +1,187 @@
+// libwordfreq: word counting engine for embedding, with a C++ API and a C ABI.
+// Build by compiling wordfreq.cpp (with the same WORDFREQ_HAVE_* flags as the
+// tool) and linking with -pthread.
+#ifndef WORDFREQ_H
+#define WORDFREQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace wordfreq {
+
+// Which bytes form words
+enum class Tokenizer {
+  LETTERS,    // Unicode letters in UTF-8, case folded
+  ASCII,      // ASCII letters only, lower cased
+  ALNUM,      // Unicode letters and ASCII digits
+  APOSTROPHE, // Unicode letters with inner apostrophes ("don't")
+};
+
+// Which table the counting threads share or merge
+enum class Backend {
+  LOCAL_MAP, // A hash map per thread, merged under a lock
+  INTERNED,  // Words interned to IDs, counted in per-thread arrays
+  SHARDED,   // One shared map split into locked shards
+  LOCKFREE,  // One shared lock-free open-addressing table
+  ART,       // An adaptive radix tree per thread, merged by subtree
+};
+
+// Upper bound on Options::threads; engines clamp larger values to it
+const int MAX_ENGINE_THREADS = 256;
+
+struct Options {
+  Tokenizer tokenizer = Tokenizer::LETTERS;
+  Backend backend = Backend::LOCAL_MAP;
+  int threads = 4;              // Clamped to 1..MAX_ENGINE_THREADS
+  size_t chunk_size = 0;        // Bytes per work chunk; 0 gives one part per thread
+  size_t hot_cache_entries = 0; // Per-thread hot-word cache slots; 0 disables the cache
+};
+
+// Word counts; counting into a table adds to what it already holds
+class CountTable {
+public:
+  CountTable();
+  ~CountTable();
+  CountTable(const CountTable &other);
+  CountTable(CountTable &&other) noexcept;
+  CountTable &operator=(const CountTable &other);
+  CountTable &operator=(CountTable &&other) noexcept;
+
+  uint64_t count(std::string_view word) const;
+  size_t size() const;   // Distinct words
+  uint64_t total() const; // Sum of all counts
+  void add(std::string_view word, uint64_t count);
+  void merge(const CountTable &other);
+  void clear();
+  void for_each(const std::function<void(std::string_view word, uint64_t count)> &callback) const;
+
+  // The k most frequent words, by count and then alphabetically
+  std::vector<std::pair<std::string, uint64_t>> top(size_t k) const;
+
+  // Save as a binary count table (.wfct), or replace the contents with one
+  bool save(const std::string &path) const;
+  bool load(const std::string &path);
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+
+  friend class Engine;
+};
+
+// Bounded selection of the most frequent words from a stream of counts
+class TopK {
+public:
+  explicit TopK(size_t k);
+  ~TopK();
+  TopK(TopK &&other) noexcept;
+  TopK &operator=(TopK &&other) noexcept;
+
+  void offer(std::string_view word, uint64_t count);
+  void offer(const CountTable &table);
+  std::vector<std::pair<std::string, uint64_t>> sorted() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// Counts words with a fixed set of options; an engine holds no other state,
+// so one engine may be used from several threads at once
+class Engine {
+public:
+  explicit Engine(const Options &options = Options());
+
+  const Options &options() const { return options_; }
+
+  // Count the words of text into table. The text is counted in place. The
+  // count functions return false, leaving table unchanged, if the counting
+  // threads cannot be started.
+  bool count(std::string_view text, CountTable &table) const;
+
+  // Count the words of a text held in several segments, such as network
+  // buffers or decompressed blocks, as if they were one buffer. Segments are
+  // not joined; only words straddling a segment boundary are copied.
+  bool count(const std::vector<std::string_view> &segments, CountTable &table) const;
+  bool count(const struct iovec *iov, int iovcnt, CountTable &table) const;
+
+  // Count the words of a file, decompressing it if needed; returns false if
+  // the file cannot be read or counted
+  bool count_file(const std::string &path, CountTable &table) const;
+
+private:
+  Options options_;
+};
+
+// Why the last failed call on the calling thread failed, e.g. a missing file or
+// a corrupt table. The library never prints; callers report this themselves.
+const std::string &last_error();
+
+} // namespace wordfreq
+
+extern "C" {
+#endif
+
+// C ABI. Functions returning int give 0 on success and -1 on failure, and
+// constructors return NULL on failure.
+typedef struct wf_engine wf_engine;
+typedef struct wf_table wf_table;
+
+enum { WF_TOKENIZER_LETTERS, WF_TOKENIZER_ASCII, WF_TOKENIZER_ALNUM, WF_TOKENIZER_APOSTROPHE };
+enum { WF_BACKEND_LOCAL_MAP, WF_BACKEND_INTERNED, WF_BACKEND_SHARDED, WF_BACKEND_LOCKFREE, WF_BACKEND_ART };
+
+typedef struct wf_options {
+  int tokenizer;
+  int backend;
+  int threads;
+  size_t chunk_size;
+  size_t hot_cache_entries;
+} wf_options;
+
+// A word and its count; word points into the table and is not NUL-terminated
+typedef struct wf_entry {
+  const char *word;
+  size_t length;
+  uint64_t count;
+} wf_entry;
+
+void wf_options_init(wf_options *options);
+
+wf_engine *wf_engine_new(const wf_options *options); // NULL options for the defaults
+void wf_engine_free(wf_engine *engine);
+
+int wf_count_buffer(const wf_engine *engine, const char *data, size_t size, wf_table *table);
+int wf_count_iovec(const wf_engine *engine, const struct iovec *iov, int iovcnt, wf_table *table);
+int wf_count_file(const wf_engine *engine, const char *path, wf_table *table);
+
+wf_table *wf_table_new(void);
+wf_table *wf_table_load(const char *path);
+void wf_table_free(wf_table *table);
+uint64_t wf_table_count(const wf_table *table, const char *word, size_t length);
+size_t wf_table_size(const wf_table *table);
+uint64_t wf_table_total(const wf_table *table);
+int wf_table_merge(wf_table *table, const wf_table *other);
+int wf_table_save(const wf_table *table, const char *path);
+
+// Message of the last failure on the calling thread; valid until its next call
+// into the library
+const char *wf_last_error(void);
+
+// Fills entries with up to k most frequent words and returns how many it wrote;
+// the words stay valid until the table is next changed or freed
+size_t wf_table_top(const wf_table *table, size_t k, wf_entry *entries);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WORDFREQ_H
@@ -0,0 +1,2457 @@
+#ifndef WORDFREQ_INTERNAL_H
+#define WORDFREQ_INTERNAL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/resource.h> 
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <mutex>
+#include <iomanip>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Define constants
+const int MAX_THREADS = 4;
+
+// Function to record why a call failed. Library code never prints: a function
+// that fails sets the message and returns false (or null), and the caller
+// reports last_error() as it sees fit. Like errno, the message is per thread.
+void set_last_error(const std::string &message);
+
+// Function to get the message of the last failure on the calling thread
+const std::string &last_error();
+
+// Reads a whole input file, decompressing it if needed (defined with the byte sources)
+bool read_input_file(const std::string &path, std::string &content);
+
+// ---------------------------------------------------------------------------
+// Tokenizer
+//
+// Words are maximal runs of letters, folded to lower case. Input is UTF-8:
+// ASCII letters and the Unicode letters (and combining marks) of the common
+// scripts join words, while everything else, including bytes that are not
+// valid UTF-8, separates them. Runs of 16 bytes without a high bit are
+// classified by a plain ASCII loop so English text pays nothing for UTF-8.
+// ---------------------------------------------------------------------------
+
+struct CodepointRange {
+  uint32_t first;
+  uint32_t last;
+};
+
+// Letters and combining marks outside ASCII, sorted (approximates Unicode L* and Mn)
+const CodepointRange UNICODE_LETTER_RANGES[] = {
+    {0x00AA, 0x00AA},   {0x00B5, 0x00B5},   {0x00BA, 0x00BA},   {0x00C0, 0x00D6},   {0x00D8, 0x00F6},
+    {0x00F8, 0x02C1},   {0x02C6, 0x02D1},   {0x02E0, 0x02E4},   {0x02EC, 0x02EC},   {0x02EE, 0x02EE},
+    {0x0300, 0x0374},   {0x0376, 0x0377},   {0x037A, 0x037D},   {0x037F, 0x037F},   {0x0386, 0x0386},
+    {0x0388, 0x038A},   {0x038C, 0x038C},   {0x038E, 0x03A1},   {0x03A3, 0x03F5},   {0x03F7, 0x0481},
+    {0x0483, 0x0487},   {0x048A, 0x052F},   {0x0531, 0x0556},   {0x0559, 0x0559},   {0x0560, 0x0588},
+    {0x0591, 0x05BD},   {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},   {0x05C7, 0x05C7},
+    {0x05D0, 0x05EA},   {0x05EF, 0x05F2},   {0x0610, 0x061A},   {0x0620, 0x065F},   {0x066E, 0x06D3},
+    {0x06D5, 0x06DC},   {0x06DF, 0x06E8},   {0x06EA, 0x06EF},   {0x06FA, 0x06FC},   {0x06FF, 0x06FF},
+    {0x0900, 0x0963},   {0x0971, 0x09E3},   {0x09F0, 0x09F1},   {0x0A01, 0x0A63},   {0x0A70, 0x0A75},
+    {0x0A81, 0x0AE3},   {0x0B01, 0x0B63},   {0x0B82, 0x0BD7},   {0x0C00, 0x0C63},   {0x0C80, 0x0CE3},
+    {0x0D00, 0x0D63},   {0x0E01, 0x0E3A},   {0x0E40, 0x0E4E},   {0x10A0, 0x10FF},   {0x1100, 0x11FF},
+    {0x1200, 0x135F},   {0x1C80, 0x1C88},   {0x1E00, 0x1FBC},   {0x1FC2, 0x1FCC},   {0x1FD0, 0x1FDB},
+    {0x1FE0, 0x1FEC},   {0x1FF2, 0x1FFC},   {0x2C60, 0x2C7F},   {0x2D00, 0x2D25},   {0x2DE0, 0x2DFF},
+    {0x3041, 0x3096},   {0x3099, 0x309F},   {0x30A1, 0x30FA},   {0x30FC, 0x30FF},   {0x3400, 0x4DBF},
+    {0x4E00, 0x9FFF},   {0xA640, 0xA69F},   {0xA720, 0xA7FF},   {0xAB30, 0xAB6F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFF21, 0xFF3A},   {0xFF41, 0xFF5A},   {0xFF66, 0xFF9F},   {0x20000, 0x2FA1F},
+};
+
+// Function to tell whether a non-ASCII code point is part of a word
+bool is_unicode_letter(uint32_t codepoint);
+
+// Function to apply simple case folding to a non-ASCII code point (the 1:1
+// mappings of Latin, Greek, Cyrillic, Armenian, Georgian and fullwidth forms)
+uint32_t fold_case(uint32_t c);
+
+// Function to decode one UTF-8 sequence; returns its length, or 0 if the bytes
+// are not valid UTF-8 (overlong forms and surrogates are rejected)
+size_t decode_utf8(const unsigned char *s, size_t available, uint32_t &codepoint);
+
+// Function to append a code point to a string as UTF-8
+void append_utf8(std::string &out, uint32_t codepoint);
+
+// Function to count words of the default policy one byte (or UTF-8 sequence) at
+// a time; the naive reference the counting engines are checked against
+std::unordered_map<std::string, int> count_words_reference(const std::string &text);
+
+// Function to check whether 16 bytes are all ASCII
+inline bool is_ascii_block(const char *p) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)) == 0;
+#else
+  uint64_t a, b;
+  memcpy(&a, p, 8);
+  memcpy(&b, p + 8, 8);
+  return ((a | b) & 0x8080808080808080ULL) == 0;
+#endif
+}
+
+// Byte classes used by the classification tables
+enum CharClass : uint8_t {
+  CHAR_SEPARATOR = 0,
+  CHAR_WORD = 1,
+  CHAR_UTF8 = 2 // Start or continuation of a multi-byte sequence, decoded separately
+};
+
+// 256-entry class and lower-case fold tables, built at compile time per policy
+struct CharTable {
+  uint8_t cls[256];
+  char fold[256];
+};
+
+template <typename IsWord>
+constexpr CharTable make_char_table(IsWord is_word, bool unicode) {
+  CharTable table{};
+  for (int c = 0; c < 256; c++) {
+    table.cls[c] = c >= 0x80 ? (unicode ? CHAR_UTF8 : CHAR_SEPARATOR) : is_word(c) ? CHAR_WORD : CHAR_SEPARATOR;
+    table.fold[c] = (char)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+  }
+  return table;
+}
+
+constexpr bool is_ascii_letter(int c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+constexpr bool is_ascii_digit(int c) { return c >= '0' && c <= '9'; }
+
+// Word policies: which bytes form words, whether UTF-8 letters count, and which
+// character is trimmed from both ends of a word (0 for none).
+
+// ASCII and Unicode letters (the default)
+struct LettersPolicy {
+  static constexpr CharTable table = make_char_table(is_ascii_letter, true);
+  static constexpr char trim = 0;
+};
+
+// ASCII letters only; every byte above 127 is a separator
+struct AsciiLettersPolicy {
+  static constexpr CharTable table = make_char_table(is_ascii_letter, false);
+  static constexpr char trim = 0;
+};
+
+// Letters and digits
+struct AlnumPolicy {
+  static constexpr CharTable table = make_char_table([](int c) { return is_ascii_letter(c) || is_ascii_digit(c); }, true);
+  static constexpr char trim = 0;
+};
+
+// Letters with inner apostrophes ("don't", "o'clock"); quotes around words are dropped
+struct ApostrophePolicy {
+  static constexpr CharTable table = make_char_table([](int c) { return is_ascii_letter(c) || c == '\''; }, true);
+  static constexpr char trim = '\'';
+};
+
+// Letters plus a custom set of ASCII characters, e.g. CustomPolicy<'-', '_'>
+template <char... Extra>
+struct CustomPolicy {
+  static_assert(((Extra != ' ' && Extra != '\t' && Extra != '\n' && Extra != '\r') && ...),
+                "whitespace delimits chunks and cannot be a word character");
+  static constexpr CharTable table = make_char_table([](int c) { return is_ascii_letter(c) || ((c == Extra) || ...); }, true);
+  static constexpr char trim = 0;
+};
+
+// Runtime names for the built-in policies
+enum class WordPolicy { LETTERS, ASCII, ALNUM, APOSTROPHE };
+
+// Function to parse a --words value; returns false for unknown names
+bool parse_word_policy(const std::string &name, WordPolicy &policy);
+
+// Function to call emit(word) for every lowercase word in text
+template <typename Policy = LettersPolicy, typename Emit>
+void for_each_word(const char *text, size_t length, Emit &&emit) {
+  constexpr const CharTable &table = Policy::table;
+  const unsigned char *s = (const unsigned char *)text;
+  std::string word;
+  size_t i = 0;
+
+  auto flush = [&]() {
+    if (Policy::trim != 0) {
+      size_t first = word.find_first_not_of(Policy::trim);
+      size_t last = word.find_last_not_of(Policy::trim);
+      if (first == std::string::npos) {
+        word.clear();
+        return;
+      }
+      if (first > 0 || last + 1 < word.size()) {
+        word = word.substr(first, last + 1 - first);
+      }
+    }
+    emit(word);
+    word.clear();
+  };
+  auto ascii_byte = [&](unsigned char c) {
+    if (table.cls[c] == CHAR_WORD) {
+      word += table.fold[c];
+    } else if (!word.empty()) {
+      flush();
+    }
+  };
+
+  while (i < length) {
+    if (length - i >= 16 && is_ascii_block(text + i)) {
+      for (size_t end = i + 16; i < end; i++) {
+        ascii_byte(s[i]);
+      }
+      continue;
+    }
+    if (table.cls[s[i]] != CHAR_UTF8) {
+      ascii_byte(s[i++]);
+      continue;
+    }
+    uint32_t codepoint;
+    size_t sequence_length = decode_utf8(s + i, length - i, codepoint);
+    if (sequence_length > 0 && is_unicode_letter(codepoint)) {
+      append_utf8(word, fold_case(codepoint));
+    } else if (!word.empty()) {
+      flush();
+    }
+    i += sequence_length > 0 ? sequence_length : 1;
+  }
+  if (!word.empty()) {
+    flush();
+  }
+}
+
+// Function to dispatch a runtime policy to the matching instantiation
+template <typename Emit>
+void for_each_word(WordPolicy policy, const char *text, size_t length, Emit &&emit) {
+  switch (policy) {
+  case WordPolicy::ASCII:
+    for_each_word<AsciiLettersPolicy>(text, length, emit);
+    break;
+  case WordPolicy::ALNUM:
+    for_each_word<AlnumPolicy>(text, length, emit);
+    break;
+  case WordPolicy::APOSTROPHE:
+    for_each_word<ApostrophePolicy>(text, length, emit);
+    break;
+  default:
+    for_each_word<LettersPolicy>(text, length, emit);
+    break;
+  }
+}
+
+// Function to tell whether text may be cut after this byte. Only ASCII whitespace
+// qualifies: it separates words under every policy and can never fall inside a
+// multi-byte UTF-8 sequence.
+inline bool is_split_byte(char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v'; }
+
+// Function to find where the trailing partial word of a chunk starts (0 if the
+// chunk has no whitespace at all)
+size_t last_word_boundary(const char *text, size_t length);
+
+// ---------------------------------------------------------------------------
+// Word interning
+//
+// Each distinct word gets a dense 32-bit ID, so counting becomes an array
+// increment and merging per-thread results adds integer vectors instead of
+// rehashing strings. The dictionary is split into shards chosen by word hash,
+// each with its own lock, and IDs come from a single atomic counter. The
+// ID -> word table is a list of doubling segments that never move, so looking
+// up a word by ID takes no lock.
+// ---------------------------------------------------------------------------
+
+// Dictionary from words to dense IDs, shared by all threads of one count
+class ConcurrentInterner {
+public:
+  ConcurrentInterner() {
+    for (auto &segment : segments_) {
+      segment.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~ConcurrentInterner() {
+    for (auto &segment : segments_) {
+      delete[] segment.load(std::memory_order_relaxed);
+    }
+  }
+
+  ConcurrentInterner(const ConcurrentInterner &) = delete;
+  ConcurrentInterner &operator=(const ConcurrentInterner &) = delete;
+
+  // Returns the ID of word, assigning the next free one the first time it is seen
+  uint32_t intern(std::string_view word) {
+    size_t hash = std::hash<std::string_view>()(word);
+    Shard &shard = shards_[(hash >> 32) % SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.ids.find(word);
+    if (it != shard.ids.end()) {
+      return it->second;
+    }
+    uint32_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    const std::string &stored = shard.words.emplace_back(word);
+    // Published under the shard lock: any thread that learns this ID from the
+    // shard, or after joining this one, also sees the slot
+    publish(id, &stored);
+    shard.ids.emplace(stored, id);
+    return id;
+  }
+
+  // Word for an ID previously returned by intern
+  const std::string &word(uint32_t id) const {
+    uint32_t offset;
+    int segment = segment_of(id, offset);
+    return *segments_[segment].load(std::memory_order_acquire)[offset];
+  }
+
+  // Number of IDs handed out so far
+  uint32_t size() const { return next_id_.load(std::memory_order_acquire); }
+
+private:
+  static const int SHARDS = 64;
+  static const uint32_t FIRST_SEGMENT = 1024; // Segment k holds FIRST_SEGMENT << k IDs
+  static const int SEGMENTS = 23;             // Enough segments to cover every 32-bit ID
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string_view, uint32_t> ids; // Keys point into words
+    std::deque<std::string> words;                      // Never relocates its elements
+  };
+
+  // Function to locate an ID in the segment list
+  static int segment_of(uint32_t id, uint32_t &offset) {
+    uint64_t bucket = id / FIRST_SEGMENT + 1;
+    int segment = 63 - __builtin_clzll(bucket);
+    offset = id - FIRST_SEGMENT * ((1U << segment) - 1);
+    return segment;
+  }
+
+  // Function to store the word of a new ID, allocating its segment on first use
+  void publish(uint32_t id, const std::string *word) {
+    uint32_t offset;
+    int k = segment_of(id, offset);
+    const std::string **segment = segments_[k].load(std::memory_order_acquire);
+    if (segment == nullptr) {
+      auto *fresh = new const std::string *[(size_t)FIRST_SEGMENT << k]();
+      if (segments_[k].compare_exchange_strong(segment, fresh, std::memory_order_acq_rel)) {
+        segment = fresh;
+      } else {
+        delete[] fresh; // Another shard allocated it first
+      }
+    }
+    segment[offset] = word;
+  }
+
+  Shard shards_[SHARDS];
+  std::atomic<uint32_t> next_id_{0};
+  std::atomic<const std::string **> segments_[SEGMENTS];
+};
+
+// Per-thread cache in front of the shared interner so repeated words skip the shard
+// locks. Keys are views of the interner's own copies, so the cache stores no strings;
+// its nodes and buckets come from resource, normally the thread's arena.
+struct LocalInterner {
+  ConcurrentInterner &shared;
+  std::pmr::unordered_map<std::string_view, uint32_t> cache;
+
+  explicit LocalInterner(ConcurrentInterner &interner,
+                         std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : shared(interner), cache(resource) {}
+
+  uint32_t intern(std::string_view word) {
+    auto it = cache.find(word);
+    if (it != cache.end()) {
+      return it->second;
+    }
+    uint32_t id = shared.intern(word);
+    cache.emplace(shared.word(id), id);
+    return id;
+  }
+};
+
+// Storage used by process_file_multi_thread for the per-thread counts
+enum class CountBackend {
+  LOCAL_MAP, // A string-keyed hash map per thread, merged under a lock
+  INTERNED,  // Words interned to IDs; an integer array per thread, merged by addition
+  SHARDED,   // One ShardedCountMap shared by all threads, no merge
+  LOCKFREE,  // One LockFreeCountMap shared by all threads, no merge
+  ART,       // An ArtCounts radix tree per thread, merged in parallel by subtree
+};
+
+// Function to parse a --backend argument
+bool parse_count_backend(const std::string &name, CountBackend &backend);
+
+// Function to turn ID-indexed counts back into a word-keyed map
+template <typename Count = int, typename IdCount>
+std::unordered_map<std::string, Count> id_counts_to_map(const ConcurrentInterner &words,
+                                                        const std::vector<IdCount> &counts) {
+  std::unordered_map<std::string, Count> word_count_map;
+  word_count_map.reserve(counts.size());
+  for (uint32_t id = 0; id < counts.size(); id++) {
+    if (counts[id] != 0) {
+      word_count_map.emplace(words.word(id), (Count)counts[id]);
+    }
+  }
+  return word_count_map;
+}
+
+// ---------------------------------------------------------------------------
+// Shared counting tables
+//
+// Alternatives to giving every thread a private map and merging the maps under
+// a lock: all threads count straight into one table. That saves the
+// merge and the per-thread copies of the vocabulary, at the price of
+// cross-thread traffic on hot words.
+// ---------------------------------------------------------------------------
+
+// Function to back off inside a spin loop; yields after a while so a
+// preempted lock holder can run when there are more threads than cores
+inline void spin_wait(int &spins) {
+  if (++spins < 64) {
+#ifdef __SSE2__
+    _mm_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+// Reader/writer spinlock in one word: the top bit marks a writer, the rest count readers
+class RwSpinLock {
+public:
+  void lock_shared() {
+    int spins = 0;
+    for (;;) {
+      uint32_t state = state_.load(std::memory_order_relaxed);
+      if ((state & WRITER) == 0 &&
+          state_.compare_exchange_weak(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+        return;
+      }
+      spin_wait(spins);
+    }
+  }
+
+  void unlock_shared() { state_.fetch_sub(1, std::memory_order_release); }
+
+  void lock() {
+    int spins = 0;
+    for (;;) {
+      uint32_t state = 0;
+      if (state_.compare_exchange_weak(state, WRITER, std::memory_order_acquire, std::memory_order_relaxed)) {
+        return;
+      }
+      spin_wait(spins);
+    }
+  }
+
+  void unlock() { state_.store(0, std::memory_order_release); }
+
+private:
+  static const uint32_t WRITER = 1U << 31;
+  std::atomic<uint32_t> state_{0};
+};
+
+// Word count table shared by all threads and split into cache-line-padded shards.
+// Counting a word already in its shard takes only the shared lock plus an atomic
+// add, so threads contend only when they insert into the same shard.
+class ShardedCountMap {
+public:
+  explicit ShardedCountMap(size_t num_shards = 256) : shards_(new Shard[num_shards]), num_shards_(num_shards) {}
+
+  void add(const std::string &word, uint64_t count = 1) {
+    size_t hash = std::hash<std::string>()(word);
+    Shard &shard = shards_[(hash >> 32) % num_shards_];
+
+    shard.lock.lock_shared();
+    auto it = shard.counts.find(word);
+    if (it != shard.counts.end()) {
+      it->second.fetch_add(count, std::memory_order_relaxed);
+      shard.lock.unlock_shared();
+      return;
+    }
+    shard.lock.unlock_shared();
+
+    // New word: inserting may rehash the shard, so take it exclusively
+    shard.lock.lock();
+    shard.counts.try_emplace(word, 0).first->second.fetch_add(count, std::memory_order_relaxed);
+    shard.lock.unlock();
+  }
+
+  // Function to copy the counts out once every thread has finished adding
+  template <typename Count = int>
+  std::unordered_map<std::string, Count> to_map() const {
+    std::unordered_map<std::string, Count> word_count_map;
+    for (size_t i = 0; i < num_shards_; i++) {
+      for (const auto &pair : shards_[i].counts) {
+        word_count_map.emplace(pair.first, (Count)pair.second.load(std::memory_order_relaxed));
+      }
+    }
+    return word_count_map;
+  }
+
+private:
+  struct alignas(64) Shard {
+    RwSpinLock lock;
+    std::unordered_map<std::string, std::atomic<uint64_t>> counts; // Nodes never move, so counts can be bumped under the shared lock
+  };
+
+  std::unique_ptr<Shard[]> shards_;
+  size_t num_shards_;
+};
+
+// Word count table shared by all threads without locks. Slots are claimed by
+// CAS on a pointer to an immutable key record and counts are bumped with a
+// relaxed fetch_add, so hot words cost one atomic add and never wait.
+//
+// Growing is cooperative. When a table is half full a twice-as-large one is
+// linked as its successor. Every thread that runs into the full table then
+// migrates a chunk of slots before moving on. Migrating a slot either seals it
+// if it is empty or freezes its count with fetch_or(FROZEN) and re-adds the
+// frozen value to the successor. An increment whose fetch_add returns a frozen
+// value landed after the copy, so it is retried in the successor. Because
+// counts are only ever added, a word may be counted in the successor before
+// its old slot is copied. Retired tables and key records are freed only by
+// the destructor, so no reader ever touches freed memory.
+class LockFreeCountMap {
+public:
+  explicit LockFreeCountMap(size_t initial_capacity = 1 << 12) {
+    size_t capacity = 64;
+    while (capacity < initial_capacity) {
+      capacity <<= 1;
+    }
+    head_ = new Table(capacity);
+    current_.store(head_, std::memory_order_relaxed);
+  }
+
+  ~LockFreeCountMap() {
+    for (Table *table = head_; table != nullptr;) {
+      Table *next = table->next.load(std::memory_order_relaxed);
+      delete table;
+      table = next;
+    }
+    for (KeyRecord *record = records_.load(std::memory_order_relaxed); record != nullptr;) {
+      KeyRecord *next = record->next_allocated;
+      free(record);
+      record = next;
+    }
+  }
+
+  LockFreeCountMap(const LockFreeCountMap &) = delete;
+  LockFreeCountMap &operator=(const LockFreeCountMap &) = delete;
+
+  void add(std::string_view word, uint64_t count = 1) {
+    uint64_t hash = std::hash<std::string_view>()(word);
+    KeyRecord *fresh = nullptr; // Allocated on the first empty slot, kept across retries
+    Table *table = current_.load(std::memory_order_acquire);
+    while (!try_add(table, hash, word, nullptr, count, fresh)) {
+      table = moved_to(table);
+    }
+    free(fresh); // Lost every race to an equal key, so never published
+  }
+
+  // Function to copy the counts out once every thread has finished adding;
+  // completes any migration the counting threads left unfinished
+  template <typename Count = int>
+  std::unordered_map<std::string, Count> to_map() {
+    Table *table = current_.load(std::memory_order_acquire);
+    while (table->next.load(std::memory_order_acquire) != nullptr) {
+      while (migrate_chunk(table)) {
+      }
+      table = current_.load(std::memory_order_acquire);
+    }
+
+    std::unordered_map<std::string, Count> word_count_map;
+    for (size_t i = 0; i < table->capacity; i++) {
+      KeyRecord *key = table->slots[i].key.load(std::memory_order_relaxed);
+      uint64_t count = table->slots[i].count.load(std::memory_order_relaxed) & ~FROZEN;
+      if (key != nullptr && key != SEALED && count != 0) {
+        word_count_map.emplace(std::string(key->data, key->length), (Count)count);
+      }
+    }
+    return word_count_map;
+  }
+
+private:
+  static const uint64_t FROZEN = 1ULL << 63;
+  static const size_t MIGRATE_CHUNK = 1024;
+
+  struct KeyRecord {
+    KeyRecord *next_allocated; // Ownership list, walked by the destructor
+    uint64_t hash;
+    uint32_t length;
+    char data[];
+  };
+
+  struct Slot {
+    std::atomic<KeyRecord *> key{nullptr};
+    std::atomic<uint64_t> count{0};
+  };
+
+  struct Table {
+    size_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> used{0};
+    std::atomic<Table *> next{nullptr};
+    std::atomic<size_t> chunks_claimed{0};
+    std::atomic<size_t> chunks_done{0};
+    std::atomic<bool> migrated{false};
+
+    explicit Table(size_t capacity) : capacity(capacity), slots(new Slot[capacity]) {}
+  };
+
+  // Marks empty slots of a table being migrated, so inserts move on to its successor
+  static inline KeyRecord *const SEALED = reinterpret_cast<KeyRecord *>(uintptr_t(1));
+
+  static KeyRecord *make_record(uint64_t hash, std::string_view word) {
+    auto *record = (KeyRecord *)malloc(sizeof(KeyRecord) + word.size());
+    record->next_allocated = nullptr;
+    record->hash = hash;
+    record->length = (uint32_t)word.size();
+    memcpy(record->data, word.data(), word.size());
+    return record;
+  }
+
+  void retain(KeyRecord *record) {
+    record->next_allocated = records_.load(std::memory_order_relaxed);
+    while (!records_.compare_exchange_weak(record->next_allocated, record, std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+    }
+  }
+
+  // Function to add count to a word in one table. existing is the word's record
+  // when migrating, otherwise fresh is allocated on demand. Returns false if the
+  // table is being migrated and the add must be retried in its successor.
+  bool try_add(Table *table, uint64_t hash, std::string_view word, KeyRecord *existing, uint64_t count,
+               KeyRecord *&fresh) {
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Slot &slot = table->slots[i];
+      KeyRecord *key = slot.key.load(std::memory_order_acquire);
+      if (key == nullptr) {
+        if (table->used.load(std::memory_order_relaxed) >= table->capacity / 2) {
+          start_resize(table);
+          return false;
+        }
+        KeyRecord *candidate = existing;
+        if (candidate == nullptr) {
+          if (fresh == nullptr) {
+            fresh = make_record(hash, word);
+          }
+          candidate = fresh;
+        }
+        if (slot.key.compare_exchange_strong(key, candidate, std::memory_order_acq_rel, std::memory_order_acquire)) {
+          if (candidate == fresh) {
+            retain(fresh);
+            fresh = nullptr;
+          }
+          table->used.fetch_add(1, std::memory_order_relaxed);
+          key = candidate;
+        }
+        // On failure key now holds whatever another thread stored
+      }
+      if (key == SEALED) {
+        return false;
+      }
+      if (key->hash == hash && key->length == word.size() && memcmp(key->data, word.data(), word.size()) == 0) {
+        if (slot.count.fetch_add(count, std::memory_order_relaxed) & FROZEN) {
+          std::atomic_thread_fence(std::memory_order_acquire); // Pairs with the freeze, so next is visible
+          return false;
+        }
+        return true;
+      }
+    }
+  }
+
+  // Function to link a successor to a full table; losers of the race free theirs
+  void start_resize(Table *table) {
+    if (table->next.load(std::memory_order_acquire) != nullptr) {
+      return;
+    }
+    Table *expected = nullptr;
+    auto *bigger = new Table(table->capacity * 2);
+    if (!table->next.compare_exchange_strong(expected, bigger, std::memory_order_acq_rel)) {
+      delete bigger;
+    }
+  }
+
+  // Function to help migrate a table that refused an add and return its successor
+  Table *moved_to(Table *table) {
+    migrate_chunk(table);
+    return table->next.load(std::memory_order_acquire);
+  }
+
+  // Function to claim and migrate one chunk of a table's slots; returns false
+  // once every chunk has been claimed
+  bool migrate_chunk(Table *table) {
+    Table *next = table->next.load(std::memory_order_acquire);
+    size_t num_chunks = (table->capacity + MIGRATE_CHUNK - 1) / MIGRATE_CHUNK;
+    size_t chunk = table->chunks_claimed.fetch_add(1, std::memory_order_relaxed);
+    if (chunk >= num_chunks) {
+      return false;
+    }
+
+    size_t end = std::min(table->capacity, (chunk + 1) * MIGRATE_CHUNK);
+    for (size_t i = chunk * MIGRATE_CHUNK; i < end; i++) {
+      Slot &slot = table->slots[i];
+      KeyRecord *key = slot.key.load(std::memory_order_acquire);
+      if (key == nullptr &&
+          slot.key.compare_exchange_strong(key, SEALED, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        continue;
+      }
+      uint64_t count = slot.count.fetch_or(FROZEN, std::memory_order_acq_rel) & ~FROZEN;
+      if (count != 0) {
+        KeyRecord *unused = nullptr;
+        Table *target = next;
+        while (!try_add(target, key->hash, std::string_view(key->data, key->length), key, count, unused)) {
+          target = moved_to(target);
+        }
+      }
+    }
+
+    if (table->chunks_done.fetch_add(1, std::memory_order_acq_rel) + 1 == num_chunks) {
+      table->migrated.store(true, std::memory_order_release);
+      advance_current();
+    }
+    return true;
+  }
+
+  // Function to move current_ past every fully migrated table
+  void advance_current() {
+    Table *table = current_.load(std::memory_order_acquire);
+    while (table->migrated.load(std::memory_order_acquire)) {
+      Table *next = table->next.load(std::memory_order_acquire);
+      if (current_.compare_exchange_strong(table, next, std::memory_order_acq_rel)) {
+        table = next;
+      }
+    }
+  }
+
+  Table *head_;                                // First table; the chain owns every table ever linked
+  std::atomic<Table *> current_;               // Oldest table not yet fully migrated
+  std::atomic<KeyRecord *> records_{nullptr};  // Every published key record
+};
+
+// Word counts in an adaptive radix tree. Words sharing a prefix share nodes,
+// and children are kept in byte order, so the tree iterates in sorted order
+// and answers prefix queries by visiting one subtree. Each node stores up to
+// MAX_PREFIX bytes of compressed path plus the count of the word ending there;
+// inner nodes grow from 4 to 16, 48 and 256 children as needed. The root is
+// always a 256-way node, so trees can be merged in parallel one first-byte
+// subtree per task. Nodes come from resource, which must outlive the tree: the
+// heap by default, or the arena of the one thread that fills the tree.
+class ArtCounts {
+public:
+  explicit ArtCounts(std::pmr::memory_resource *resource = std::pmr::new_delete_resource())
+      : resource_(resource), root_(new_node(NODE256)) {}
+  ~ArtCounts() { destroy(root_); }
+
+  ArtCounts(ArtCounts &&other) noexcept : resource_(other.resource_), root_(other.root_), size_(other.size_) {
+    other.root_ = nullptr;
+    other.size_ = 0;
+  }
+
+  ArtCounts &operator=(ArtCounts &&other) noexcept {
+    std::swap(resource_, other.resource_);
+    std::swap(root_, other.root_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  ArtCounts(const ArtCounts &) = delete;
+  ArtCounts &operator=(const ArtCounts &) = delete;
+
+  void add(std::string_view word, uint64_t count = 1) {
+    if (!word.empty() && add_from(&root_, word, 0, count)) {
+      size_++;
+    }
+  }
+
+  uint64_t count(std::string_view word) const {
+    const Node *node = root_;
+    for (size_t depth = 0;;) {
+      if (node->prefix_length > word.size() - depth ||
+          memcmp(node->prefix, word.data() + depth, node->prefix_length) != 0) {
+        return 0;
+      }
+      depth += node->prefix_length;
+      if (depth == word.size()) {
+        return node->count;
+      }
+      Node *const *child = find_child(node, (uint8_t)word[depth]);
+      if (child == nullptr) {
+        return 0;
+      }
+      node = *child;
+      depth++;
+    }
+  }
+
+  // Number of distinct words
+  size_t size() const { return size_; }
+
+  // Function to call fn(word, count) for every word, in byte order
+  template <typename Fn>
+  void for_each(Fn &&fn) const {
+    std::string key;
+    visit(root_, key, fn);
+  }
+
+  // Function to call fn(word, count) for every word starting with prefix, in byte order
+  template <typename Fn>
+  void for_each_prefix(std::string_view prefix, Fn &&fn) const {
+    const Node *node = root_;
+    for (size_t depth = 0;;) {
+      size_t remaining = prefix.size() - depth;
+      if (memcmp(node->prefix, prefix.data() + depth, std::min<size_t>(node->prefix_length, remaining)) != 0) {
+        return;
+      }
+      if (remaining <= node->prefix_length) {
+        // The prefix ends inside this node, so its whole subtree matches
+        std::string key(prefix.substr(0, depth));
+        visit(node, key, fn);
+        return;
+      }
+      depth += node->prefix_length;
+      Node *const *child = find_child(node, (uint8_t)prefix[depth]);
+      if (child == nullptr) {
+        return;
+      }
+      node = *child;
+      depth++;
+    }
+  }
+
+  // Function to list the most frequent words starting with prefix (autocomplete)
+  std::vector<std::pair<std::string, uint64_t>> complete(std::string_view prefix, size_t top_n) const {
+    std::vector<std::pair<std::string, uint64_t>> matches;
+    for_each_prefix(prefix, [&](const std::string &word, uint64_t count) { matches.emplace_back(word, count); });
+    top_n = std::min(top_n, matches.size());
+    std::partial_sort(matches.begin(), matches.begin() + top_n, matches.end(), [](const auto &a, const auto &b) {
+      return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    matches.resize(top_n);
+    return matches;
+  }
+
+  template <typename Count = int>
+  std::unordered_map<std::string, Count> to_map() const {
+    std::unordered_map<std::string, Count> word_count_map;
+    word_count_map.reserve(size_);
+    for_each([&](const std::string &word, uint64_t count) { word_count_map.emplace(word, (Count)count); });
+    return word_count_map;
+  }
+
+  // Function to merge trees into the first one on num_threads threads. Each
+  // thread owns a disjoint set of first bytes, so no locking is needed. A tree
+  // on an arena cannot take nodes from several threads, so if the first tree
+  // is one, the result is a new tree on the heap instead.
+  static ArtCounts merge(std::vector<ArtCounts> &trees, int num_threads) {
+    if (trees.empty()) {
+      return ArtCounts();
+    }
+    size_t first_tree = trees[0].resource_ == std::pmr::new_delete_resource() ? 1 : 0;
+    ArtCounts result = first_tree == 1 ? std::move(trees[0]) : ArtCounts();
+    num_threads = std::max(1, std::min(num_threads, 256));
+    std::vector<pthread_t> threads(num_threads);
+    std::vector<MergeData> merge_data(num_threads);
+    std::vector<bool> started(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+      merge_data[i] = {&result, &trees, first_tree, i, num_threads, 0};
+      started[i] = pthread_create(&threads[i], nullptr, merge_subtrees, &merge_data[i]) == 0;
+      if (!started[i]) {
+        merge_subtrees(&merge_data[i]); // Out of threads: merge this share here instead
+      }
+    }
+    auto *root = (Node256 *)result.root_;
+    for (int i = 0; i < num_threads; i++) {
+      if (started[i]) {
+        pthread_join(threads[i], nullptr);
+      }
+      result.size_ += merge_data[i].new_words;
+    }
+    root->num_children = 0;
+    for (Node *child : root->children) {
+      root->num_children += child != nullptr;
+    }
+    return result;
+  }
+
+private:
+  static const int MAX_PREFIX = 12; // Fills the node header to 24 bytes
+
+  enum NodeType : uint8_t { LEAF, NODE4, NODE16, NODE48, NODE256 };
+
+  struct Node {
+    uint8_t type;
+    uint8_t prefix_length;
+    uint16_t num_children;
+    char prefix[MAX_PREFIX];
+    uint64_t count; // Occurrences of the word ending after prefix; 0 if none
+  };
+  struct Node4 : Node {
+    uint8_t keys[4]; // Sorted
+    Node *children[4];
+  };
+  struct Node16 : Node {
+    uint8_t keys[16]; // Sorted
+    Node *children[16];
+  };
+  struct Node48 : Node {
+    uint8_t index[256]; // Slot + 1 in children, 0 for none
+    Node *children[48];
+  };
+  struct Node256 : Node {
+    Node *children[256];
+  };
+
+  struct MergeData {
+    ArtCounts *result;
+    std::vector<ArtCounts> *trees;
+    size_t first_tree; // Trees before this one are already in result
+    int first_byte;
+    int stride;
+    uint64_t new_words;
+  };
+
+  static size_t node_size(uint8_t type) {
+    switch (type) {
+    case NODE4:
+      return sizeof(Node4);
+    case NODE16:
+      return sizeof(Node16);
+    case NODE48:
+      return sizeof(Node48);
+    case NODE256:
+      return sizeof(Node256);
+    default:
+      return sizeof(Node);
+    }
+  }
+
+  Node *new_node(NodeType type) {
+    void *memory = resource_->allocate(node_size(type), alignof(Node256));
+    Node *node;
+    switch (type) {
+    case NODE4:
+      node = new (memory) Node4();
+      break;
+    case NODE16:
+      node = new (memory) Node16();
+      break;
+    case NODE48:
+      node = new (memory) Node48();
+      break;
+    case NODE256:
+      node = new (memory) Node256();
+      break;
+    default:
+      node = new (memory) Node();
+      break;
+    }
+    node->type = type;
+    return node;
+  }
+
+  // Nodes are trivially destructible, so only their memory is given back
+  void delete_node(Node *node) { resource_->deallocate(node, node_size(node->type), alignof(Node256)); }
+
+  void destroy(Node *node) {
+    if (node == nullptr) {
+      return;
+    }
+    for_each_child(node, [this](uint8_t, Node *child) { destroy(child); });
+    delete_node(node);
+  }
+
+  // Function to call fn(byte, child) for the children of a node in byte order
+  template <typename Fn>
+  static void for_each_child(const Node *node, Fn &&fn) {
+    switch (node->type) {
+    case NODE4: {
+      auto *n = (const Node4 *)node;
+      for (int i = 0; i < n->num_children; i++) {
+        fn(n->keys[i], n->children[i]);
+      }
+      break;
+    }
+    case NODE16: {
+      auto *n = (const Node16 *)node;
+      for (int i = 0; i < n->num_children; i++) {
+        fn(n->keys[i], n->children[i]);
+      }
+      break;
+    }
+    case NODE48: {
+      auto *n = (const Node48 *)node;
+      for (int byte = 0; byte < 256; byte++) {
+        if (n->index[byte] != 0) {
+          fn((uint8_t)byte, n->children[n->index[byte] - 1]);
+        }
+      }
+      break;
+    }
+    case NODE256: {
+      auto *n = (const Node256 *)node;
+      for (int byte = 0; byte < 256; byte++) {
+        if (n->children[byte] != nullptr) {
+          fn((uint8_t)byte, n->children[byte]);
+        }
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  static Node **find_child(Node *node, uint8_t key) {
+    switch (node->type) {
+    case NODE4: {
+      auto *n = (Node4 *)node;
+      for (int i = 0; i < n->num_children; i++) {
+        if (n->keys[i] == key) {
+          return &n->children[i];
+        }
+      }
+      return nullptr;
+    }
+    case NODE16: {
+      auto *n = (Node16 *)node;
+#ifdef __SSE2__
+      __m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8((char)key), _mm_loadu_si128((const __m128i *)n->keys));
+      int mask = _mm_movemask_epi8(matches) & ((1 << n->num_children) - 1);
+      return mask != 0 ? &n->children[__builtin_ctz(mask)] : nullptr;
+#else
+      for (int i = 0; i < n->num_children; i++) {
+        if (n->keys[i] == key) {
+          return &n->children[i];
+        }
+      }
+      return nullptr;
+#endif
+    }
+    case NODE48: {
+      auto *n = (Node48 *)node;
+      return n->index[key] != 0 ? &n->children[n->index[key] - 1] : nullptr;
+    }
+    case NODE256: {
+      auto *n = (Node256 *)node;
+      return n->children[key] != nullptr ? &n->children[key] : nullptr;
+    }
+    default:
+      return nullptr;
+    }
+  }
+
+  static Node *const *find_child(const Node *node, uint8_t key) { return find_child(const_cast<Node *>(node), key); }
+
+  // Function to replace a full node with the next larger type
+  Node *grow(Node *node) {
+    static const NodeType next_type[] = {NODE4, NODE16, NODE48, NODE256, NODE256};
+    Node *bigger = new_node(next_type[node->type]);
+    bigger->prefix_length = node->prefix_length;
+    memcpy(bigger->prefix, node->prefix, MAX_PREFIX);
+    bigger->count = node->count;
+    // Re-adding the children in byte order keeps the small node types sorted
+    for_each_child(node, [&](uint8_t byte, Node *child) { insert_child(bigger, byte, child); });
+    delete_node(node);
+    return bigger;
+  }
+
+  static bool is_full(const Node *node) {
+    switch (node->type) {
+    case NODE4:
+      return node->num_children == 4;
+    case NODE16:
+      return node->num_children == 16;
+    case NODE48:
+      return node->num_children == 48;
+    case NODE256:
+      return false;
+    default:
+      return true;
+    }
+  }
+
+  // Function to add a child to a node that has room for it
+  static void insert_child(Node *node, uint8_t key, Node *child) {
+    int count = node->num_children;
+    if (node->type == NODE4 || node->type == NODE16) {
+      uint8_t *keys = node->type == NODE4 ? ((Node4 *)node)->keys : ((Node16 *)node)->keys;
+      Node **children = node->type == NODE4 ? ((Node4 *)node)->children : ((Node16 *)node)->children;
+      int pos = 0;
+      while (pos < count && keys[pos] < key) {
+        pos++;
+      }
+      memmove(keys + pos + 1, keys + pos, count - pos);
+      memmove(children + pos + 1, children + pos, (count - pos) * sizeof(Node *));
+      keys[pos] = key;
+      children[pos] = child;
+    } else if (node->type == NODE48) {
+      auto *n = (Node48 *)node;
+      n->children[count] = child; // Children are never removed, so slots fill in order
+      n->index[key] = count + 1;
+    } else {
+      ((Node256 *)node)->children[key] = child;
+    }
+    node->num_children++;
+  }
+
+  void add_child(Node **ref, uint8_t key, Node *child) {
+    if (is_full(*ref)) {
+      *ref = grow(*ref);
+    }
+    insert_child(*ref, key, child);
+  }
+
+  // Function to build the chain of nodes holding word[from..] with its count
+  Node *make_path(std::string_view word, size_t from, uint64_t count) {
+    size_t length = std::min<size_t>(MAX_PREFIX, word.size() - from);
+    bool last = from + length == word.size();
+    Node *node = new_node(last ? LEAF : NODE4);
+    node->prefix_length = (uint8_t)length;
+    memcpy(node->prefix, word.data() + from, length);
+    if (last) {
+      node->count = count;
+    } else {
+      auto *n = (Node4 *)node; // A fresh node has room, so fill its first slot directly
+      n->keys[0] = (uint8_t)word[from + length];
+      n->children[0] = make_path(word, from + length + 1, count);
+      node->num_children = 1;
+    }
+    return node;
+  }
+
+  // Function to add count to word below the node at *ref, which sits at depth;
+  // returns true if the word was not in the tree yet
+  bool add_from(Node **ref, std::string_view word, size_t depth, uint64_t count) {
+    for (;;) {
+      Node *node = *ref;
+      if (node == nullptr) {
+        *ref = make_path(word, depth, count);
+        return true;
+      }
+
+      size_t limit = std::min<size_t>(node->prefix_length, word.size() - depth);
+      size_t match = 0;
+      while (match < limit && node->prefix[match] == word[depth + match]) {
+        match++;
+      }
+      if (match < node->prefix_length) {
+        // The word leaves this node's compressed path: split the path at the mismatch
+        Node *parent = new_node(NODE4);
+        parent->prefix_length = (uint8_t)match;
+        memcpy(parent->prefix, node->prefix, match);
+        uint8_t old_key = (uint8_t)node->prefix[match];
+        node->prefix_length -= match + 1;
+        memmove(node->prefix, node->prefix + match + 1, node->prefix_length);
+        insert_child(parent, old_key, node);
+        *ref = parent;
+        depth += match;
+        if (depth == word.size()) {
+          parent->count = count;
+        } else {
+          insert_child(parent, (uint8_t)word[depth], make_path(word, depth + 1, count));
+        }
+        return true;
+      }
+
+      depth += node->prefix_length;
+      if (depth == word.size()) {
+        bool fresh = node->count == 0;
+        node->count += count;
+        return fresh;
+      }
+      Node **child = find_child(node, (uint8_t)word[depth]);
+      if (child == nullptr) {
+        add_child(ref, (uint8_t)word[depth], make_path(word, depth + 1, count));
+        return true;
+      }
+      ref = child;
+      depth++;
+    }
+  }
+
+  // Function to walk a subtree in byte order; key holds the path above node
+  template <typename Fn>
+  static void visit(const Node *node, std::string &key, Fn &&fn) {
+    size_t base = key.size();
+    key.append(node->prefix, node->prefix_length);
+    if (node->count != 0) {
+      fn(key, node->count);
+    }
+    for_each_child(node, [&](uint8_t byte, const Node *child) {
+      key.push_back((char)byte);
+      visit(child, key, fn);
+      key.pop_back();
+    });
+    key.resize(base);
+  }
+
+  // Thread entry for merge: folds first-byte subtrees of trees[1..] into result
+  static void *merge_subtrees(void *arg) {
+    auto *data = (MergeData *)arg;
+    auto *root = (Node256 *)data->result->root_;
+    for (int byte = data->first_byte; byte < 256; byte += data->stride) {
+      for (size_t t = data->first_tree; t < data->trees->size(); t++) {
+        Node *const *source = find_child((const Node *)(*data->trees)[t].root_, (uint8_t)byte);
+        if (source == nullptr) {
+          continue;
+        }
+        std::string key(1, (char)byte);
+        visit(*source, key, [&](const std::string &word, uint64_t count) {
+          if (data->result->add_from(&root->children[byte], word, 1, count)) {
+            data->new_words++;
+          }
+        });
+      }
+    }
+    return nullptr;
+  }
+
+  std::pmr::memory_resource *resource_;
+  Node *root_;
+  size_t size_ = 0;
+};
+
+// Process-wide totals of the counting arenas, reported with the resource usage
+struct ArenaStats {
+  std::atomic<uint64_t> allocations{0};          // Requests served by arenas
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> upstream_allocations{0}; // Blocks the arenas took from the heap
+  std::atomic<uint64_t> upstream_bytes{0};
+};
+
+extern ArenaStats arena_stats;
+
+// memory_resource that counts the allocations it passes on to upstream
+class CountingResource : public std::pmr::memory_resource {
+public:
+  explicit CountingResource(std::pmr::memory_resource *upstream) : upstream_(upstream) {}
+
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+
+private:
+  void *do_allocate(size_t size, size_t alignment) override {
+    allocations++;
+    bytes += size;
+    return upstream_->allocate(size, alignment);
+  }
+
+  void do_deallocate(void *p, size_t size, size_t alignment) override { upstream_->deallocate(p, size, alignment); }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+  std::pmr::memory_resource *upstream_;
+};
+
+// Arena for the counting state of one thread. Allocations are bumped out of
+// geometrically growing blocks and never freed individually; everything is
+// released in one shot when the arena goes out of scope, at which point its
+// counters are added to arena_stats. Not thread-safe: each thread owns its own.
+class ScopedArena {
+public:
+  explicit ScopedArena(size_t initial_size = 64 << 10)
+      : heap_(std::pmr::new_delete_resource()), monotonic_(initial_size, &heap_), served_(&monotonic_) {}
+
+  ~ScopedArena() {
+    arena_stats.allocations += served_.allocations;
+    arena_stats.bytes += served_.bytes;
+    arena_stats.upstream_allocations += heap_.allocations;
+    arena_stats.upstream_bytes += heap_.bytes;
+  }
+
+  ScopedArena(const ScopedArena &) = delete;
+  ScopedArena &operator=(const ScopedArena &) = delete;
+
+  std::pmr::memory_resource *resource() { return &served_; }
+
+private:
+  CountingResource heap_;                          // What reaches the heap
+  std::pmr::monotonic_buffer_resource monotonic_;
+  CountingResource served_;                        // Everything the counting state asked for
+};
+
+// Word -> count map whose hash nodes, buckets and word bytes all live in an
+// arena. Keys are views of arena copies, so looking up a word already in the
+// map allocates nothing.
+class ArenaCountMap {
+public:
+  explicit ArenaCountMap(std::pmr::memory_resource *arena) : arena_(arena), counts_(arena) {}
+
+  void add(std::string_view word, uint64_t count = 1) {
+    auto it = counts_.find(word);
+    if (it != counts_.end()) {
+      it->second += count;
+      return;
+    }
+    auto *copy = (char *)arena_->allocate(word.size(), 1);
+    memcpy(copy, word.data(), word.size());
+    counts_.emplace(std::string_view(copy, word.size()), count);
+  }
+
+  // Function to add every count to a word-keyed map
+  template <typename Count>
+  void merge_into(std::unordered_map<std::string, Count> &word_count_map) const {
+    for (const auto &pair : counts_) {
+      word_count_map[std::string(pair.first)] += pair.second;
+    }
+  }
+
+  size_t size() const { return counts_.size(); }
+
+private:
+  std::pmr::memory_resource *arena_;
+  std::pmr::unordered_map<std::string_view, uint64_t> counts_;
+};
+
+// ---------------------------------------------------------------------------
+// Per-phase instrumentation
+//
+// With --profile the counting paths time each phase of their work: reading
+// the input, tokenizing, counting, merging per-thread results, selecting the
+// top N and printing. Timers are steady_clock reads at phase boundaries only,
+// and cost a null check when profiling is off. Tokenizing and counting are
+// normally fused in one loop; in profile mode a part is first tokenized into
+// a batch and then counted from it, so the two can be timed apart.
+// ---------------------------------------------------------------------------
+
+enum Phase { PHASE_READ, PHASE_TOKENIZE, PHASE_COUNT, PHASE_MERGE, PHASE_TOP_N, PHASE_OUTPUT, NUM_PHASES };
+
+extern const char *const PHASE_NAMES[NUM_PHASES];
+
+// Hardware events counted per phase with --hw-counters
+enum HwCounter {
+  HW_CYCLES,
+  HW_INSTRUCTIONS,
+  HW_CACHE_MISSES,
+  HW_BRANCH_MISSES,
+  HW_LLC_MISSES,
+  HW_DTLB_MISSES,
+  NUM_HW_COUNTERS
+};
+
+extern const char *const HW_COUNTER_NAMES[NUM_HW_COUNTERS];
+
+// Nanoseconds spent in each phase, plus hardware counts when enabled
+struct PhaseTimes {
+  uint64_t ns[NUM_PHASES] = {};
+  uint64_t counters[NUM_PHASES][NUM_HW_COUNTERS] = {};
+
+  void add(const PhaseTimes &other) {
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+      ns[phase] += other.ns[phase];
+      for (int counter = 0; counter < NUM_HW_COUNTERS; counter++) {
+        counters[phase][counter] += other.counters[phase][counter];
+      }
+    }
+  }
+};
+
+extern bool hw_counters_enabled;
+
+// Function to read the calling thread's hardware counters, scaled up if the
+// group was multiplexed; false if they could not be opened
+bool read_hw_counters(uint64_t values[NUM_HW_COUNTERS]);
+
+// Function to check that the hardware counters can be opened, setting
+// last_error() if not (no PMU, e.g. in many VMs and containers)
+bool hw_counters_available();
+
+// ---------------------------------------------------------------------------
+// Timeline tracing. With --trace, spans for files, chunks and phases are
+// recorded into per-thread ring buffers and written at exit as Chrome trace
+// JSON (chrome://tracing or ui.perfetto.dev). Forked children write their
+// events to TRACE.<pid>, and the parent merges those files into its own.
+// ---------------------------------------------------------------------------
+
+// One completed span, padded to a cache line. Names are copied (and cut to
+// fit) so callers can pass temporaries.
+struct TraceEvent {
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  const char *category; // Static string
+  int32_t tid;
+  char name[36];
+};
+
+extern bool tracing_enabled;
+
+extern std::vector<pid_t> trace_children; // Children whose event files are merged at exit
+
+// Function to read the clock used for trace timestamps
+uint64_t trace_now_ns();
+
+// Function to add a completed span to the calling thread's ring
+void record_trace_event(const TraceEvent &event);
+
+// Function to enable tracing; the trace is written to path by finish_trace
+void start_trace(const std::string &path);
+
+// Function to drop the events inherited from the parent in a forked child
+void trace_after_fork(const std::string &process_name);
+
+// Records the lifetime of the span as one complete event when tracing is on
+class TraceSpan {
+public:
+  TraceSpan(const char *category, std::string_view name) {
+    if (tracing_enabled) {
+      event_.category = category;
+      size_t length = std::min(name.size(), sizeof(event_.name) - 1);
+      memcpy(event_.name, name.data(), length);
+      event_.name[length] = '\0';
+      event_.start_ns = trace_now_ns();
+    }
+  }
+
+  ~TraceSpan() {
+    if (tracing_enabled) {
+      event_.duration_ns = trace_now_ns() - event_.start_ns;
+      event_.tid = syscall(SYS_gettid);
+      record_trace_event(event_);
+    }
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+  TraceEvent event_;
+};
+
+// Adds the lifetime of the timer to one phase, along with the hardware counts
+// of the calling thread when enabled. The span is traced even if times is null.
+class PhaseTimer {
+public:
+  PhaseTimer(PhaseTimes *times, Phase phase) : times_(times), phase_(phase), span_("phase", PHASE_NAMES[phase]) {
+    if (times_ != nullptr) {
+      counting_ = hw_counters_enabled && read_hw_counters(start_counts_);
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~PhaseTimer() {
+    if (times_ != nullptr) {
+      times_->ns[phase_] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start_).count();
+      uint64_t end_counts[NUM_HW_COUNTERS];
+      if (counting_ && read_hw_counters(end_counts)) {
+        for (int counter = 0; counter < NUM_HW_COUNTERS; counter++) {
+          times_->counters[phase_][counter] += end_counts[counter] - start_counts_[counter];
+        }
+      }
+    }
+  }
+
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+  PhaseTimes *times_;
+  Phase phase_;
+  std::chrono::steady_clock::time_point start_;
+  bool counting_ = false;
+  uint64_t start_counts_[NUM_HW_COUNTERS];
+  TraceSpan span_;
+};
+
+// Phase times of one variant run over one file. total holds the work of the
+// calling thread plus the sum over all worker threads; threads holds each
+// worker separately.
+struct PhaseProfile {
+  std::string file;
+  std::string variant;
+  PhaseTimes total{};
+  std::vector<PhaseTimes> threads{};
+};
+
+// Profiles collected by the main thread when --profile is given
+extern bool phase_profiling;
+
+extern std::vector<PhaseProfile> phase_profiles;
+
+// Function to print the collected profiles as a table in milliseconds
+void print_phase_report(std::ostream &out);
+
+// Function to quote a string for JSON output
+std::string json_string(const std::string &text);
+
+// Function to write the collected profiles as JSON, phase times in seconds
+bool write_phase_json(const std::string &path);
+
+// Function to write this process's events as Chrome trace JSON objects, one per line
+void write_trace_events(std::ostream &out);
+
+// Function to write a forked child's events to TRACE.<pid> for the parent to merge
+void write_trace_fragment();
+
+// Function to write the trace file, merging in (and removing) the children's event files
+bool finish_trace();
+
+// Hit counters of the hot-word caches of one count
+struct HotCacheStats {
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+};
+
+// Small direct-mapped per-thread cache that absorbs increments for the most
+// frequent words before they reach the counting table. Natural text is
+// Zipfian, so a few hundred entries catch most increments. Words of up to 16
+// bytes are stored inline, zero-padded, and compared as two 64-bit integers;
+// longer words bypass the cache. Evicted entries and the final contents are
+// passed to a flush callback taking (word, count).
+class HotWordCache {
+public:
+  static const size_t MAX_WORD = 16;
+
+  explicit HotWordCache(size_t entries) {
+    size_t size = 1;
+    while (size < entries) {
+      size <<= 1;
+    }
+    entries_.resize(size);
+    shift_ = 64 - __builtin_ctzll(size);
+  }
+
+  template <typename Flush>
+  void add(const std::string &word, Flush &&flush) {
+    lookups++;
+    size_t length = word.size();
+    if (length > MAX_WORD) {
+      flush(word, 1);
+      return;
+    }
+    uint64_t bytes[2] = {0, 0};
+    memcpy(bytes, word.data(), length);
+    uint64_t hash = (bytes[0] ^ (bytes[1] * 0xff51afd7ed558ccdULL) ^ length) * 0x9e3779b97f4a7c15ULL;
+    Entry &entry = entries_[shift_ == 64 ? 0 : hash >> shift_];
+    if (entry.count != 0 && entry.length == length && entry.bytes[0] == bytes[0] && entry.bytes[1] == bytes[1]) {
+      if (++entry.count == UINT32_MAX) {
+        evict(entry, flush); // Hand the count on before it wraps to the empty marker
+      }
+      hits++;
+      return;
+    }
+    if (entry.count != 0) {
+      evict(entry, flush);
+    }
+    entry.bytes[0] = bytes[0];
+    entry.bytes[1] = bytes[1];
+    entry.length = (uint32_t)length;
+    entry.count = 1;
+  }
+
+  // Function to hand every cached count to flush and empty the cache
+  template <typename Flush>
+  void flush(Flush &&flush) {
+    for (Entry &entry : entries_) {
+      if (entry.count != 0) {
+        evict(entry, flush);
+      }
+    }
+  }
+
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+
+private:
+  struct Entry {
+    uint64_t bytes[2];
+    uint32_t length;
+    uint32_t count; // 0 marks an empty entry
+  };
+
+  template <typename Flush>
+  void evict(Entry &entry, Flush &&flush) {
+    scratch_.assign((const char *)entry.bytes, entry.length);
+    flush(scratch_, (uint64_t)entry.count);
+    entry.count = 0;
+  }
+
+  std::vector<Entry> entries_;
+  int shift_;
+  std::string scratch_; // Reused for evicted words, so flushing does not allocate
+};
+
+// Struct for passing additional arguments to threads. Every field defaults to
+// off, so callers set only what their backend uses, by name.
+struct ThreadData {
+  std::string_view text_part;
+  std::unordered_map<std::string, int> *word_count_map = nullptr;
+  std::unordered_map<std::string, uint64_t> *wide_word_count_map = nullptr; // Set instead for 64-bit counts
+  std::mutex *merge_mutex = nullptr;           // The call's lock for the count maps, id_counts and hot_cache_stats
+  ConcurrentInterner *interner = nullptr;      // INTERNED backend only
+  std::vector<uint64_t> *id_counts = nullptr;  // INTERNED backend only, indexed by word ID
+  ShardedCountMap *shared_counts = nullptr;    // SHARDED backend only
+  LockFreeCountMap *lockfree_counts = nullptr; // LOCKFREE backend only
+  ArtCounts *art_counts = nullptr;             // ART backend only, this thread's own tree
+  size_t hot_cache_entries = 0;                // 0 disables the hot-word cache
+  HotCacheStats *hot_cache_stats = nullptr;
+  PhaseTimes *phase_times = nullptr;           // This thread's phase times in profile mode, else null
+  void *(*worker)(void *) = nullptr;           // Backend body, when started through run_counting_thread
+  struct rusage *usage = nullptr;              // Receives the thread's own resource usage when non-null
+  std::vector<std::string_view> *chunks = nullptr; // When set, the worker runs once per chunk claimed from here
+  std::atomic<size_t> *next_chunk = nullptr;   // Index of the next unclaimed chunk
+};
+
+// Function to pass every word of a thread's part to add(word, count), through a
+// hot-word cache when one is enabled
+template <typename Policy, typename Add>
+void count_part(ThreadData *data, Add &&add) {
+  std::string_view text_part = data->text_part;
+  std::unique_ptr<HotWordCache> cache(data->hot_cache_entries > 0 ? new HotWordCache(data->hot_cache_entries)
+                                                                  : nullptr);
+  auto emit = [&](const std::string &word) {
+    if (cache) {
+      cache->add(word, add);
+    } else {
+      add(word, 1);
+    }
+  };
+
+  // Profile mode: tokenize into a batch of concatenated words first
+  std::string batch;
+  std::vector<size_t> word_ends;
+  if (data->phase_times != nullptr) {
+    PhaseTimer timer(data->phase_times, PHASE_TOKENIZE);
+    for_each_word<Policy>(text_part.data(), text_part.size(), [&](const std::string &word) {
+      batch += word;
+      word_ends.push_back(batch.size());
+    });
+  }
+
+  {
+    PhaseTimer timer(data->phase_times, PHASE_COUNT);
+    if (data->phase_times == nullptr) {
+      for_each_word<Policy>(text_part.data(), text_part.size(), emit);
+    } else {
+      std::string word;
+      size_t start = 0;
+      for (size_t end : word_ends) {
+        word.assign(batch, start, end - start);
+        emit(word);
+        start = end;
+      }
+    }
+    if (cache) {
+      cache->flush(add);
+    }
+  }
+
+  if (cache) {
+    std::lock_guard<std::mutex> lock(*data->merge_mutex);
+    data->hot_cache_stats->lookups += cache->lookups;
+    data->hot_cache_stats->hits += cache->hits;
+  }
+}
+
+// Function to count word frequencies in a portion of the file (multi-threaded)
+template <typename Policy = LettersPolicy>
+void *count_words(void *arg) {
+  auto *data = (ThreadData *)arg;
+
+  ScopedArena arena;
+  ArenaCountMap local_word_count(arena.resource());  // Local map for each thread
+
+  count_part<Policy>(data, [&](const std::string &word, uint64_t count) { local_word_count.add(word, count); });
+
+  // Update the shared word count map with thread-local results
+  PhaseTimer timer(data->phase_times, PHASE_MERGE);     // Includes waiting for the lock
+  std::lock_guard<std::mutex> lock(*data->merge_mutex);  // Lock to prevent data race
+  if (data->wide_word_count_map != nullptr) {
+    local_word_count.merge_into(*data->wide_word_count_map);
+  } else {
+    local_word_count.merge_into(*data->word_count_map);
+  }
+
+  return nullptr;
+}
+
+// Function to count word frequencies in a portion of the file as increments of an
+// array indexed by interned word ID (multi-threaded)
+template <typename Policy = LettersPolicy>
+void *count_words_interned(void *arg) {
+  auto *data = (ThreadData *)arg;
+  ScopedArena arena;
+  LocalInterner interner(*data->interner, arena.resource());
+  std::vector<uint64_t> local_counts; // On the heap: it grows by doubling, which an arena would never give back
+
+  count_part<Policy>(data, [&](const std::string &word, uint64_t count) {
+    uint32_t id = interner.intern(word);
+    if (id >= local_counts.size()) {
+      local_counts.resize(std::max<size_t>(id + 1, local_counts.size() * 2));
+    }
+    local_counts[id] += count;
+  });
+
+  // Merging is a vector addition; no strings are hashed or copied
+  PhaseTimer timer(data->phase_times, PHASE_MERGE);
+  std::lock_guard<std::mutex> lock(*data->merge_mutex);
+  std::vector<uint64_t> &total = *data->id_counts;
+  if (total.size() < local_counts.size()) {
+    total.resize(local_counts.size());
+  }
+  for (size_t id = 0; id < local_counts.size(); id++) {
+    total[id] += local_counts[id];
+  }
+  return nullptr;
+}
+
+// Function to count word frequencies in a portion of the file straight into the
+// shared sharded table (multi-threaded)
+template <typename Policy = LettersPolicy>
+void *count_words_sharded(void *arg) {
+  auto *data = (ThreadData *)arg;
+  count_part<Policy>(data, [&](const std::string &word, uint64_t count) { data->shared_counts->add(word, count); });
+  return nullptr;
+}
+
+// Function to count word frequencies in a portion of the file straight into the
+// shared lock-free table (multi-threaded)
+template <typename Policy = LettersPolicy>
+void *count_words_lockfree(void *arg) {
+  auto *data = (ThreadData *)arg;
+  count_part<Policy>(data, [&](const std::string &word, uint64_t count) { data->lockfree_counts->add(word, count); });
+  return nullptr;
+}
+
+// Function to count word frequencies in a portion of the file into the thread's
+// own radix tree (multi-threaded)
+template <typename Policy = LettersPolicy>
+void *count_words_art(void *arg) {
+  auto *data = (ThreadData *)arg;
+  count_part<Policy>(data, [&](const std::string &word, uint64_t count) { data->art_counts->add(word, count); });
+  return nullptr;
+}
+
+// Thread entry: run the backend worker over the thread's part, or over chunks
+// claimed one at a time from the shared list, then record the CPU time used
+void *run_counting_thread(void *arg);
+
+// Function to split text into num_parts roughly equal parts, moving each cut
+// forward to whitespace so no word (or UTF-8 sequence) is split between threads
+std::vector<std::string_view> split_at_whitespace(std::string_view text, int num_parts);
+
+// Function to split segments that together form one text (an iovec list, say)
+// into word-aligned parts of about part_size bytes. Parts point into the
+// segments; only the words that straddle a segment boundary are copied, into
+// seams, which becomes the last part.
+std::vector<std::string_view> split_segments(const std::vector<std::string_view> &segments, size_t part_size,
+                                             std::string &seams);
+
+// Function to count word-aligned parts on num_threads threads into
+// word_count_map, whose counts are int or uint64_t. With claim_chunks the
+// threads claim parts one at a time; otherwise there must be one part per
+// thread. Returns false if the threads cannot be started.
+template <typename Policy, typename Count>
+bool count_parts_multi_thread(std::vector<std::string_view> &parts, bool claim_chunks, CountBackend backend,
+                              size_t hot_cache_entries, HotCacheStats *hot_cache_stats, PhaseProfile *profile,
+                              std::vector<struct rusage> *thread_usage, int num_threads,
+                              std::unordered_map<std::string, Count> &word_count_map) {
+  static_assert(std::is_same_v<Count, int> || std::is_same_v<Count, uint64_t>, "counts are int or uint64_t");
+  PhaseTimes *main_times = profile != nullptr ? &profile->total : nullptr;
+  std::vector<PhaseTimes> thread_times(profile != nullptr ? num_threads : 0);
+  std::vector<std::string_view> *chunks = claim_chunks ? &parts : nullptr;
+  std::atomic<size_t> next_chunk{0};
+
+  std::vector<pthread_t> threads(num_threads);
+  std::unordered_map<std::string, Count> total_word_count;
+  std::mutex merge_mutex; // Local to the call, so concurrent calls do not share a lock
+  std::vector<uint64_t> id_counts;
+  std::deque<ScopedArena> art_arenas(backend == CountBackend::ART ? num_threads : 0); // One per thread's tree
+  std::vector<ArtCounts> art_counts;
+  for (ScopedArena &arena : art_arenas) {
+    art_counts.emplace_back(arena.resource());
+  }
+  // Shared tables are sizeable (64 to 256 shards), so only the chosen backend's is built
+  std::optional<ConcurrentInterner> interner;
+  std::optional<ShardedCountMap> shared_counts;
+  std::optional<LockFreeCountMap> lockfree_counts;
+  if (backend == CountBackend::INTERNED) {
+    interner.emplace();
+  } else if (backend == CountBackend::SHARDED) {
+    shared_counts.emplace();
+  } else if (backend == CountBackend::LOCKFREE) {
+    lockfree_counts.emplace();
+  }
+  HotCacheStats cache_stats;
+  std::vector<struct rusage> usage(num_threads);
+  std::vector<ThreadData> thread_data(num_threads);
+  void *(*worker)(void *) = count_words<Policy>;
+  if (backend == CountBackend::INTERNED) {
+    worker = count_words_interned<Policy>;
+  } else if (backend == CountBackend::SHARDED) {
+    worker = count_words_sharded<Policy>;
+  } else if (backend == CountBackend::LOCKFREE) {
+    worker = count_words_lockfree<Policy>;
+  } else if (backend == CountBackend::ART) {
+    worker = count_words_art<Policy>;
+  }
+
+  int started = 0;
+  for (int i = 0; i < num_threads; i++) {
+    ThreadData &data = thread_data[i];
+    data.text_part = chunks ? std::string_view() : parts[i];
+    data.merge_mutex = &merge_mutex;
+    data.interner = interner ? &*interner : nullptr;
+    data.id_counts = &id_counts;
+    data.shared_counts = shared_counts ? &*shared_counts : nullptr;
+    data.lockfree_counts = lockfree_counts ? &*lockfree_counts : nullptr;
+    data.art_counts = art_counts.empty() ? nullptr : &art_counts[i];
+    data.hot_cache_entries = hot_cache_entries;
+    data.hot_cache_stats = &cache_stats;
+    data.phase_times = thread_times.empty() ? nullptr : &thread_times[i];
+    data.worker = worker;
+    data.usage = &usage[i];
+    data.chunks = chunks;
+    data.next_chunk = &next_chunk;
+    if constexpr (std::is_same_v<Count, int>) {
+      data.word_count_map = &total_word_count;
+    } else {
+      data.wide_word_count_map = &total_word_count;
+    }
+    int error = pthread_create(&threads[i], NULL, run_counting_thread, (void *)&thread_data[i]);
+    if (error != 0) {
+      set_last_error(std::string("Error creating counting threads: ") + strerror(error));
+      break;
+    }
+    started++;
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  if (started < num_threads) {
+    return false;
+  }
+  if (hot_cache_stats != nullptr) {
+    *hot_cache_stats = cache_stats;
+  }
+  if (thread_usage != nullptr) {
+    *thread_usage = usage;
+  }
+  if (profile != nullptr) {
+    for (const PhaseTimes &times : thread_times) {
+      profile->total.add(times);
+    }
+    profile->threads = thread_times;
+  }
+
+  // Backends without a per-thread merge build the result map here
+  PhaseTimer timer(backend == CountBackend::LOCAL_MAP ? nullptr : main_times, PHASE_MERGE);
+  if (backend == CountBackend::INTERNED) {
+    word_count_map = id_counts_to_map<Count>(*interner, id_counts);
+  } else if (backend == CountBackend::SHARDED) {
+    word_count_map = shared_counts->to_map<Count>();
+  } else if (backend == CountBackend::LOCKFREE) {
+    word_count_map = lockfree_counts->to_map<Count>();
+  } else if (backend == CountBackend::ART) {
+    word_count_map = ArtCounts::merge(art_counts, num_threads).to_map<Count>();
+  } else {
+    word_count_map = std::move(total_word_count);
+  }
+  return true;
+}
+
+// Function to count text on several threads. By default the text is split
+// into one part per thread; with chunk_size > 0 it is split into word-aligned
+// chunks of about that many bytes, which the threads claim one at a time.
+template <typename Policy, typename Count>
+bool count_text_multi_thread(std::string_view text, std::unordered_map<std::string, Count> &word_count_map,
+                             CountBackend backend = CountBackend::LOCAL_MAP,
+                             size_t hot_cache_entries = 0,
+                             HotCacheStats *hot_cache_stats = nullptr,
+                             PhaseProfile *profile = nullptr,
+                             std::vector<struct rusage> *thread_usage = nullptr,
+                             int num_threads = MAX_THREADS, size_t chunk_size = 0) {
+  std::vector<std::string_view> parts;
+  {
+    PhaseTimer timer(profile != nullptr ? &profile->total : nullptr, PHASE_READ); // Splitting counts as reading
+    int num_parts = chunk_size > 0 ? std::max<size_t>(1, text.size() / chunk_size) : num_threads;
+    parts = split_at_whitespace(text, num_parts);
+  }
+  return count_parts_multi_thread<Policy>(parts, chunk_size > 0, backend, hot_cache_entries, hot_cache_stats, profile,
+                                          thread_usage, num_threads, word_count_map);
+}
+
+// Function to count a text given as several segments, without joining them.
+// The segments are cut into chunks of chunk_size bytes (by default an equal
+// share per thread), which the threads claim one at a time.
+template <typename Policy, typename Count>
+bool count_segments_multi_thread(const std::vector<std::string_view> &segments,
+                                 std::unordered_map<std::string, Count> &word_count_map,
+                                 CountBackend backend = CountBackend::LOCAL_MAP,
+                                 size_t hot_cache_entries = 0,
+                                 HotCacheStats *hot_cache_stats = nullptr,
+                                 PhaseProfile *profile = nullptr,
+                                 std::vector<struct rusage> *thread_usage = nullptr,
+                                 int num_threads = MAX_THREADS, size_t chunk_size = 0) {
+  std::string seams;
+  std::vector<std::string_view> parts;
+  {
+    PhaseTimer timer(profile != nullptr ? &profile->total : nullptr, PHASE_READ);
+    size_t total_size = 0;
+    for (std::string_view segment : segments) {
+      total_size += segment.size();
+    }
+    size_t part_size = chunk_size > 0 ? chunk_size : std::max<size_t>(1, total_size / num_threads);
+    parts = split_segments(segments, part_size, seams);
+  }
+  return count_parts_multi_thread<Policy>(parts, true, backend, hot_cache_entries, hot_cache_stats, profile,
+                                          thread_usage, num_threads, word_count_map);
+}
+
+// Function to dispatch a runtime policy to the matching instantiation; defined
+// for int and uint64_t counts
+template <typename Count>
+bool count_segments_multi_thread(const std::vector<std::string_view> &segments,
+                                 std::unordered_map<std::string, Count> &word_count_map,
+                                 WordPolicy policy = WordPolicy::LETTERS,
+                                 CountBackend backend = CountBackend::LOCAL_MAP,
+                                 size_t hot_cache_entries = 0,
+                                 HotCacheStats *hot_cache_stats = nullptr,
+                                 PhaseProfile *profile = nullptr,
+                                 std::vector<struct rusage> *thread_usage = nullptr,
+                                 int num_threads = MAX_THREADS, size_t chunk_size = 0);
+
+// Function to dispatch a runtime policy to the matching instantiation; defined
+// for int and uint64_t counts
+template <typename Count>
+bool count_text_multi_thread(std::string_view text, std::unordered_map<std::string, Count> &word_count_map,
+                             WordPolicy policy = WordPolicy::LETTERS,
+                             CountBackend backend = CountBackend::LOCAL_MAP,
+                             size_t hot_cache_entries = 0,
+                             HotCacheStats *hot_cache_stats = nullptr,
+                             PhaseProfile *profile = nullptr,
+                             std::vector<struct rusage> *thread_usage = nullptr,
+                             int num_threads = MAX_THREADS, size_t chunk_size = 0);
+
+// Function to count files into one radix tree: each file is counted on
+// MAX_THREADS threads into per-thread trees, which are all merged by subtree.
+// Files that cannot be read are skipped, with their messages added to errors.
+ArtCounts count_files_art(const std::vector<std::string> &files, std::vector<std::string> *errors = nullptr);
+
+// Function to extract the top N most frequent words
+std::vector<std::pair<std::string, int>> get_top_frequent_words(const std::unordered_map<std::string, int> &word_count_map, int top_n = 10,
+                                                                PhaseTimes *times = nullptr);
+std::vector<std::pair<std::string, uint64_t>> get_top_frequent_words(const std::unordered_map<std::string, uint64_t> &word_count_map,
+                                                                     int top_n = 10, PhaseTimes *times = nullptr);
+
+// ---------------------------------------------------------------------------
+// N-gram counting
+//
+// Words are interned to dense 32-bit IDs and an n-gram is keyed by its tuple
+// of IDs, so hashing and storing a trigram costs three integers rather than a
+// concatenated string. Text split across threads or chunks is stitched back
+// together: each chunk records its first and last n-1 word IDs, and the
+// n-grams that cross chunk boundaries are counted afterwards in chunk order.
+// ---------------------------------------------------------------------------
+
+const int MAX_NGRAM = 5;
+
+// An n-gram as a tuple of word IDs; unused trailing slots stay zero
+struct NgramKey {
+  uint32_t ids[MAX_NGRAM];
+
+  bool operator==(const NgramKey &other) const { return memcmp(ids, other.ids, sizeof(ids)) == 0; }
+};
+
+struct NgramKeyHash {
+  size_t operator()(const NgramKey &key) const {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    for (uint32_t id : key.ids) {
+      hash = (hash ^ id) * 0xff51afd7ed558ccdULL;
+      hash ^= hash >> 32;
+    }
+    return hash;
+  }
+};
+
+// Per-thread maps are built on the thread's arena; merged totals use the heap
+typedef std::pmr::unordered_map<NgramKey, int, NgramKeyHash> NgramCountMap;
+
+// N-gram counts together with the dictionary their IDs refer to
+struct NgramCounts {
+  int n = 2;
+  std::unique_ptr<ConcurrentInterner> words{new ConcurrentInterner};
+  NgramCountMap counts;
+};
+
+// First and last n-1 word IDs of a chunk, for counting n-grams that cross into it
+struct ChunkEdges {
+  std::vector<uint32_t> head;
+  std::vector<uint32_t> tail;
+  uint64_t words = 0;
+};
+
+// Function to count the n-grams that lie entirely inside one chunk
+template <typename Policy = LettersPolicy>
+void count_chunk_ngrams(const char *text, size_t length, int n, LocalInterner &interner, NgramCountMap &counts,
+                        ChunkEdges &edges) {
+  uint32_t recent[MAX_NGRAM]; // Ring buffer of the last n word IDs
+  uint64_t seen = 0;
+  for_each_word<Policy>(text, length, [&](const std::string &word) {
+    uint32_t id = interner.intern(word);
+    if (edges.head.size() + 1 < (size_t)n) {
+      edges.head.push_back(id);
+    }
+    recent[seen % n] = id;
+    seen++;
+    if (seen >= (uint64_t)n) {
+      NgramKey key{};
+      for (int k = 0; k < n; k++) {
+        key.ids[k] = recent[(seen - n + k) % n];
+      }
+      counts[key]++;
+    }
+  });
+
+  edges.words = seen;
+  edges.tail.clear();
+  for (uint64_t k = seen - std::min<uint64_t>(seen, n - 1); k < seen; k++) {
+    edges.tail.push_back(recent[k % n]);
+  }
+}
+
+// Function to dispatch a runtime policy to the matching count_chunk_ngrams instantiation
+void count_chunk_ngrams(WordPolicy policy, const char *text, size_t length, int n, LocalInterner &interner,
+                        NgramCountMap &counts, ChunkEdges &edges);
+
+// Function to count the n-grams that span chunk boundaries; chunks must be in text order
+void count_crossing_ngrams(const std::vector<ChunkEdges> &chunks, int n, NgramCountMap &counts);
+
+// Struct for passing n-gram arguments to threads
+struct NgramThreadData {
+  std::string_view text_part;
+  int n;
+  ConcurrentInterner *words;
+  NgramCountMap *total_counts;
+  std::mutex *merge_mutex; // Guards total_counts
+  ChunkEdges *edges;
+};
+
+// Function to count n-grams in a portion of the file (multi-threaded)
+template <typename Policy = LettersPolicy>
+void *count_ngrams(void *arg) {
+  auto *data = (NgramThreadData *)arg;
+  ScopedArena arena;
+  LocalInterner interner(*data->words, arena.resource());
+  NgramCountMap local_counts(arena.resource());
+  count_chunk_ngrams<Policy>(data->text_part.data(), data->text_part.size(), data->n, interner, local_counts,
+                             *data->edges);
+
+  std::lock_guard<std::mutex> lock(*data->merge_mutex);
+  for (const auto &pair : local_counts) {
+    (*data->total_counts)[pair.first] += pair.second;
+  }
+  return nullptr;
+}
+
+// Function to render an n-gram as space-separated words
+std::string ngram_text(const NgramCounts &ngrams, const NgramKey &key);
+
+// Function to render all n-grams as a string-keyed map (for display and comparisons)
+std::unordered_map<std::string, int> ngram_string_counts(const NgramCounts &ngrams);
+
+// Function to extract the top N most frequent n-grams, rendering only those
+std::vector<std::pair<std::string, int>> get_top_ngrams(const NgramCounts &ngrams, size_t top_n = 10);
+
+// ---------------------------------------------------------------------------
+// Binary count table format (.wfct)
+//
+// A table is written once and then used in place through mmap:
+//
+//   header | string pool | offsets[n + 1] | counts[n] | hash[buckets] | rank[n]
+//
+// Words are stored sorted and concatenated in the string pool; offsets[i] is
+// the start of word i in the pool. Counts are fixed-width u64 so any entry can
+// be read in O(1). The optional hash section is an open-addressing table of
+// (word index + 1) for O(1) lookups, and the optional rank section lists word
+// indices from most to least frequent so top(N) needs no sort. Sections are
+// 8-byte aligned and integers use host byte order (the magic doubles as a
+// byte order check).
+// ---------------------------------------------------------------------------
+
+const char COUNT_TABLE_MAGIC[4] = {'W', 'F', 'C', 'T'};
+
+const uint32_t COUNT_TABLE_VERSION = 1;
+
+const uint32_t COUNT_TABLE_HAS_HASH = 1;
+
+const uint32_t COUNT_TABLE_HAS_RANK = 2;
+
+struct CountTableHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t reserved;
+  uint64_t num_words;
+  uint64_t total_count;
+  uint64_t pool_offset;
+  uint64_t pool_size;
+  uint64_t offsets_offset;
+  uint64_t counts_offset;
+  uint64_t hash_offset;
+  uint64_t hash_buckets; // Power of two, 0 without a hash section
+  uint64_t rank_offset;
+};
+
+// FNV-1a hash used by the table's hash section
+uint64_t hash_word(std::string_view word);
+
+// Streaming writer: words must be added in strictly increasing order. The
+// offsets and counts are staged in temporary files so that writing (or merging
+// into) a table larger than memory never holds more than the hash/rank index.
+struct CountTableWriter {
+  FILE *out = nullptr;
+  FILE *offsets = nullptr;
+  FILE *counts = nullptr;
+  bool with_index = false;
+  bool failed = false;
+  uint64_t num_words = 0;
+  uint64_t total_count = 0;
+  uint64_t pool_size = 0;
+  std::string last_word;
+  std::vector<uint64_t> hashes;      // Only kept when building the hash/rank index
+  std::vector<uint64_t> index_counts;
+
+  CountTableWriter() = default;
+  CountTableWriter(const CountTableWriter &) = delete;
+  CountTableWriter &operator=(const CountTableWriter &) = delete;
+  ~CountTableWriter() { close_files(); }
+
+  // Start writing to fd (the writer takes ownership of a duplicate of it)
+  bool open(int fd, bool index);
+
+  // Add the next word, which must sort after the previous one
+  void add(std::string_view word, uint64_t count);
+
+  // Write the index and the header; false if any write failed
+  bool finish();
+
+private:
+  // Function to write to the output or a side file; the first failure is
+  // reported and fails the whole table
+  void put(FILE *file, const void *data, size_t bytes);
+
+  // Pad the output with zeros to the next 8-byte boundary
+  void pad_to_alignment(uint64_t &position);
+
+  // Copy a staged side file to the end of the output; returns bytes copied
+  uint64_t append_file(FILE *side);
+
+  void close_files();
+};
+
+// Read-only view of a count table, usually mmap'ed straight from a file
+struct CountTableView {
+  static const uint64_t npos = UINT64_MAX;
+
+  const char *base = nullptr;
+  size_t length = 0;
+  CountTableHeader header{};
+  const char *pool = nullptr;
+  const uint64_t *offsets = nullptr;
+  const uint64_t *counts = nullptr;
+  const uint32_t *hash = nullptr;
+  const uint32_t *rank = nullptr;
+
+  CountTableView() = default;
+  CountTableView(const CountTableView &) = delete;
+  CountTableView &operator=(const CountTableView &) = delete;
+  ~CountTableView() {
+    if (base) {
+      munmap((void *)base, length);
+    }
+  }
+
+  // Map a table from a path; on failure last_error() says why. The advice tells the
+  // kernel how the mapping will be read (MADV_SEQUENTIAL for one-pass merges).
+  bool open(const std::string &path, int advice = MADV_WILLNEED);
+
+  // Map a table from an open descriptor (a file or a memfd)
+  bool map(int fd, int advice = MADV_WILLNEED);
+
+  uint64_t size() const { return header.num_words; }
+
+  std::string_view word(uint64_t i) const { return std::string_view(pool + offsets[i], offsets[i + 1] - offsets[i]); }
+
+  uint64_t count(uint64_t i) const { return counts[i]; }
+
+  // Index of the first word not less than key
+  uint64_t lower_bound(std::string_view key) const {
+    uint64_t low = 0, high = size();
+    while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      if (word(mid) < key) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    return low;
+  }
+
+  // Index of a word, or npos if it is not in the table
+  uint64_t find(std::string_view key) const {
+    if (hash) {
+      uint64_t mask = header.hash_buckets - 1;
+      uint64_t slot = hash_word(key) & mask;
+      for (uint64_t probes = 0; probes < header.hash_buckets && hash[slot] != 0; probes++) {
+        if (word(hash[slot] - 1) == key) {
+          return hash[slot] - 1;
+        }
+        slot = (slot + 1) & mask;
+      }
+      return npos;
+    }
+    uint64_t i = lower_bound(key);
+    return i < size() && word(i) == key ? i : npos;
+  }
+
+  // Index of the r-th most frequent word (requires the rank section)
+  uint64_t ranked(uint64_t r) const { return rank[r]; }
+
+  // Drop the resident pages of entries before i after a sequential pass over them
+  void release_before(uint64_t i) const;
+};
+
+// Function to write a word count map as a table to fd
+bool write_count_table(int fd, const std::unordered_map<std::string, int> &word_count_map, bool with_index = true);
+
+// Function to save a word count map to a table file; the file is replaced atomically
+bool save_count_table(const std::string &path, const std::unordered_map<std::string, int> &word_count_map);
+
+// Function to k-way merge sorted tables, calling emit(word, summed count) in word
+// order. Each table's pages behind the read position are dropped after about
+// every release_bytes read from it, so a table never holds much more resident.
+void merge_count_tables(const std::vector<const CountTableView *> &tables,
+                        const std::function<void(std::string_view, uint64_t)> &emit, size_t release_bytes = 1 << 20);
+
+// ---------------------------------------------------------------------------
+// Byte sources: plain descriptors and streaming decompressors
+//
+// Compressed inputs are recognised by their magic bytes, not their names, and
+// decompressed on the fly into the tokenizer. Codecs are optional and enabled
+// at build time:
+//
+//   -DWORDFREQ_HAVE_ZLIB -lz   -DWORDFREQ_HAVE_BZIP2 -lbz2   -DWORDFREQ_HAVE_ZSTD -lzstd
+//
+// zstd files made of several frames (zstd -T, pzstd) and BGZF-blocked gzip
+// files (bgzip) carry their frame sizes in the stream, so their frames are
+// decompressed in parallel; everything else is decoded sequentially.
+// ---------------------------------------------------------------------------
+
+// Anything read_chunks can pull bytes from
+struct ByteSource {
+  virtual ~ByteSource() = default;
+  // Read up to length bytes; returns 0 at end of input and -1 on error, with
+  // last_error() set
+  virtual ssize_t read(char *buffer, size_t length) = 0;
+};
+
+enum class Compression { NONE, GZIP, BZIP2, ZSTD };
+
+// Function to recognise a compression format from the first bytes of an input
+Compression detect_compression(const unsigned char *magic, size_t length);
+
+const char *compression_name(Compression compression);
+
+// Function to wrap fd in a source that transparently decompresses it. Regular
+// files whose frames can be located up front are decoded on num_threads threads.
+// The caller keeps ownership of fd.
+std::unique_ptr<ByteSource> open_input_source(int fd, int num_threads = MAX_THREADS);
+
+// ---------------------------------------------------------------------------
+// Chunked input and external-memory counting
+//
+// A reader thread cuts the input into chunks that end on a word boundary
+// (the partial word at the end of a read is carried into the next chunk) and
+// hands them to counting threads through a bounded queue. In spill mode each
+// thread's table is sorted and written to disk as a count table run whenever
+// it outgrows its share of the memory budget; the runs are k-way merged at
+// the end, so memory stays bounded by the budget plus the queued chunks. At
+// most merge_fan_in runs are mapped at once: with more, groups of runs are
+// first merged into longer runs, pass by pass.
+// ---------------------------------------------------------------------------
+
+const size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+// Bounded multi-producer/multi-consumer queue of strings (text chunks or paths)
+struct StringQueue {
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<std::string> items;
+  size_t capacity;
+  bool closed = false;
+  uint64_t popped = 0; // Items handed out so far, i.e. the next item's sequence number
+
+  explicit StringQueue(size_t max_items) : capacity(max_items) {}
+
+  void push(std::string item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [&] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+  }
+
+  // Returns false once the queue is closed and drained. The optional sequence is the
+  // item's position in push order, for consumers that must reassemble the stream.
+  bool pop(std::string &item, uint64_t *sequence = nullptr) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [&] { return !items.empty() || closed; });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    if (sequence) {
+      *sequence = popped;
+    }
+    popped++;
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+};
+
+// Function to read a source to EOF as word-aligned chunks of about chunk_size bytes;
+// the queue is closed when input ends. Returns false on a read error.
+bool read_chunks(ByteSource &source, StringQueue &queue, size_t chunk_size, uint64_t *bytes_read = nullptr);
+
+// Bounded selection of the most frequent words from a stream of entries
+struct TopWords {
+  size_t limit;
+  std::vector<std::pair<std::string, uint64_t>> heap; // Min-heap: weakest entry on top
+
+  explicit TopWords(size_t n) : limit(n) {}
+
+  static bool better(const std::pair<std::string, uint64_t> &a, const std::pair<std::string, uint64_t> &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  }
+
+  void offer(std::string_view word, uint64_t count) {
+    if (heap.size() < limit) {
+      heap.emplace_back(word, count);
+      std::push_heap(heap.begin(), heap.end(), better);
+    } else if (limit > 0 && (count > heap.front().second || (count == heap.front().second && word < heap.front().first))) {
+      std::pop_heap(heap.begin(), heap.end(), better);
+      heap.back() = {std::string(word), count};
+      std::push_heap(heap.begin(), heap.end(), better);
+    }
+  }
+
+  std::vector<std::pair<std::string, uint64_t>> sorted() const {
+    auto result = heap;
+    std::sort(result.begin(), result.end(), better);
+    return result;
+  }
+};
+
+// Shared state for one external-memory counting run
+struct SpillContext {
+  std::string spill_dir;
+  size_t thread_budget;  // Bytes of table a thread may hold before spilling
+  std::mutex runs_mutex;
+  std::vector<std::string> runs;
+  uint64_t bytes_spilled = 0;
+};
+
+// Per-thread arguments for spill_count_worker
+struct SpillThreadData {
+  StringQueue *queue;
+  SpillContext *context;
+  bool failed = false;
+  std::string error; // The thread's last_error() when failed
+};
+
+// Function to estimate the heap footprint of one unordered_map<string, int> entry
+inline size_t estimate_entry_bytes(const std::string &word) {
+  const size_t NODE_BYTES = 72;   // Node with cached hash, plus allocator overhead
+  const size_t BUCKET_BYTES = 8;
+  const size_t SSO_CAPACITY = 15;
+  return NODE_BYTES + BUCKET_BYTES + (word.size() > SSO_CAPACITY ? word.size() + 17 : 0);
+}
+
+// Function to write a thread's table to a new sorted run file and clear it
+bool spill_run(SpillContext &context, std::unordered_map<std::string, int> &word_count_map);
+
+// Thread body: count chunks from the queue, spilling whenever the budget is exceeded
+void *spill_count_worker(void *arg);
+
+// Options for the external command
+struct ExternalOptions {
+  size_t memory_budget = 256 << 20;
+  std::string spill_dir;
+  std::string output;
+  int threads = MAX_THREADS;
+  size_t top_n = 10;
+  size_t chunk_size = DEFAULT_CHUNK_SIZE;
+  size_t merge_fan_in = 64; // Runs mapped at once; more are merged in passes
+};
+
+// What an external count found, and what it spilled on the way
+struct ExternalStats {
+  uint64_t distinct_words = 0;
+  size_t runs = 0;            // Sorted runs written to the spill directory
+  uint64_t bytes_spilled = 0;
+  size_t merge_passes = 0;    // Intermediate passes needed to get down to the fan-in
+};
+
+// Function to count files under a memory budget by spilling sorted runs to disk and
+// merging them; the merged table is written to options.output if set.
+// Returns false on I/O errors, with last_error() set.
+bool count_files_external(const std::vector<std::string> &files, const ExternalOptions &options, TopWords &top,
+                          ExternalStats &stats);
+
+// Per-thread arguments for count_chunks_worker
+struct ChunkCountData {
+  StringQueue *chunks;
+  std::unordered_map<std::string, uint64_t> *word_count_map; // 64-bit, as a stream has no size bound
+  std::mutex *merge_mutex;
+  WordPolicy policy;
+  NgramCounts *ngrams;              // Count n-grams instead of words when set
+  std::vector<ChunkEdges> *edges;   // Per-chunk edges, indexed by sequence number
+};
+
+// Thread body: count word-aligned chunks from the queue, merging once at the end
+void *count_chunks_worker(void *arg);
+
+// Function to count a stream (pipe, socket, stdin) without knowing its size: the
+// calling thread reads word-aligned chunks and num_threads workers count them.
+// Counts are exact because no word is ever split across chunks; with ngrams set,
+// n-grams crossing chunks are stitched together once all chunks are counted.
+bool count_stream(int fd, int num_threads, size_t chunk_size, std::unordered_map<std::string, uint64_t> &word_count_map,
+                  uint64_t *bytes_read = nullptr, WordPolicy policy = WordPolicy::LETTERS,
+                  NgramCounts *ngrams = nullptr);
+
+#endif // WORDFREQ_INTERNAL_H